@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "fs.h"
+
+// Most runs of one workload, and most generator arguments passed through
+#define MAX_RUNS 100000
+#define MAX_GEN_ARGS 64
+
+// Structure sample_t, what one run of a tool cost
+typedef struct {
+	uint64_t ns;
+	uint64_t syscr;
+	uint64_t syscw;
+	uint64_t rchar;
+	uint64_t wchar;
+	uint64_t user_us;
+	uint64_t sys_us;
+	int ok;
+} sample_t;
+
+// Structure bench_file_t, a file found in the generated image
+typedef struct {
+	char *path;
+	uint32_t size;
+} bench_file_t;
+
+// Structure bench_t, the image under test and the files and directories in it
+typedef struct {
+	const char *tools;
+	char *image;
+	bench_file_t *files;
+	long file_count;
+	long file_capacity;
+	char deepest[FS_PATH_MAX];
+	int deepest_level;
+	sample_t *samples;
+	int first;
+} bench_t;
+
+// Function now_ns, returns a monotonic timestamp in nanoseconds
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Function read_proc_io, reads the I/O accounting of an exited child that has not been reaped
+void read_proc_io(pid_t pid,sample_t *sample) {
+	char path[64],key[32];
+	unsigned long long value;
+	snprintf(path,sizeof(path),"/proc/%d/io",(int)pid);
+	FILE *fp = fopen(path,"r");
+	if (!fp) return;
+	while (fscanf(fp,"%31[^:]: %llu\n",key,&value) == 2) {
+		if (!strcmp(key,"syscr")) sample->syscr = value;
+		else if (!strcmp(key,"syscw")) sample->syscw = value;
+		else if (!strcmp(key,"rchar")) sample->rchar = value;
+		else if (!strcmp(key,"wchar")) sample->wchar = value;
+	}
+	fclose(fp);
+	return;
+}
+
+// Function run_tool, runs one tool with its output discarded and records what it cost
+// The child is timed from fork to exit, and its counters are read before it is reaped
+// Returns 1 if the tool exited with status 0, 0 otherwise
+int run_tool(const bench_t *bench,char *const args[],sample_t *sample) {
+	char path[FS_PATH_MAX];
+	snprintf(path,sizeof(path),"%s/%s",bench->tools,args[0]);
+	memset(sample,0,sizeof(sample_t));
+
+	uint64_t start = now_ns();
+	pid_t pid = fork();
+	if (pid < 0) return 0;
+	if (pid == 0) {
+		int null = open("/dev/null",O_WRONLY);
+		if (null >= 0) dup2(null,STDOUT_FILENO);
+		execv(path,args);
+		_exit(127);
+	}
+
+	siginfo_t info;
+	waitid(P_PID,pid,&info,WEXITED | WNOWAIT);
+	sample->ns = now_ns() - start;
+	read_proc_io(pid,sample);
+
+	int status;
+	struct rusage usage;
+	wait4(pid,&status,0,&usage);
+	sample->user_us = usage.ru_utime.tv_sec * 1000000ull + usage.ru_utime.tv_usec;
+	sample->sys_us = usage.ru_stime.tv_sec * 1000000ull + usage.ru_stime.tv_usec;
+	sample->ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	return sample->ok;
+}
+
+// Function collect_file, fs_walk callback that records every file and the deepest directory
+int collect_file(fs_t *fs,const char *path,const dir_entry_t *entry,void *arg) {
+	bench_t *bench = arg;
+	if (entry->status & FS_ENTRY_DIR) {
+		int level = 0;
+		for (const char *p = path; *p; p++) level += *p == '/';
+		if (level > bench->deepest_level && strlen(path) < sizeof(bench->deepest)) {
+			bench->deepest_level = level;
+			strcpy(bench->deepest,path);
+		}
+		return 1;
+	}
+
+	if (bench->file_count == bench->file_capacity) {
+		long capacity = bench->file_capacity ? bench->file_capacity * 2 : 256;
+		bench_file_t *files = realloc(bench->files,capacity * sizeof(bench_file_t));
+		if (!files) return 0;
+		bench->files = files;
+		bench->file_capacity = capacity;
+	}
+	bench->files[bench->file_count].path = strdup(path);
+	bench->files[bench->file_count].size = ntohl(entry->size);
+	bench->file_count++;
+	return 1;
+}
+
+// Function compare_ns, orders samples by elapsed time
+int compare_ns(const void *a,const void *b) {
+	uint64_t x = ((const sample_t *)a)->ns,y = ((const sample_t *)b)->ns;
+	return x < y ? -1 : x > y;
+}
+
+// Function percentile_ms, returns the p-th percentile of sorted samples in milliseconds
+double percentile_ms(const sample_t *samples,int runs,int p) {
+	int i = (int)(((long)runs * p + 99)/100) - 1;
+	if (i < 0) i = 0;
+	return samples[i].ns/1e6;
+}
+
+// Function report, prints one workload as a JSON object
+// bytes is the file data moved over all runs, used for throughput
+void report(bench_t *bench,const char *name,int runs,uint64_t bytes) {
+	sample_t *samples = bench->samples;
+	uint64_t total_ns = 0,syscr = 0,syscw = 0,rchar = 0,wchar = 0,user_us = 0,sys_us = 0;
+	int failed = 0;
+	for (int i = 0; i < runs; i++) {
+		total_ns += samples[i].ns;
+		syscr += samples[i].syscr;
+		syscw += samples[i].syscw;
+		rchar += samples[i].rchar;
+		wchar += samples[i].wchar;
+		user_us += samples[i].user_us;
+		sys_us += samples[i].sys_us;
+		failed += !samples[i].ok;
+	}
+	qsort(samples,runs,sizeof(sample_t),compare_ns);
+
+	printf("%s\n    {\"name\": \"%s\", \"runs\": %d, \"failed\": %d,\n",bench->first ? "" : ",",name,runs,failed);
+	printf("     \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f,\n",
+		total_ns/1e6/runs,percentile_ms(samples,runs,50),percentile_ms(samples,runs,90),
+		percentile_ms(samples,runs,99),samples[runs - 1].ns/1e6);
+	printf("     \"bytes\": %llu, \"throughput_mb_s\": %.2f,\n",(unsigned long long)bytes,
+		total_ns ? bytes/1048576.0/(total_ns/1e9) : 0.0);
+	printf("     \"read_syscalls\": %.1f, \"write_syscalls\": %.1f, \"read_bytes\": %.0f, \"write_bytes\": %.0f,\n",
+		(double)syscr/runs,(double)syscw/runs,(double)rchar/runs,(double)wchar/runs);
+	printf("     \"user_ms\": %.3f, \"sys_ms\": %.3f}",user_us/1e3/runs,sys_us/1e3/runs);
+	bench->first = 0;
+	return;
+}
+
+// Function write_source, creates a host file of size pseudo-random bytes for the put workload
+// Returns 1 if successful, 0 otherwise
+int write_source(const char *path,uint32_t size) {
+	FILE *fp = fopen(path,"wb");
+	if (!fp) return 0;
+	uint64_t x = 88172645463325252ull;
+	for (uint32_t i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		fputc((int)(x & 0xFF),fp);
+	}
+	return fclose(fp) == 0;
+}
+
+int main(int argc,char *argv[]) {
+	fs_stats_init(&argc,argv);
+
+	// Bench options come first, everything else is passed to diskgen
+	bench_t bench = {0};
+	bench.tools = ".";
+	bench.first = 1;
+	int runs = 20;
+	uint32_t put_size = 256 << 10;
+	int keep = 0;
+	char *gen_args[MAX_GEN_ARGS + 4];
+	int gen_count = 0;
+	gen_args[gen_count++] = "diskgen";
+	gen_args[gen_count++] = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i],"-i") && i + 1 < argc) runs = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-t") && i + 1 < argc) bench.tools = argv[++i];
+		else if (!strcmp(argv[i],"-P") && i + 1 < argc) put_size = atoi(argv[++i]);
+		else if (!strcmp(argv[i],"-k")) keep = 1;
+		else if (gen_count < MAX_GEN_ARGS) gen_args[gen_count++] = argv[i];
+	}
+	gen_args[gen_count] = NULL;
+	if (runs <= 0 || runs > MAX_RUNS) {
+		printf("Usage: %s [-i runs] [-t tools_dir] [-P put_size] [-k] [diskgen options]\n",argv[0]);
+		exit(1);
+	}
+
+	// Everything the runs create lives in a scratch directory
+	char work[] = "/tmp/diskbench.XXXXXX";
+	if (!mkdtemp(work)) {
+		perror("Error: Cannot create work directory");
+		exit(1);
+	}
+	char image[sizeof(work) + 16],host[sizeof(work) + 16],source[sizeof(work) + 16];
+	snprintf(image,sizeof(image),"%s/bench.img",work);
+	snprintf(host,sizeof(host),"%s/get.out",work);
+	snprintf(source,sizeof(source),"%s/put.in",work);
+	bench.image = image;
+	gen_args[1] = image;
+
+	bench.samples = calloc(runs,sizeof(sample_t));
+	if (!bench.samples || !write_source(source,put_size)) {
+		perror("Error: Setup failed");
+		exit(1);
+	}
+
+	printf("{\n  \"config\": {\"runs\": %d, \"put_size\": %u, \"generator\": \"",runs,put_size);
+	for (int i = 2; i < gen_count; i++) printf("%s%s",i > 2 ? " " : "",gen_args[i]);
+	printf("\"},\n  \"workloads\": [");
+
+	// Generation is measured once, then the image is walked to pick targets
+	if (!run_tool(&bench,gen_args,bench.samples)) {
+		fprintf(stderr,"Error: diskgen failed\n");
+		exit(1);
+	}
+	report(&bench,"diskgen",1,0);
+
+	fs_t fs;
+	if (!fs_open(&fs,image,"rb")) {
+		perror("Error: File Invalid");
+		exit(1);
+	}
+	strcpy(bench.deepest,"/");
+	fs_walk(&fs,fs.super_block.root_start,"/",collect_file,&bench);
+	fs_close(&fs);
+
+	char *info_args[] = {"diskinfo",image,NULL};
+	for (int i = 0; i < runs; i++) run_tool(&bench,info_args,&bench.samples[i]);
+	report(&bench,"diskinfo",runs,0);
+
+	char *scan_args[] = {"diskinfo",image,"--scan",NULL};
+	for (int i = 0; i < runs; i++) run_tool(&bench,scan_args,&bench.samples[i]);
+	report(&bench,"diskinfo_scan",runs,0);
+
+	char *list_args[] = {"disklist",image,bench.deepest,NULL};
+	for (int i = 0; i < runs; i++) run_tool(&bench,list_args,&bench.samples[i]);
+	report(&bench,"disklist",runs,0);
+
+	// Gets cycle through the files in walk order, so every run reads a different file
+	if (bench.file_count > 0) {
+		uint64_t bytes = 0;
+		for (int i = 0; i < runs; i++) {
+			bench_file_t *file = &bench.files[i % bench.file_count];
+			char *get_args[] = {"diskget",image,file->path,host,NULL};
+			run_tool(&bench,get_args,&bench.samples[i]);
+			bytes += file->size;
+		}
+		report(&bench,"diskget",runs,bytes);
+	}
+
+	// Each put adds a new file, so later runs also see a fuller directory and FAT
+	for (int i = 0; i < runs; i++) {
+		char dest[64];
+		snprintf(dest,sizeof(dest),"/bench/put%06d",i);
+		char *put_args[] = {"diskput",image,source,dest,NULL};
+		run_tool(&bench,put_args,&bench.samples[i]);
+	}
+	report(&bench,"diskput",runs,(uint64_t)runs * put_size);
+	printf("\n  ]\n}\n");
+
+	if (!keep) {
+		unlink(image);
+		unlink(host);
+		unlink(source);
+		rmdir(work);
+	} else {
+		fprintf(stderr,"Kept %s\n",work);
+	}
+	for (long i = 0; i < bench.file_count; i++) free(bench.files[i].path);
+	free(bench.files);
+	free(bench.samples);
+	return 0;
+}
@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+// Data is moved through a buffer of this size
+#define MOVE_BUFFER_SIZE (8 << 20)
+
+// Files moved between FAT commits, and how much data they may hold
+#define BATCH_FILES 1024
+#define BATCH_BYTES (64ull << 20)
+
+// Passes over the files, as space freed by one pass can make room for more moves
+#define MAX_PASSES 3
+
+// Structure item_t, a file or directory found in the image and where its entry lives
+typedef struct {
+	uint32_t parent;
+	uint32_t slot;
+	uint32_t start;
+	uint32_t blocks;
+	uint32_t extents;
+	uint32_t depth;
+	int is_dir;
+} item_t;
+
+// Structure move_t, a chain that has been copied but whose entry still points at the old blocks
+typedef struct {
+	item_t *item;
+	uint32_t new_start;
+	uint32_t new_extents;
+} move_t;
+
+// Structure defrag_t, everything found in the image and the moves in progress
+typedef struct {
+	fs_t *fs;
+	item_t *items;
+	long count;
+	long capacity;
+	move_t batch[BATCH_FILES];
+	int batch_count;
+	uint64_t batch_bytes;
+	char *buffer;
+	uint64_t moved_files;
+	uint64_t moved_dirs;
+	uint64_t moved_bytes;
+	uint64_t *owned;
+	int cross_linked;
+	int failed;
+} defrag_t;
+
+// Structure layout_t, a summary of how fragmented the image is
+typedef struct {
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t extents;
+	uint64_t fragmented;
+	uint64_t requests;
+	uint64_t ideal_requests;
+} layout_t;
+
+// Function add_item, records one entry found while walking
+// Returns 1 if successful, 0 otherwise
+int add_item(defrag_t *defrag,const item_t *item) {
+	if (defrag->count == defrag->capacity) {
+		long capacity = defrag->capacity ? defrag->capacity * 2 : 256;
+		item_t *items = realloc(defrag->items,capacity * sizeof(item_t));
+		if (!items) return 0;
+		defrag->items = items;
+		defrag->capacity = capacity;
+	}
+	defrag->items[defrag->count++] = *item;
+	return 1;
+}
+
+// Function claim_chain, marks every block of a whole chain, up to its end, as owned
+// Returns 1 if successful, 0 if a block is already owned, by another chain or earlier in this one
+int claim_chain(defrag_t *defrag,uint32_t start) {
+	fs_t *fs = defrag->fs;
+	for (uint32_t b = start; b != FAT_EOF; b = fs_next_block(fs,b)) {
+		if (b < 2 || b >= fs->fat_entries) return 1;
+		uint64_t bit = (uint64_t)1 << (b % 64);
+		if (defrag->owned[b/64] & bit) return 0;
+		defrag->owned[b/64] |= bit;
+	}
+	return 1;
+}
+
+// Function collect, records every entry below a directory with its chain length and extent count
+// Chains that share blocks are not recorded, and set cross_linked
+// Returns 1 if every directory could be read, 0 otherwise
+int collect(defrag_t *defrag,uint32_t start,uint32_t depth) {
+	fs_t *fs = defrag->fs;
+	if (depth > FS_MAX_DEPTH) return 0;
+	fs_dir_t *dir = fs_dir_get(fs,start);
+	if (!dir) return 0;
+
+	uint32_t block_size = fs->super_block.block_size;
+	int ok = 1;
+	FS_STAT_ADD(dir_entries_scanned,dir->entry_count);
+	for (uint32_t slot = 0; slot < dir->entry_count; slot++) {
+		dir_entry_t entry = dir->entries[slot];
+		if (entry.status == 0x00) continue;
+
+		item_t item = {0};
+		item.parent = start;
+		item.slot = slot;
+		item.start = ntohl(entry.starting_block);
+		item.depth = depth;
+		item.is_dir = (entry.status & FS_ENTRY_DIR) != 0;
+		if (item.start == 0 || item.start >= fs->fat_entries) continue;
+		if (!claim_chain(defrag,item.start)) {
+			defrag->cross_linked = 1;
+			continue;
+		}
+
+		// Files own the blocks their size needs, directories own their whole chain
+		uint32_t max_blocks = item.is_dir ? fs->fat_entries :
+			(uint32_t)(((uint64_t)ntohl(entry.size) + block_size - 1)/block_size);
+		fs_run_t *runs;
+		item.extents = fs_chain_extents(fs,item.start,max_blocks,&runs);
+		for (uint32_t r = 0; r < item.extents; r++) item.blocks += runs[r].length;
+		free(runs);
+		if (item.blocks == 0) continue;
+
+		if (!add_item(defrag,&item)) return 0;
+		if (item.is_dir && !collect(defrag,item.start,depth + 1)) ok = 0;
+	}
+	return ok;
+}
+
+// Function requests_for, counts the read requests a chain costs at a readahead window
+// Every break in the chain starts a new request, as readahead only follows consecutive blocks
+uint64_t requests_for(const fs_t *fs,uint32_t start,uint32_t blocks,uint64_t window) {
+	uint32_t block_size = fs->super_block.block_size;
+	fs_run_t *runs;
+	uint32_t count = fs_chain_extents(fs,start,blocks,&runs);
+	uint64_t requests = 0;
+	for (uint32_t r = 0; r < count; r++) {
+		uint64_t bytes = (uint64_t)runs[r].length * block_size;
+		requests += (bytes + window - 1)/window;
+	}
+	free(runs);
+	return requests;
+}
+
+// Function measure, summarizes the fragmentation of every collected chain
+void measure(const defrag_t *defrag,uint64_t window,layout_t *out) {
+	const fs_t *fs = defrag->fs;
+	uint32_t block_size = fs->super_block.block_size;
+	memset(out,0,sizeof(layout_t));
+	for (long i = 0; i < defrag->count; i++) {
+		const item_t *item = &defrag->items[i];
+		if (item->is_dir) out->dirs++;
+		else out->files++;
+		out->extents += item->extents;
+		if (item->extents > 1) out->fragmented++;
+		out->requests += requests_for(fs,item->start,item->blocks,window);
+		out->ideal_requests += ((uint64_t)item->blocks * block_size + window - 1)/window;
+	}
+	return;
+}
+
+// Function chain_io, reads or writes len bytes at byte offset pos of a list of runs
+// Returns 1 if successful, 0 otherwise
+int chain_io(fs_t *fs,const fs_run_t *runs,uint32_t count,uint64_t pos,char *buf,size_t len,int write) {
+	uint32_t block_size = fs->super_block.block_size;
+	int fd = fileno(fs->fp);
+	for (uint32_t r = 0; r < count && len > 0; r++) {
+		uint64_t run_bytes = (uint64_t)runs[r].length * block_size;
+		if (pos >= run_bytes) {
+			pos -= run_bytes;
+			continue;
+		}
+		size_t chunk = run_bytes - pos < len ? run_bytes - pos : len;
+		off_t offset = fs_block_offset(fs,runs[r].start) + pos;
+		ssize_t done = write ? pwrite(fd,buf,chunk,offset) : pread(fd,buf,chunk,offset);
+		if (done != (ssize_t)chunk) return 0;
+		fs_stats_io(write ? FS_IO_WRITE : FS_IO_READ,chunk,offset);
+		buf += chunk;
+		len -= chunk;
+		pos = 0;
+	}
+	return len == 0;
+}
+
+// Function release_chain, frees every block of a chain up to its end
+// A file's chain may run past the blocks its size needs, those are freed too
+void release_chain(fs_t *fs,uint32_t start) {
+	for (uint32_t b = start,n = 0; n < fs->fat_entries && b != FAT_EOF && b < fs->fat_entries; n++) {
+		uint32_t next = fs_next_block(fs,b);
+		fs_set_next(fs,b,FAT_FREE);
+		b = next;
+	}
+	return;
+}
+
+// Function copy_item, gives a chain a new home in fewer extents and copies its blocks there
+// Nothing points at the copy until its batch is committed
+// Returns the new first block, or 0 if the chain stays where it is
+uint32_t copy_item(defrag_t *defrag,item_t *item,uint32_t *new_extents) {
+	fs_t *fs = defrag->fs;
+	fs_run_t *to;
+	uint32_t to_count;
+	uint32_t new_start = fs_alloc_chain(fs,item->blocks,&to,&to_count);
+	if (new_start == 0) return 0;
+	if (to_count >= item->extents) {
+		release_chain(fs,new_start);
+		free(to);
+		return 0;
+	}
+
+	fs_run_t *from;
+	uint32_t from_count = fs_chain_extents(fs,item->start,item->blocks,&from);
+	uint64_t total = (uint64_t)item->blocks * fs->super_block.block_size;
+	int ok = 1;
+	for (uint64_t pos = 0; pos < total && ok; pos += MOVE_BUFFER_SIZE) {
+		size_t len = total - pos < MOVE_BUFFER_SIZE ? total - pos : MOVE_BUFFER_SIZE;
+		ok = chain_io(fs,from,from_count,pos,defrag->buffer,len,0) &&
+			chain_io(fs,to,to_count,pos,defrag->buffer,len,1);
+	}
+	free(from);
+	free(to);
+
+	if (!ok) {
+		perror("Error: Copy failed");
+		release_chain(fs,new_start);
+		defrag->failed = 1;
+		return 0;
+	}
+	*new_extents = to_count;
+	return new_start;
+}
+
+// Function commit_batch, switches every copied chain in the batch over to its new blocks
+// The FAT holding the new chains is written first, then the entries are pointed at them,
+// then the old chains are freed, so a crash at any point leaves every entry on a valid chain
+// Returns 1 if successful, 0 otherwise
+int commit_batch(defrag_t *defrag) {
+	fs_t *fs = defrag->fs;
+	if (defrag->batch_count == 0) return 1;
+	if (!fs_flush(fs)) return 0;
+
+	uint32_t per_block = fs->super_block.block_size/sizeof(dir_entry_t);
+	int ok = 1;
+	for (int i = 0; i < defrag->batch_count && ok; i++) {
+		move_t *move = &defrag->batch[i];
+		item_t *item = move->item;
+		fs_dir_t *dir = fs_dir_get(fs,item->parent);
+		if (!dir) {
+			ok = 0;
+			break;
+		}
+
+		uint32_t start = htonl(move->new_start);
+		off_t offset = fs_block_offset(fs,dir->blocks[item->slot/per_block]) +
+			(off_t)(item->slot % per_block) * sizeof(dir_entry_t) + offsetof(dir_entry_t,starting_block);
+		if (pwrite(fileno(fs->fp),&start,sizeof(start),offset) != sizeof(start)) {
+			ok = 0;
+			break;
+		}
+		fs_stats_io(FS_IO_WRITE,sizeof(start),offset);
+		dir->entries[item->slot].starting_block = start;
+
+		release_chain(fs,item->start);
+		item->start = move->new_start;
+		item->extents = move->new_extents;
+	}
+
+	defrag->batch_count = 0;
+	defrag->batch_bytes = 0;
+	return ok && fs_flush(fs);
+}
+
+// Function move_files, rewrites fragmented files into contiguous runs where there is room
+// Returns 1 if successful, 0 otherwise
+int move_files(defrag_t *defrag) {
+	uint32_t block_size = defrag->fs->super_block.block_size;
+	for (int pass = 0; pass < MAX_PASSES; pass++) {
+		uint64_t moved = defrag->moved_files;
+		for (long i = 0; i < defrag->count && !defrag->failed; i++) {
+			item_t *item = &defrag->items[i];
+			if (item->is_dir || item->extents <= 1) continue;
+
+			uint32_t new_extents;
+			uint32_t new_start = copy_item(defrag,item,&new_extents);
+			if (new_start == 0) continue;
+
+			move_t *move = &defrag->batch[defrag->batch_count++];
+			move->item = item;
+			move->new_start = new_start;
+			move->new_extents = new_extents;
+			defrag->batch_bytes += (uint64_t)item->blocks * block_size;
+			defrag->moved_files++;
+			defrag->moved_bytes += (uint64_t)item->blocks * block_size;
+
+			if (defrag->batch_count == BATCH_FILES || defrag->batch_bytes >= BATCH_BYTES) {
+				if (!commit_batch(defrag)) return 0;
+			}
+		}
+		if (!commit_batch(defrag)) return 0;
+		if (defrag->failed || defrag->moved_files == moved) break;
+	}
+	return !defrag->failed;
+}
+
+// Function compare_depth, orders items deepest first
+int compare_depth(const void *a,const void *b) {
+	uint32_t x = ((const item_t *)a)->depth,y = ((const item_t *)b)->depth;
+	return x > y ? -1 : x < y;
+}
+
+// Function move_dirs, rewrites fragmented directories into contiguous runs, deepest first
+// A directory is copied after every change to its own entries, and its parent has not moved yet,
+// so each one is committed on its own and the loaded directories are dropped after it
+// Returns 1 if successful, 0 otherwise
+int move_dirs(defrag_t *defrag) {
+	fs_t *fs = defrag->fs;
+	qsort(defrag->items,defrag->count,sizeof(item_t),compare_depth);
+	for (long i = 0; i < defrag->count && !defrag->failed; i++) {
+		item_t *item = &defrag->items[i];
+		if (!item->is_dir || item->extents <= 1) continue;
+
+		uint32_t new_extents;
+		uint32_t new_start = copy_item(defrag,item,&new_extents);
+		if (new_start == 0) continue;
+
+		move_t *move = &defrag->batch[defrag->batch_count++];
+		move->item = item;
+		move->new_start = new_start;
+		move->new_extents = new_extents;
+		if (!commit_batch(defrag)) return 0;
+		defrag->moved_dirs++;
+		defrag->moved_bytes += (uint64_t)item->blocks * fs->super_block.block_size;
+
+		// Directories are cached by starting block, which has just changed
+		fs_dir_cache_destroy(fs);
+		fs_path_cache_clear(fs);
+	}
+	return !defrag->failed;
+}
+
+// Function print_layout, prints one fragmentation summary
+void print_layout(const char *label,const layout_t *layout,uint64_t window) {
+	printf("%s: %llu files, %llu directories, %llu extents, %llu fragmented, %llu read requests at %llu KiB readahead\n",
+		label,(unsigned long long)layout->files,(unsigned long long)layout->dirs,
+		(unsigned long long)layout->extents,(unsigned long long)layout->fragmented,
+		(unsigned long long)layout->requests,(unsigned long long)(window >> 10));
+	return;
+}
+
+int main(int argc,char *argv[]) {
+	fs_stats_init(&argc,argv);
+
+	// An image is needed as an argument
+	if (argc < 2) {
+		printf("Usage: %s image [-n] [-w readahead_kib]\n",argv[0]);
+		exit(1);
+	}
+
+	// -n only plans and reports, -w sets the readahead window the estimate assumes
+	int dry_run = 0;
+	uint64_t window = 128 << 10;
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i],"-n")) dry_run = 1;
+		else if (!strcmp(argv[i],"-w") && i + 1 < argc) window = strtoull(argv[++i],NULL,10) << 10;
+	}
+	if (window == 0) window = 128 << 10;
+
+	fs_t fs;
+	if (!fs_open(&fs,argv[1],dry_run ? "rb" : "rb+")) {
+		perror("Error: File Invalid");
+		exit(1);
+	}
+
+	defrag_t defrag = {0};
+	defrag.fs = &fs;
+	// Blocks are owned by at most one chain, moving a shared chain would free blocks still in use
+	defrag.owned = calloc(fs.fat_entries/64 + 1,sizeof(uint64_t));
+	if (!defrag.owned) {
+		perror("Error: Out of memory");
+		exit(1);
+	}
+	if (!claim_chain(&defrag,fs.super_block.root_start)) defrag.cross_linked = 1;
+	int readable = collect(&defrag,fs.super_block.root_start,0);
+	if (!readable || defrag.cross_linked) {
+		printf(readable ? "Some chains share blocks, run diskfsck first\n" :
+			"Some directories could not be read, run diskfsck first\n");
+		fs_close(&fs);
+		exit(1);
+	}
+
+	layout_t before;
+	measure(&defrag,window,&before);
+	print_layout("Before",&before,window);
+	printf("Fully contiguous: %llu read requests, expected readahead gain %.2fx\n",
+		(unsigned long long)before.ideal_requests,
+		before.ideal_requests ? (double)before.requests/before.ideal_requests : 1.0);
+	if (dry_run) {
+		fs_close(&fs);
+		return 0;
+	}
+
+	defrag.buffer = malloc(MOVE_BUFFER_SIZE);
+	if (!defrag.buffer) {
+		perror("Error: Out of memory");
+		exit(1);
+	}
+
+	// Files first, while every directory is still where it was found
+	int ok = move_files(&defrag) && move_dirs(&defrag);
+
+	layout_t after;
+	measure(&defrag,window,&after);
+	print_layout("After",&after,window);
+	printf("Moved %llu files and %llu directories (%llu bytes), readahead gain %.2fx\n",
+		(unsigned long long)defrag.moved_files,(unsigned long long)defrag.moved_dirs,
+		(unsigned long long)defrag.moved_bytes,
+		after.requests ? (double)before.requests/after.requests : 1.0);
+
+	if (!fs_flush(&fs)) {
+		perror("Error: FAT write-back failed");
+		exit(1);
+	}
+	fs_close(&fs);
+	free(defrag.buffer);
+	free(defrag.items);
+	free(defrag.owned);
+	return ok ? 0 : 1;
+}
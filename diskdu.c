@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+// Structure du_total_t, what a directory and everything below it holds
+// Allocated bytes include the blocks of the directories themselves
+typedef struct {
+	uint64_t files;
+	uint64_t logical;
+	uint64_t allocated;
+} du_total_t;
+
+// Structure du_t, the options and state of one summary
+typedef struct {
+	fs_t *fs;
+	int summary;
+	int max_depth;
+	long failed;
+} du_t;
+
+// Function print_total, prints one line in the form files logical allocated path
+void print_total(const du_total_t *total,const char *path) {
+	printf("%10llu %14llu %14llu %s\n",(unsigned long long)total->files,
+		(unsigned long long)total->logical,(unsigned long long)total->allocated,path);
+	return;
+}
+
+// Function du_dir, adds up a directory and everything below it into out
+// Each directory chain is read once, whole runs at a time, subdirectories are summed before their parent,
+// and a directory's line is printed after those of its subdirectories, as du does
+void du_dir(du_t *du,const char *path,uint32_t start,int depth,du_total_t *out) {
+	fs_t *fs = du->fs;
+	uint32_t block_size = fs->super_block.block_size;
+	uint32_t per_block = block_size/sizeof(dir_entry_t);
+	memset(out,0,sizeof(*out));
+
+	uint32_t blocks;
+	char *data = depth <= FS_MAX_DEPTH ? fs_read_chain(fs,start,&blocks) : NULL;
+	if (!data) {
+		fprintf(stderr,"Error: Could not read directory %s\n",path);
+		du->failed++;
+		return;
+	}
+	out->allocated = (uint64_t)blocks * block_size;
+	FS_STAT_ADD(dir_entries_scanned,(uint64_t)blocks * per_block);
+
+	size_t path_len = strlen(path);
+	char *child_path = malloc(path_len + 34);
+	for (uint32_t b = 0; child_path && b < blocks; b++) {
+		for (uint32_t s = 0; s < per_block; s++) {
+			dir_entry_t entry;
+			memcpy(&entry,data + (size_t)b * block_size + s * sizeof(dir_entry_t),sizeof(entry));
+			if (entry.status == 0x00) continue; // Unused
+
+			if (entry.status & FS_ENTRY_FILE) {
+				out->files++;
+				out->logical += ntohl(entry.size);
+				out->allocated += (uint64_t)ntohl(entry.block_count) * block_size;
+			} else if (entry.status & FS_ENTRY_DIR) {
+				char name[32];
+				fs_entry_name(&entry,name);
+				sprintf(child_path,"%s%s%s",path,path[path_len - 1] == '/' ? "" : "/",name);
+
+				du_total_t child;
+				du_dir(du,child_path,ntohl(entry.starting_block),depth + 1,&child);
+				out->files += child.files;
+				out->logical += child.logical;
+				out->allocated += child.allocated;
+			}
+		}
+	}
+	if (!child_path) {
+		perror("Error: Out of memory");
+		du->failed++;
+	}
+	free(child_path);
+	free(data);
+
+	if (depth == 0 || (!du->summary && (du->max_depth < 0 || depth <= du->max_depth))) print_total(out,path);
+	return;
+}
+
+int main(int argc,char *argv[]) {
+	fs_stats_init(&argc,argv);
+
+	// An image is needed as an argument
+	if (argc < 2) {
+		printf("Usage: %s image [directory] [-s] [-d max_depth]\n",argv[0]);
+		exit(1);
+	}
+
+	// -s prints only the total, -d only prints directories up to that many levels below the first
+	du_t du = {0};
+	du.max_depth = -1;
+	const char *path = "/";
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i],"-s")) du.summary = 1;
+		else if (!strcmp(argv[i],"-d") && i + 1 < argc) du.max_depth = atoi(argv[++i]);
+		else path = argv[i];
+	}
+
+	// Opens the inputted file, loading the superblock and FAT into memory
+	fs_t fs;
+	if (!fs_open(&fs,argv[1],"rb")) {
+		perror("Error: File Invalid");
+		exit(1);
+	}
+	du.fs = &fs;
+
+	uint32_t start = fs.super_block.root_start;
+	if (strcmp(path,"/")) {
+		uint32_t blocks;
+		if (!fs_resolve_path(&fs,path,0,&start,&blocks)) {
+			printf("Subdirectory \'%s\' not found\n",path);
+			fs_close(&fs);
+			exit(1);
+		}
+	}
+
+	du_total_t total;
+	du_dir(&du,path,start,0,&total);
+	fs_close(&fs);
+
+	return du.failed ? 1 : 0;
+}
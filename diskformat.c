@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+
+// Function parse_size, reads a size with an optional K, M or G suffix
+uint64_t parse_size(const char *arg) {
+	char *end;
+	uint64_t value = strtoull(arg,&end,10);
+	if (*end == 'K' || *end == 'k') value <<= 10;
+	else if (*end == 'M' || *end == 'm') value <<= 20;
+	else if (*end == 'G' || *end == 'g') value <<= 30;
+	return value;
+}
+
+int main(int argc,char *argv[]) {
+	fs_stats_init(&argc,argv);
+
+	// An image path is needed as an argument
+	if (argc < 2) {
+		printf("Usage: %s image [-b block_size] [-n block_count | -s image_size] [-R root_blocks] [--preallocate]\n",
+			argv[0]);
+		exit(1);
+	}
+
+	uint64_t block_size = 512,block_count = 65536,image_size = 0,root_blocks = 8;
+	int flags = 0;
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i],"--preallocate")) flags |= FS_FORMAT_PREALLOCATE;
+		else if (i + 1 < argc && !strcmp(argv[i],"-b")) block_size = parse_size(argv[++i]);
+		else if (i + 1 < argc && !strcmp(argv[i],"-n")) block_count = parse_size(argv[++i]);
+		else if (i + 1 < argc && !strcmp(argv[i],"-s")) image_size = parse_size(argv[++i]);
+		else if (i + 1 < argc && !strcmp(argv[i],"-R")) root_blocks = parse_size(argv[++i]);
+		else {
+			printf("Unknown option %s\n",argv[i]);
+			exit(1);
+		}
+	}
+
+	// A size in bytes is turned into whole blocks
+	if (image_size && block_size) block_count = image_size/block_size;
+	if (block_size > UINT16_MAX || block_count > UINT32_MAX || root_blocks > UINT32_MAX ||
+			!fs_format(argv[1],block_size,block_count,root_blocks,flags)) {
+		perror("Error: Format failed");
+		exit(1);
+	}
+
+	printf("Formatted %s: %llu blocks of %llu bytes, %llu root directory blocks%s\n",argv[1],
+		(unsigned long long)block_count,(unsigned long long)block_size,(unsigned long long)root_blocks,
+		flags & FS_FORMAT_PREALLOCATE ? ", preallocated" : "");
+	return 0;
+}
@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fs.h"
+
+// Most worker threads used to traverse directories
+#define MAX_WORKERS 16
+
+// How a chain walk ended
+enum { CHAIN_OK, CHAIN_CROSSLINK, CHAIN_CYCLE, CHAIN_BAD_LINK };
+
+// Structure dir_job_t, a directory waiting to be checked
+// entry_offset is where the directory's own entry lives, 0 for the root
+typedef struct dir_job {
+	uint32_t start;
+	char *path;
+	int depth;
+	off_t entry_offset;
+	struct dir_job *next;
+} dir_job_t;
+
+// Structure entry_fix_t, a directory entry to rewrite during repair
+typedef struct {
+	off_t offset;
+	dir_entry_t entry;
+} entry_fix_t;
+
+// Structure fsck_t, the shared state of a check
+// claimed has one bit per block, set atomically by whichever chain reaches the block first
+typedef struct {
+	fs_t *fs;
+	uint32_t usable;
+	uint64_t *claimed;
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	dir_job_t *queue;
+	int active;
+
+	char **problems;
+	long problem_count;
+	long problem_capacity;
+	entry_fix_t *entry_fixes;
+	long entry_fix_count;
+	long entry_fix_capacity;
+	uint32_t *truncations;
+	long truncation_count;
+	long truncation_capacity;
+
+	uint64_t dirs;
+	uint64_t files;
+} fsck_t;
+
+// Function grow, makes room for one more element in a growable array
+// Returns 1 if successful, 0 otherwise
+int grow(void **array,long count,long *capacity,size_t size) {
+	if (count < *capacity) return 1;
+	long new_capacity = *capacity ? *capacity * 2 : 64;
+	void *grown = realloc(*array,new_capacity * size);
+	if (!grown) return 0;
+	*array = grown;
+	*capacity = new_capacity;
+	return 1;
+}
+
+// Function report, records a problem found at path
+void report(fsck_t *fsck,const char *path,const char *format,...) __attribute__((format(printf,3,4)));
+void report(fsck_t *fsck,const char *path,const char *format,...) {
+	char detail[160];
+	va_list args;
+	va_start(args,format);
+	vsnprintf(detail,sizeof(detail),format,args);
+	va_end(args);
+
+	char *line = malloc(strlen(path) + strlen(detail) + 3);
+	if (!line) return;
+	sprintf(line,"%s: %s",path,detail);
+
+	pthread_mutex_lock(&fsck->lock);
+	if (grow((void **)&fsck->problems,fsck->problem_count,&fsck->problem_capacity,sizeof(char *))) {
+		fsck->problems[fsck->problem_count++] = line;
+	} else {
+		free(line);
+	}
+	pthread_mutex_unlock(&fsck->lock);
+	return;
+}
+
+// Function fix_entry, queues a rewrite of the entry at offset
+void fix_entry(fsck_t *fsck,off_t offset,const dir_entry_t *entry) {
+	pthread_mutex_lock(&fsck->lock);
+	if (grow((void **)&fsck->entry_fixes,fsck->entry_fix_count,&fsck->entry_fix_capacity,sizeof(entry_fix_t))) {
+		fsck->entry_fixes[fsck->entry_fix_count].offset = offset;
+		fsck->entry_fixes[fsck->entry_fix_count].entry = *entry;
+		fsck->entry_fix_count++;
+	}
+	pthread_mutex_unlock(&fsck->lock);
+	return;
+}
+
+// Function fix_truncate, queues ending a chain at block
+void fix_truncate(fsck_t *fsck,uint32_t block) {
+	pthread_mutex_lock(&fsck->lock);
+	if (grow((void **)&fsck->truncations,fsck->truncation_count,&fsck->truncation_capacity,sizeof(uint32_t))) {
+		fsck->truncations[fsck->truncation_count++] = block;
+	}
+	pthread_mutex_unlock(&fsck->lock);
+	return;
+}
+
+// Function claim, marks a block as owned
+// Returns 1 if this caller is the first to claim it, 0 if it was already owned
+int claim(fsck_t *fsck,uint32_t block) {
+	uint64_t bit = 1ull << (block & 63);
+	return !(__atomic_fetch_or(&fsck->claimed[block >> 6],bit,__ATOMIC_RELAXED) & bit);
+}
+
+// Function is_claimed, returns 1 if a block is owned
+int is_claimed(const fsck_t *fsck,uint32_t block) {
+	return (__atomic_load_n(&fsck->claimed[block >> 6],__ATOMIC_RELAXED) >> (block & 63)) & 1;
+}
+
+// Function in_chain, returns 1 if block is among the first length blocks of the chain at start
+// Only used once a walk meets an owned block, so it adds at most one extra pass per chain
+int in_chain(const fs_t *fs,uint32_t start,uint32_t length,uint32_t block) {
+	for (uint32_t b = start,n = 0; n < length; n++) {
+		if (b == block) return 1;
+		b = fs_next_block(fs,b);
+	}
+	return 0;
+}
+
+// Function walk_chain, claims every block of a chain until its end or its first fault
+// Sets length to the blocks claimed and last to the final one claimed (0 if none)
+// When runs is given it also receives the claimed blocks grouped into runs
+// Returns CHAIN_OK or the fault that ended the walk
+int walk_chain(fsck_t *fsck,uint32_t start,uint32_t *length,uint32_t *last,
+		fs_run_t **runs,uint32_t *run_count) {
+	fs_t *fs = fsck->fs;
+	uint32_t run_capacity = 0;
+	*length = *last = 0;
+	if (runs) {
+		*runs = NULL;
+		*run_count = 0;
+	}
+
+	uint32_t block = start;
+	while (1) {
+		if (block < 2 || block >= fsck->usable) return CHAIN_BAD_LINK;
+		if (!claim(fsck,block)) {
+			return in_chain(fs,start,*length,block) ? CHAIN_CYCLE : CHAIN_CROSSLINK;
+		}
+
+		if (runs) {
+			if (*run_count > 0 && (*runs)[*run_count - 1].start + (*runs)[*run_count - 1].length == block) {
+				(*runs)[*run_count - 1].length++;
+			} else {
+				if (*run_count == run_capacity) {
+					run_capacity = run_capacity ? run_capacity * 2 : 16;
+					fs_run_t *grown = realloc(*runs,run_capacity * sizeof(fs_run_t));
+					if (!grown) return CHAIN_BAD_LINK;
+					*runs = grown;
+				}
+				(*runs)[*run_count].start = block;
+				(*runs)[*run_count].length = 1;
+				(*run_count)++;
+			}
+		}
+
+		(*length)++;
+		*last = block;
+		uint32_t next = fs_next_block(fs,block);
+		if (next == FAT_EOF) return CHAIN_OK;
+		block = next;
+	}
+}
+
+// Function chain_fault, describes how a chain walk ended
+const char *chain_fault(int result) {
+	if (result == CHAIN_CROSSLINK) return "cross-linked with another chain";
+	if (result == CHAIN_CYCLE) return "chain loops back on itself";
+	return "chain has an invalid link";
+}
+
+// Function push_dir, queues a directory for any worker to check
+void push_dir(fsck_t *fsck,dir_job_t *job) {
+	pthread_mutex_lock(&fsck->lock);
+	job->next = fsck->queue;
+	fsck->queue = job;
+	pthread_cond_signal(&fsck->ready);
+	pthread_mutex_unlock(&fsck->lock);
+	return;
+}
+
+// Function check_file, checks a file's chain against its size and block count
+void check_file(fsck_t *fsck,const char *path,off_t offset,dir_entry_t entry) {
+	uint32_t block_size = fsck->fs->super_block.block_size;
+	uint32_t start = ntohl(entry.starting_block);
+	uint32_t size = ntohl(entry.size),block_count = ntohl(entry.block_count);
+
+	// Empty files may have no chain at all
+	if (start == 0 && size == 0) {
+		if (block_count != 0) {
+			report(fsck,path,"empty file records %u blocks",block_count);
+			entry.block_count = 0;
+			fix_entry(fsck,offset,&entry);
+		}
+		return;
+	}
+
+	uint32_t length,last;
+	int result = walk_chain(fsck,start,&length,&last,NULL,NULL);
+	int changed = 0;
+	if (result != CHAIN_OK) {
+		report(fsck,path,"%s after %u blocks",chain_fault(result),length);
+		if (length > 0) fix_truncate(fsck,last);
+		else entry.starting_block = 0;
+		changed = 1;
+	}
+	if (block_count != length) {
+		if (result == CHAIN_OK) report(fsck,path,"records %u blocks but its chain has %u",block_count,length);
+		entry.block_count = htonl(length);
+		changed = 1;
+	}
+	if ((uint64_t)size > (uint64_t)length * block_size) {
+		if (result == CHAIN_OK) report(fsck,path,"size %u does not fit in its %u blocks",size,length);
+		entry.size = htonl((uint64_t)length * block_size);
+		changed = 1;
+	}
+	if (changed) fix_entry(fsck,offset,&entry);
+	return;
+}
+
+// Function check_dir, checks one directory's chain and every entry in it
+// Files are checked here, subdirectories are queued for any worker
+void check_dir(fsck_t *fsck,dir_job_t *job) {
+	fs_t *fs = fsck->fs;
+	uint32_t block_size = fs->super_block.block_size;
+	uint32_t per_block = block_size/sizeof(dir_entry_t);
+
+	fs_run_t *runs;
+	uint32_t run_count,length,last;
+	int result = walk_chain(fsck,job->start,&length,&last,&runs,&run_count);
+	if (result != CHAIN_OK) {
+		if (length == 0) {
+			// Nothing of this directory is its own, so its entry is removed
+			report(fsck,job->path,"directory %s",chain_fault(result));
+			if (job->entry_offset) {
+				dir_entry_t cleared = {0};
+				fix_entry(fsck,job->entry_offset,&cleared);
+			}
+			free(runs);
+			return;
+		}
+		report(fsck,job->path,"directory %s after %u blocks",chain_fault(result),length);
+		fix_truncate(fsck,last);
+	}
+	__atomic_fetch_add(&fsck->dirs,1,__ATOMIC_RELAXED);
+
+	// The blocks are read run by run, straight from the image
+	char *data = malloc((size_t)length * block_size + 1);
+	uint32_t *blocks = malloc((length + 1) * sizeof(uint32_t));
+	int fd = fileno(fs->fp);
+	uint32_t loaded = 0;
+	for (uint32_t r = 0; data && blocks && r < run_count; r++) {
+		size_t len = (size_t)runs[r].length * block_size;
+		off_t offset = fs_block_offset(fs,runs[r].start);
+		if (pread(fd,data + (size_t)loaded * block_size,len,offset) != (ssize_t)len) {
+			report(fsck,job->path,"directory block %u cannot be read",runs[r].start);
+			break;
+		}
+		fs_stats_io(FS_IO_READ,len,offset);
+		for (uint32_t b = 0; b < runs[r].length; b++) blocks[loaded + b] = runs[r].start + b;
+		loaded += runs[r].length;
+	}
+	free(runs);
+
+	size_t path_len = strlen(job->path);
+	FS_STAT_ADD(dir_entries_scanned,(uint64_t)loaded * per_block);
+	for (uint32_t b = 0; b < loaded; b++) {
+		for (uint32_t s = 0; s < per_block; s++) {
+			dir_entry_t entry;
+			memcpy(&entry,data + (size_t)b * block_size + s * sizeof(dir_entry_t),sizeof(entry));
+			if (entry.status == 0x00) continue;
+			off_t offset = fs_block_offset(fs,blocks[b]) + (off_t)s * sizeof(dir_entry_t);
+
+			char name[32];
+			fs_entry_name(&entry,name);
+			char *child = malloc(path_len + 34);
+			if (!child) continue;
+			sprintf(child,"%s%s%s",job->path,path_len > 0 && job->path[path_len - 1] == '/' ? "" : "/",name);
+
+			int is_file = (entry.status & FS_ENTRY_FILE) != 0,is_dir = (entry.status & FS_ENTRY_DIR) != 0;
+			if (is_file == is_dir || name[0] == '\0') {
+				report(fsck,child,"entry has invalid status 0x%02x or an empty name",entry.status);
+				dir_entry_t cleared = {0};
+				fix_entry(fsck,offset,&cleared);
+				free(child);
+			} else if (is_file) {
+				__atomic_fetch_add(&fsck->files,1,__ATOMIC_RELAXED);
+				check_file(fsck,child,offset,entry);
+				free(child);
+			} else if (job->depth + 1 > FS_MAX_DEPTH) {
+				report(fsck,child,"directory is nested more than %d deep",FS_MAX_DEPTH);
+				free(child);
+			} else {
+				dir_job_t *sub = calloc(1,sizeof(dir_job_t));
+				if (!sub) {
+					free(child);
+					continue;
+				}
+				sub->start = ntohl(entry.starting_block);
+				sub->path = child;
+				sub->depth = job->depth + 1;
+				sub->entry_offset = offset;
+				push_dir(fsck,sub);
+			}
+		}
+	}
+	free(blocks);
+	free(data);
+	return;
+}
+
+// Function check_worker, takes directories off the shared queue until the whole tree is done
+// The tree is done when the queue is empty and no worker is still checking a directory
+void *check_worker(void *arg) {
+	fsck_t *fsck = arg;
+	pthread_mutex_lock(&fsck->lock);
+	while (1) {
+		while (!fsck->queue && fsck->active > 0) pthread_cond_wait(&fsck->ready,&fsck->lock);
+		if (!fsck->queue) break;
+
+		dir_job_t *job = fsck->queue;
+		fsck->queue = job->next;
+		fsck->active++;
+		pthread_mutex_unlock(&fsck->lock);
+
+		check_dir(fsck,job);
+		free(job->path);
+		free(job);
+
+		pthread_mutex_lock(&fsck->lock);
+		if (--fsck->active == 0 && !fsck->queue) pthread_cond_broadcast(&fsck->ready);
+	}
+	pthread_mutex_unlock(&fsck->lock);
+	return NULL;
+}
+
+// Function compare_problem, orders problem lines by path
+int compare_problem(const void *a,const void *b) {
+	return strcmp(*(char *const *)a,*(char *const *)b);
+}
+
+int main(int argc,char *argv[]) {
+	fs_stats_init(&argc,argv);
+
+	// An image is needed as an argument, -y repairs what is found
+	if (argc < 2) {
+		printf("Usage: %s image [-y]\n",argv[0]);
+		exit(1);
+	}
+	int repair = argc > 2 && !strcmp(argv[2],"-y");
+
+	fs_t fs;
+	if (!fs_open(&fs,argv[1],repair ? "rb+" : "rb")) {
+		perror("Error: File Invalid");
+		exit(1);
+	}
+
+	fsck_t fsck = {0};
+	fsck.fs = &fs;
+	fsck.usable = fs.super_block.block_count < fs.fat_entries ? fs.super_block.block_count : fs.fat_entries;
+	fsck.claimed = calloc(fsck.usable/64 + 1,sizeof(uint64_t));
+	if (!fsck.claimed) {
+		perror("Error: Out of memory");
+		exit(1);
+	}
+	pthread_mutex_init(&fsck.lock,NULL);
+	pthread_cond_init(&fsck.ready,NULL);
+
+	// Blocks before the root belong to the file system itself
+	uint32_t root_start = fs.super_block.root_start;
+	for (uint32_t b = 0; b < root_start && b < fsck.usable; b++) {
+		claim(&fsck,b);
+		if (fs.fat[b] != FAT_RESERVED) report(&fsck,"/","metadata block %u is not marked reserved",b);
+	}
+
+	dir_job_t *root = calloc(1,sizeof(dir_job_t));
+	if (!root || !(root->path = strdup("/"))) {
+		perror("Error: Out of memory");
+		exit(1);
+	}
+	root->start = root_start;
+	fsck.queue = root;
+
+	// The tree is split across workers one directory at a time
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long workers = cpus > 0 ? cpus : 1;
+	if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+	pthread_t threads[MAX_WORKERS];
+	long started = 0;
+	for (long t = 1; t < workers; t++) {
+		if (pthread_create(&threads[started],NULL,check_worker,&fsck) == 0) started++;
+	}
+	check_worker(&fsck);
+	for (long t = 0; t < started; t++) pthread_join(threads[t],NULL);
+
+	// Any used block no chain reached is lost
+	uint64_t orphans = 0,in_use = 0;
+	for (uint32_t b = 0; b < fsck.usable; b++) {
+		uint32_t value = fs.fat[b];
+		if (is_claimed(&fsck,b)) in_use++;
+		else if (value != FAT_FREE) orphans++;
+	}
+	if (orphans) report(&fsck,"/","%llu blocks are marked used but belong to no file or directory",
+		(unsigned long long)orphans);
+	// diskformat reserves them, older images leave them free
+	for (uint32_t b = fsck.usable; b < fs.fat_entries; b++) {
+		if (fs.fat[b] != FAT_FREE && fs.fat[b] != FAT_RESERVED) {
+			report(&fsck,"/","FAT entries past the end of the image are in use");
+			break;
+		}
+	}
+
+	// Counters left clean but disagreeing with the FAT would mislead diskinfo
+	fs_census_t stored,actual = {0};
+	for (uint32_t b = 0; b < fs.fat_entries; b++) {
+		if (fs.fat[b] == FAT_FREE) actual.free_blocks++;
+		else if (fs.fat[b] == FAT_RESERVED) actual.reserved_blocks++;
+		else actual.allocated_blocks++;
+	}
+	int stale = fs_read_counters(&fs,&stored) && memcmp(&stored,&actual,sizeof(actual)) != 0;
+	if (stale) report(&fsck,"/","allocation counters in block 0 do not match the FAT");
+
+	qsort(fsck.problems,fsck.problem_count,sizeof(char *),compare_problem);
+	for (long i = 0; i < fsck.problem_count; i++) {
+		printf("%s\n",fsck.problems[i]);
+		free(fsck.problems[i]);
+	}
+	printf("%llu directories, %llu files, %llu blocks in use, %ld problems\n",
+		(unsigned long long)fsck.dirs,(unsigned long long)fsck.files,(unsigned long long)in_use,
+		fsck.problem_count);
+
+	int failed = fsck.problem_count > 0;
+	if (repair && failed) {
+		// Entries first, then chain ends, then the lost blocks are returned to the free pool
+		int ok = 1;
+		for (long i = 0; i < fsck.entry_fix_count; i++) {
+			entry_fix_t *fix = &fsck.entry_fixes[i];
+			if (pwrite(fileno(fs.fp),&fix->entry,sizeof(dir_entry_t),fix->offset) != sizeof(dir_entry_t)) ok = 0;
+			else fs_stats_io(FS_IO_WRITE,sizeof(dir_entry_t),fix->offset);
+		}
+		for (long i = 0; i < fsck.truncation_count; i++) fs_set_next(&fs,fsck.truncations[i],FAT_EOF);
+		for (uint32_t b = root_start; b < fsck.usable; b++) {
+			if (!is_claimed(&fsck,b) && fs.fat[b] != FAT_FREE) fs_set_next(&fs,b,FAT_FREE);
+		}
+		for (uint32_t b = 0; b < root_start && b < fsck.usable; b++) {
+			if (fs.fat[b] != FAT_RESERVED) fs_set_next(&fs,b,FAT_RESERVED);
+		}
+		for (uint32_t b = fsck.usable; b < fs.fat_entries; b++) {
+			if (fs.fat[b] != FAT_FREE && fs.fat[b] != FAT_RESERVED) fs_set_next(&fs,b,FAT_RESERVED);
+		}
+
+		// fs_flush rewrites the counters when the FAT changed, otherwise they are rewritten here
+		int fat_changed = fs.counters_open;
+		if (!fs_flush(&fs) || (stale && !fat_changed && !fs_commit_counters(&fs))) ok = 0;
+		if (!ok) {
+			perror("Error: Repair failed");
+			exit(1);
+		}
+		printf("Repaired %ld entries and %ld chains, freed %llu blocks\n",fsck.entry_fix_count,
+			fsck.truncation_count,(unsigned long long)orphans);
+		failed = 0;
+	}
+
+	fs_close(&fs);
+	free(fsck.claimed);
+	free(fsck.problems);
+	free(fsck.entry_fixes);
+	free(fsck.truncations);
+	return failed;
+}
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+// Structure gen_opts_t, the shape of the image to generate
+typedef struct {
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t root_blocks;
+	uint32_t depth;
+	uint32_t fanout;
+	uint32_t files;
+	uint32_t min_size;
+	uint32_t max_size;
+	int log_sizes;
+	uint32_t fragmentation;
+	uint64_t seed;
+} gen_opts_t;
+
+// Structure gen_t, the generator's state while it fills the image
+typedef struct {
+	fs_t *fs;
+	const gen_opts_t *opts;
+	uint64_t rng;
+	uint32_t *spacers;
+	uint32_t spacer_count;
+	uint32_t spacer_capacity;
+	char *data;
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t bytes;
+	uint64_t fragments;
+	int full;
+} gen_t;
+
+// Function next_random, xorshift64*, so an image is fully determined by its seed
+uint64_t next_random(gen_t *gen) {
+	gen->rng ^= gen->rng >> 12;
+	gen->rng ^= gen->rng << 25;
+	gen->rng ^= gen->rng >> 27;
+	return gen->rng * 2685821657736338717ull;
+}
+
+// Function pick_size, draws a file size between min_size and max_size
+// The log distribution picks a power of two range first, so small files are as common as large ones
+uint32_t pick_size(gen_t *gen) {
+	uint32_t lo = gen->opts->min_size,hi = gen->opts->max_size;
+	if (hi <= lo) return lo;
+	if (!gen->opts->log_sizes) return lo + next_random(gen) % (hi - lo + 1);
+
+	uint32_t lo_bits = 31 - __builtin_clz(lo ? lo : 1),hi_bits = 31 - __builtin_clz(hi);
+	uint32_t bits = lo_bits + next_random(gen) % (hi_bits - lo_bits + 1);
+	uint64_t base = 1ull << bits;
+	uint64_t size = base + next_random(gen) % base;
+	if (size < lo) size = lo;
+	if (size > hi) size = hi;
+	return size;
+}
+
+// Function take_spacer, allocates one block to hold back until the end, splitting free space
+// Returns 1 if successful, 0 otherwise
+int take_spacer(gen_t *gen) {
+	if (gen->spacer_count == gen->spacer_capacity) {
+		uint32_t capacity = gen->spacer_capacity ? gen->spacer_capacity * 2 : 256;
+		uint32_t *spacers = realloc(gen->spacers,capacity * sizeof(uint32_t));
+		if (!spacers) return 0;
+		gen->spacers = spacers;
+		gen->spacer_capacity = capacity;
+	}
+	uint32_t block = fs_alloc_block(gen->fs);
+	if (block == 0) return 0;
+	gen->spacers[gen->spacer_count++] = block;
+	return 1;
+}
+
+// Function release_file, frees every block of a chain that no entry points to
+void release_file(fs_t *fs,uint32_t first) {
+	for (uint32_t b = first; b != FAT_EOF && b != 0; ) {
+		uint32_t next = fs_next_block(fs,b);
+		fs_set_next(fs,b,FAT_FREE);
+		b = next;
+	}
+	return;
+}
+
+// Function allocate_file, allocates a chain of blocks_needed blocks
+// With fragmentation set, the chain is cut into pieces with a held-back block between each,
+// so both the file and, once the spacers are freed, the free space are broken up
+// Returns the first block, or 0 if the image is full
+uint32_t allocate_file(gen_t *gen,uint32_t blocks_needed) {
+	fs_t *fs = gen->fs;
+	uint32_t first = 0,last = 0;
+
+	while (blocks_needed > 0) {
+		// Each block ends the current piece with probability fragmentation percent
+		uint32_t piece = 1;
+		while (piece < blocks_needed && next_random(gen) % 100 >= gen->opts->fragmentation) piece++;
+
+		fs_run_t *extents;
+		uint32_t count;
+		uint32_t start = fs_alloc_chain(fs,piece,&extents,&count);
+		if (start == 0) {
+			if (first) release_file(fs,first);
+			return 0;
+		}
+		if (first == 0) first = start;
+		else fs_set_next(fs,last,start);
+		last = extents[count - 1].start + extents[count - 1].length - 1;
+		gen->fragments += count;
+		free(extents);
+
+		blocks_needed -= piece;
+		// Without room for a spacer the next piece simply follows on
+		if (blocks_needed > 0 && gen->opts->fragmentation > 0) take_spacer(gen);
+	}
+	return first;
+}
+
+// Function write_data, fills a chain with size bytes of pseudo-random data
+// Returns 1 if successful, 0 otherwise
+int write_data(gen_t *gen,uint32_t first,uint32_t size) {
+	fs_t *fs = gen->fs;
+	for (uint32_t i = 0; i < size; i += 8) {
+		uint64_t r = next_random(gen);
+		memcpy(gen->data + i,&r,size - i < 8 ? size - i : 8);
+	}
+
+	uint32_t block_size = fs->super_block.block_size;
+	fs_run_t *runs;
+	uint32_t count = fs_chain_extents(fs,first,(size + block_size - 1)/block_size,&runs);
+	int fd = fileno(fs->fp);
+	uint64_t done = 0;
+	int ok = 1;
+	for (uint32_t r = 0; r < count && done < size && ok; r++) {
+		uint64_t len = (uint64_t)runs[r].length * block_size;
+		if (len > size - done) len = size - done;
+		off_t offset = fs_block_offset(fs,runs[r].start);
+		ok = pwrite(fd,gen->data + done,len,offset) == (ssize_t)len;
+		fs_stats_io(FS_IO_WRITE,len,offset);
+		done += len;
+	}
+	free(runs);
+	return ok && done == size;
+}
+
+// Function add_file, creates one file of random size in a directory
+// A file that cannot be written or entered in its directory gives its blocks back
+// Returns 1 if successful, 0 once the image is full
+int add_file(gen_t *gen,uint32_t dir_start,const char *name) {
+	fs_t *fs = gen->fs;
+	uint32_t block_size = fs->super_block.block_size;
+	uint32_t size = pick_size(gen);
+	uint32_t blocks = (size + block_size - 1)/block_size;
+
+	uint32_t first = 0;
+	if (blocks > 0) {
+		first = allocate_file(gen,blocks);
+		if (first == 0) return 0;
+		if (!write_data(gen,first,size)) {
+			release_file(fs,first);
+			return 0;
+		}
+	}
+
+	dir_entry_t entry = {0};
+	entry.status = FS_ENTRY_FILE;
+	strncpy(entry.name,name,sizeof(entry.name)-1);
+	entry.starting_block = htonl(first);
+	entry.block_count = htonl(blocks);
+	entry.size = htonl(size);
+	fs_fill_timestamp(&entry);
+	if (!fs_dir_add(fs,dir_start,&entry)) {
+		release_file(fs,first);
+		return 0;
+	}
+
+	gen->files++;
+	gen->bytes += size;
+	return 1;
+}
+
+// Function fill_directory, creates the files of a directory and then its subdirectories
+// Returns 1 if successful, 0 once the image is full
+int fill_directory(gen_t *gen,const char *path,uint32_t dir_start,uint32_t depth) {
+	char name[32];
+	for (uint32_t i = 0; i < gen->opts->files; i++) {
+		snprintf(name,sizeof(name),"f%04u.bin",i);
+		if (!add_file(gen,dir_start,name)) return 0;
+	}
+	if (depth >= gen->opts->depth) return 1;
+
+	for (uint32_t i = 0; i < gen->opts->fanout; i++) {
+		char *sub = malloc(strlen(path) + 16);
+		if (!sub) return 0;
+		sprintf(sub,"%s/d%04u",strcmp(path,"/") ? path : "",i);
+
+		uint32_t sub_start,sub_blocks;
+		int ok = fs_resolve_path(gen->fs,sub,1,&sub_start,&sub_blocks);
+		if (ok) {
+			gen->dirs++;
+			ok = fill_directory(gen,sub,sub_start,depth + 1);
+		}
+		free(sub);
+		if (!ok) return 0;
+	}
+	return 1;
+}
+
+// Function parse_size, reads a size with an optional K, M or G suffix
+uint64_t parse_size(const char *arg) {
+	char *end;
+	uint64_t value = strtoull(arg,&end,10);
+	if (*end == 'K' || *end == 'k') value <<= 10;
+	else if (*end == 'M' || *end == 'm') value <<= 20;
+	else if (*end == 'G' || *end == 'g') value <<= 30;
+	return value;
+}
+
+int main(int argc,char *argv[]) {
+	fs_stats_init(&argc,argv);
+
+	// An image path is needed as an argument
+	if (argc < 2) {
+		printf("Usage: %s image [-b block_size] [-n block_count] [-R root_blocks] [-d depth] [-f fanout]\n"
+			"       [-F files_per_dir] [-s min_size] [-S max_size] [-D log|uniform] [-p frag_percent] [-r seed]\n",
+			argv[0]);
+		exit(1);
+	}
+
+	gen_opts_t opts = {512,262144,8,3,4,8,1024,256 << 10,1,0,1};
+	for (int i = 2; i < argc; i += 2) {
+		const char *flag = argv[i],*value = argv[i + 1];
+		if (i + 1 == argc) {
+			printf("Option %s needs a value\n",flag);
+			exit(1);
+		}
+		if (!strcmp(flag,"-b")) opts.block_size = parse_size(value);
+		else if (!strcmp(flag,"-n")) opts.block_count = parse_size(value);
+		else if (!strcmp(flag,"-R")) opts.root_blocks = parse_size(value);
+		else if (!strcmp(flag,"-d")) opts.depth = parse_size(value);
+		else if (!strcmp(flag,"-f")) opts.fanout = parse_size(value);
+		else if (!strcmp(flag,"-F")) opts.files = parse_size(value);
+		else if (!strcmp(flag,"-s")) opts.min_size = parse_size(value);
+		else if (!strcmp(flag,"-S")) opts.max_size = parse_size(value);
+		else if (!strcmp(flag,"-D")) opts.log_sizes = strcmp(value,"uniform") != 0;
+		else if (!strcmp(flag,"-p")) opts.fragmentation = parse_size(value);
+		else if (!strcmp(flag,"-r")) opts.seed = parse_size(value);
+		else {
+			printf("Unknown option %s\n",flag);
+			exit(1);
+		}
+	}
+	if (opts.fragmentation > 100) {
+		printf("Invalid image shape\n");
+		exit(1);
+	}
+
+	if (!fs_format(argv[1],opts.block_size,opts.block_count,opts.root_blocks,0)) {
+		perror("Error: Cannot create image");
+		exit(1);
+	}
+
+	fs_t fs;
+	if (!fs_open(&fs,argv[1],"rb+")) {
+		perror("Error: File Invalid");
+		exit(1);
+	}
+
+	gen_t gen = {0};
+	gen.fs = &fs;
+	gen.opts = &opts;
+	gen.rng = opts.seed ? opts.seed : 1;
+	gen.data = malloc(opts.max_size > opts.min_size ? opts.max_size + 8 : opts.min_size + 8);
+	if (!gen.data) {
+		perror("Error: Out of memory");
+		exit(1);
+	}
+
+	// Stops early, keeping what was made, when the image fills up
+	gen.full = !fill_directory(&gen,"/",fs.super_block.root_start,0);
+
+	// Releases the held-back blocks, leaving holes between the pieces of fragmented files
+	for (uint32_t i = 0; i < gen.spacer_count; i++) fs_set_next(&fs,gen.spacers[i],FAT_FREE);
+
+	if (!fs_flush(&fs)) {
+		perror("Error: FAT write-back failed");
+		exit(1);
+	}
+	fs_close(&fs);
+
+	printf("%llu files, %llu directories, %llu bytes, %llu extents%s\n",
+		(unsigned long long)gen.files,(unsigned long long)gen.dirs,
+		(unsigned long long)gen.bytes,(unsigned long long)gen.fragments,
+		gen.full ? " (image full)" : "");
+	free(gen.spacers);
+	free(gen.data);
+	return 0;
+}
@@ -3,270 +3,349 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
-#define FAT_EOF 0xFFFFFFFF
+#include "fs.h"
 
-// Structure super_block_t, stores information for the superblock
-typedef struct {
-	uint16_t block_size;
-	uint32_t block_count;
-	uint32_t fat_start;
-	uint32_t fat_blocks;
-	uint32_t root_start;
-	uint32_t root_blocks;
-} __attribute__((packed)) super_block_t;
-
-// Structure dir_entry_t, stores information about directory entries
-typedef struct {
-	uint8_t status;
-	uint32_t starting_block;
-	uint32_t block_count;
-	uint32_t size;
-	uint8_t created[7];
-	uint8_t modified[7];
-	char name[31];
-	uint8_t unused[6];
-} __attribute__((packed)) dir_entry_t;
-
-// Function find_subdir, returns 1 if found, 0 if not
-// Takes filepath, start blcok, block count, block size, target directory, and output variables as input
-int find_subdir (FILE *fp, uint32_t start_block, uint32_t block_count,
-		uint16_t block_size, char *target,
-		uint32_t *out_start, uint32_t *out_blocks) {
-	// Finds offset of target
-	off_t offset = (off_t)start_block * block_size;
-	// Finds size of target
-	size_t size = (size_t)block_count * block_size;
-
-	// Moves to target
-	fseek(fp,offset,SEEK_SET);
+// Function find_file, locates the target file within a directory
+// Returns 1 if successful, 0 otherwise
+// Saves target entry to out_entry
+int find_file(fs_t *fs,uint32_t start,const char *filename,dir_entry_t *out_entry) {
+	// Looks the name up in the directory's hash index, which is built on first access
+	return fs_dir_lookup(fs,start,filename,FS_ENTRY_FILE,out_entry);
+}
 
-	dir_entry_t entry;
-	size_t entries = size/sizeof(dir_entry_t);
-
-	// Iterates until target is found
-	for (size_t i = 0; i < entries; i++) {
-		if (fread(&entry,sizeof(dir_entry_t),1,fp) != 1) break;
-		if (entry.status == 0x00) continue; // Unused
-
-		// A directory is found
-		if (entry.status & (1 << 2)) {
-			// Copies entry name
-			char name_buf[32];
-			memcpy(name_buf,entry.name,31);
-			name_buf[31] = '\0';
-
-			// Trims trailing spaces
-			for (int j = 30; j >= 0; j--) {
-				if (name_buf[j] == '\0' || name_buf[j] == ' ' || name_buf[j] == 0x00) name_buf[j] = '\0';
-				else break;
-			}
-
-			// Compares current entry to target directory
-			if (strcmp(name_buf,target) == 0) {
-				*out_start = ntohl(entry.starting_block);
-				*out_blocks = ntohl(entry.block_count);
-				return 1;
-			}
-		}
-	}
-	return 0; // Target not found
+// Function open_output, opens the host file to write, - is standard output
+// Returns the descriptor, or -1 on failure
+int open_output(const char *filename) {
+	if (!strcmp(filename,"-")) return STDOUT_FILENO;
+	return open(filename,O_WRONLY | O_CREAT | O_TRUNC,0666);
 }
 
-// Function resolve_path, uses find_subdir to locate a specified subdirectory
-// Supports multiple levels of subdirectories by using string tokenization
+// Function close_output, closes a descriptor from open_output
 // Returns 1 if successful, 0 otherwise
-int resolve_path(FILE *fp,uint32_t root_start,uint32_t root_blocks,uint32_t block_size,
-		const char *path,uint32_t *out_start,uint32_t *out_blocks) {
+int close_output(int out) {
+	if (out == STDOUT_FILENO) return 1;
+	return close(out) == 0;
+}
 
-	// Skip leading slash if present
-    	if (path[0] == '/') path++;
+// Function copy_file, copies the target file to the user's current directory
+// Entry to be copied and new filename are given as arguments
+// Returns 1 if successful, 0 otherwise
+int copy_file(fs_t *fs,const dir_entry_t *entry,const char *filename) {
+	// Opens the new file to write binary in
+	int out = open_output(filename);
+	if (out < 0) return 0;
 
-    	// Make a copy of the path for strtok
-    	char *path_copy = strdup(path);
-    	if (!path_copy) return 0;
+	// Moves each run of consecutive blocks in the chain with a single transfer
+	int ok = fs_copy_to_fd(fs,ntohl(entry->starting_block),ntohl(entry->size),out);
 
-    	// Path is broken down into sections seperated by /, which indicates subdirectories
-    	char *token = strtok(path_copy, "/");
-    	uint32_t current_start = root_start;
-    	uint32_t current_blocks = root_blocks;
+	if (!close_output(out)) ok = 0;
+	return ok;
+}
 
-    	// Checks each token
-    	while (token) {
-        	uint32_t sub_start = 0, sub_blocks = 0;
+// Function lookup_file, finds the directory entry for a file given by its full image path
+// Prints a message and returns 0 if it is not found, returns 1 otherwise
+int lookup_file(fs_t *fs,const char *image_path,dir_entry_t *out_entry) {
+	// Copies path and seperates filename
+	char *dirpath,*filename;
+	if (!fs_split_path(image_path,&dirpath,&filename)) return 0;
 
-        	// Calls find_subdir to determine if the subdirectory is present
-        	if (!find_subdir(fp,current_start,current_blocks,block_size,token,&sub_start,&sub_blocks)) {
-            		free(path_copy);
-            		return 0;
-        	}
+	uint32_t dir_start,dir_blocks;
 
-        	// Advance into the found subdirectory
-        	current_start = sub_start;
-        	current_blocks = sub_blocks;
+	// Attempts to find the directory, then the file within it
+	int found = fs_resolve_path(fs,dirpath,0,&dir_start,&dir_blocks) &&
+		find_file(fs,dir_start,filename,out_entry);
+	if (!found) printf("Requested file %s not found in %s.\n",filename,dirpath);
 
-        	token = strtok(NULL, "/");
-    	}
+	free(dirpath);
+	return found;
+}
 
-    	free(path_copy);
+// Structure get_job_t, one file to extract in batch mode
+typedef struct {
+	dir_entry_t entry;
+	const char *host_path;
+} get_job_t;
+
+// Function compare_directory, orders manifest pairs by image directory, then by name
+int compare_directory(const void *a,const void *b) {
+	const char *x = ((const fs_pair_t *)a)->source,*y = ((const fs_pair_t *)b)->source;
+	const char *xs = strrchr(x,'/'),*ys = strrchr(y,'/');
+	size_t xl = xs ? (size_t)(xs - x) : 0,yl = ys ? (size_t)(ys - y) : 0;
+	int cmp = strncmp(x,y,xl < yl ? xl : yl);
+	if (cmp == 0 && xl != yl) return xl < yl ? -1 : 1;
+	if (cmp == 0) cmp = strcmp(x,y);
+	return cmp;
+}
 
-    	*out_start = current_start;
-    	*out_blocks = current_blocks;
-    	return 1;
+// Function compare_position, orders batch jobs by the first block of each file
+int compare_position(const void *a,const void *b) {
+	uint32_t x = ntohl(((const get_job_t *)a)->entry.starting_block);
+	uint32_t y = ntohl(((const get_job_t *)b)->entry.starting_block);
+	return x < y ? -1 : x > y;
 }
 
-// Function find_file, locates the target file within a directory
-// Returns 1 if successful, 0 otherwise
-// Saves target entry to out_entry
-int find_file(FILE *fp,uint32_t start,uint32_t blocks,uint32_t fat_start,uint32_t block_size,
-		const char *filename, dir_entry_t *out_entry) {
-	size_t block_entries = block_size/sizeof(dir_entry_t);
-	dir_entry_t entry;
+// Function get_batch, extracts every (image path, host path) pair in a manifest
+// Lookups are grouped by directory, then files are copied in order of their position in the image
+// Returns the number of files that failed
+long get_batch(fs_t *fs,const char *manifest) {
+	fs_pair_t *pairs;
+	long count = fs_manifest_read(manifest,&pairs);
+	if (count < 0) {
+		perror("Error: Manifest Invalid");
+		return 1;
+	}
 
-	uint32_t current = start;
-	
-	// Iterates through every entry in the directory
-	while (current != FAT_EOF) {
-		fseek(fp,(off_t)current * block_size,SEEK_SET);
-		for (size_t i = 0; i < block_entries; i++) {
-			if (fread(&entry,sizeof(dir_entry_t),1,fp) != 1) break;
-			if (entry.status == 0x00) continue;
-
-			char name_buf[32];
-			strncpy(name_buf,entry.name,sizeof(name_buf)-1);
-			name_buf[31] = '\0';
-
-			// Checks file type and name with target
-			if (entry.status & (1 << 1) && !strcmp(name_buf,filename)) {
-				*out_entry = entry;
-				return 1;
-			}
+	// Resolves every file first, one directory at a time
+	qsort(pairs,count,sizeof(fs_pair_t),compare_directory);
+	get_job_t *jobs = malloc((count + 1) * sizeof(get_job_t));
+	if (!jobs) {
+		fs_manifest_free(pairs,count);
+		return count;
+	}
+	long job_count = 0,failed = 0;
+	for (long i = 0; i < count; i++) {
+		if (lookup_file(fs,pairs[i].source,&jobs[job_count].entry)) {
+			jobs[job_count++].host_path = pairs[i].dest;
+		} else {
+			failed++;
 		}
-		off_t offset = (off_t)fat_start * block_size + (off_t)current * sizeof(uint32_t);
-		fseek(fp,offset,SEEK_SET);
-		fread(&current,sizeof(uint32_t),1,fp);
-		current = ntohl(current);
 	}
-	return 0;
+
+	// Then copies them in a single sweep across the image
+	qsort(jobs,job_count,sizeof(get_job_t),compare_position);
+	for (long i = 0; i < job_count; i++) {
+		if (!copy_file(fs,&jobs[i].entry,jobs[i].host_path)) {
+			fprintf(stderr,"Error: Copy to %s failed\n",jobs[i].host_path);
+			failed++;
+		}
+	}
+
+	free(jobs);
+	fs_manifest_free(pairs,count);
+	return failed;
 }
 
-// Function copy_file, copies the target file to the user's current directory
-// Entry to be copied and new filename are given as arguments
-void copy_file(FILE *fp,uint32_t fat_start,uint32_t block_size,const dir_entry_t *entry,
-		const char *filename) {
-	// Opens the new file to write binary in
-	FILE *out = fopen(filename,"wb");
-	
-	uint32_t current = ntohl(entry->starting_block);
-	uint32_t remaining = ntohl(entry->size);
-
-	// Writes everything until the end of the file
-	while (current != FAT_EOF && remaining > 0) {
-		fseek(fp,(off_t)current * block_size,SEEK_SET);
-
-		size_t to_read = remaining < block_size ? remaining : block_size;
-		char *buf = malloc(block_size);
-		fread(buf,1,to_read,fp); // Reads from file
-		fwrite(buf,1,to_read,out); // Writes to new file
-		free(buf);
-
-		remaining -= to_read;
-
-		off_t offset = (off_t)fat_start * block_size + (off_t)current * sizeof(uint32_t);
-		fseek(fp,offset,SEEK_SET);
-		fread(&current,sizeof(uint32_t),1,fp);
-		current = ntohl(current);
+// Most worker threads used by recursive extraction
+#define MAX_WORKERS 16
+
+// Structure tree_t, the files collected for a recursive extraction and the workers' progress
+typedef struct {
+	const char *image_root;
+	const char *host_root;
+	fs_t *fs;
+	get_job_t *jobs;
+	long count;
+	long capacity;
+	long next;
+	long failed;
+} tree_t;
+
+// Function host_path_for, maps an image path under image_root to the same place under host_root
+char *host_path_for(const tree_t *tree,const char *image_path) {
+	const char *rest = image_path + strlen(tree->image_root);
+	while (*rest == '/') rest++;
+	char *host = malloc(strlen(tree->host_root) + strlen(rest) + 2);
+	if (host) sprintf(host,"%s/%s",tree->host_root,rest);
+	return host;
+}
+
+// Function safe_name, checks that an entry's name can be joined to a host path without leaving it
+// Returns 1 if the name is usable, 0 if it is empty, . or .., or holds a /
+int safe_name(const dir_entry_t *entry) {
+	char name[32];
+	fs_entry_name(entry,name);
+	return name[0] != '\0' && strcmp(name,".") && strcmp(name,"..") && !strchr(name,'/');
+}
+
+// Function collect_entry, fs_walk callback that mirrors directories and queues files
+// Entries whose names would escape host_root are reported and skipped, along with anything below them
+int collect_entry(fs_t *fs,const char *path,const dir_entry_t *entry,void *arg) {
+	tree_t *tree = arg;
+	if (!safe_name(entry)) {
+		fprintf(stderr,"Error: Skipping %s, its name is not a valid host file name\n",path);
+		tree->failed++;
+		return 0;
+	}
+
+	char *host = host_path_for(tree,path);
+	if (!host) {
+		tree->failed++;
+		return 0;
 	}
-	fclose(out);
-	return;
+
+	if (entry->status & FS_ENTRY_DIR) {
+		if (mkdir(host,0777) != 0 && errno != EEXIST) {
+			fprintf(stderr,"Error: Cannot create %s\n",host);
+			tree->failed++;
+			free(host);
+			return 0;
+		}
+		free(host);
+		return 1;
+	}
+
+	if (tree->count == tree->capacity) {
+		long capacity = tree->capacity ? tree->capacity * 2 : 256;
+		get_job_t *jobs = realloc(tree->jobs,capacity * sizeof(get_job_t));
+		if (!jobs) {
+			tree->failed++;
+			free(host);
+			return 0;
+		}
+		tree->jobs = jobs;
+		tree->capacity = capacity;
+	}
+	tree->jobs[tree->count].entry = *entry;
+	tree->jobs[tree->count].host_path = host;
+	tree->count++;
+	return 1;
+}
+
+// Function extract_worker, takes files off the shared list until none are left
+// Every read is positional, so workers never share a file position
+void *extract_worker(void *arg) {
+	tree_t *tree = arg;
+	long i;
+	while ((i = __atomic_fetch_add(&tree->next,1,__ATOMIC_RELAXED)) < tree->count) {
+		if (!copy_file(tree->fs,&tree->jobs[i].entry,tree->jobs[i].host_path)) {
+			fprintf(stderr,"Error: Copy to %s failed\n",tree->jobs[i].host_path);
+			__atomic_fetch_add(&tree->failed,1,__ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+// Function get_tree, extracts every file below an image directory into a host directory
+// The subtree is walked once, then files are copied in image order by a pool of threads
+// Returns the number of files that failed
+long get_tree(fs_t *fs,const char *image_dir,const char *host_dir) {
+	uint32_t dir_start,dir_blocks;
+	if (!fs_resolve_path(fs,image_dir,0,&dir_start,&dir_blocks)) {
+		printf("Subdirectory \'%s\' not found\n",image_dir);
+		return 1;
+	}
+	if (mkdir(host_dir,0777) != 0 && errno != EEXIST) {
+		perror("Error: Cannot create output directory");
+		return 1;
+	}
+
+	tree_t tree = {0};
+	tree.image_root = image_dir;
+	tree.host_root = host_dir;
+	tree.fs = fs;
+	if (!fs_walk(fs,dir_start,image_dir,collect_entry,&tree)) tree.failed++;
+
+	// Workers pull files in order of their position in the image
+	qsort(tree.jobs,tree.count,sizeof(get_job_t),compare_position);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long workers = cpus > 0 ? cpus : 1;
+	if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+	if (workers > tree.count) workers = tree.count;
+
+	pthread_t threads[MAX_WORKERS];
+	long started = 0;
+	for (long t = 1; t < workers; t++) {
+		if (pthread_create(&threads[started],NULL,extract_worker,&tree) == 0) started++;
+	}
+	extract_worker(&tree);
+	for (long t = 0; t < started; t++) pthread_join(threads[t],NULL);
+
+	for (long i = 0; i < tree.count; i++) free((char *)tree.jobs[i].host_path);
+	free(tree.jobs);
+	return tree.failed;
+}
+
+// Function get_remote, asks an image server for a file and writes it to host_path
+// Prints a message and returns 0 on failure, returns 1 otherwise
+int get_remote(int server,const char *image_path,const char *host_path) {
+	fs_msg_t msg;
+	if (!fs_send_msg(server,FS_OP_GET,0,image_path,0) || !fs_recv_msg(server,&msg)) {
+		perror("Error: Server request failed");
+		return 0;
+	}
+	if (msg.status != FS_STATUS_OK) {
+		printf("Requested file %s: %s.\n",image_path,fs_status_message(msg.status));
+		return 0;
+	}
+
+	int out = open_output(host_path);
+	if (out < 0) {
+		perror("Error: Copy failed");
+		return 0;
+	}
+	int ok = fs_relay(server,out,msg.length);
+	if (!close_output(out)) ok = 0;
+	if (!ok) perror("Error: Copy failed");
+	return ok;
 }
 
 int main(int argc,char *argv[]) {
-	// A filename is needed as an argument
-	if (argc < 3) {
+	fs_stats_init(&argc,argv);
+	fs_aio_init(&argc,argv);
+
+	// A filename and either a file pair or a batch manifest are needed as arguments
+	if (argc < 4) {
 		perror("Error: Not enough arguments");
 		exit(1);
 	}
 
-	// Skips the file system ID, which is 8 bytes
-	off_t offset = 8;
-	// Creates a new super_block struct and allocates memory
-	super_block_t *super_block = malloc(sizeof(super_block_t));
+	// A socket is served by a running diskserve, which handles single files
+	int server = fs_connect(argv[1]);
+	if (server >= 0) {
+		if (!strcmp(argv[2],"-b") || !strcmp(argv[2],"-r")) {
+			printf("Batch and recursive modes need the image itself\n");
+			exit(1);
+		}
+		int ok = get_remote(server,argv[2],argv[3]);
+		close(server);
+		return ok ? 0 : 1;
+	}
 
-	// Opens the inputted file in read binary mode
-	FILE* fp = fopen(argv[1],"rb");
-	
-	if (!fp) {
+	// Opens the inputted file, loading the superblock and FAT into memory
+	fs_t fs;
+	if (!fs_open_flags(&fs,argv[1],"rb",fs_aio_direct ? FS_OPEN_DIRECT : 0)) {
 		perror("Error: File Invalid");
 		exit(1);
 	}
+	if (fs_aio_direct && !fs.direct_align) fprintf(stderr,"Direct I/O unavailable, using the page cache\n");
 
-	// Moves to the specified offset, after the ID
-	fseek(fp,offset,SEEK_SET);
-	// Reads superblock information to the struct
-	fread(super_block,sizeof(super_block_t),1,fp);
-
-	// Superblock values are converted to the correct endianness
-	super_block->block_size = ntohs(super_block->block_size);
-	super_block->block_count = ntohl(super_block->block_count);
-	super_block->fat_start = ntohl(super_block->fat_start);
-	super_block->fat_blocks = ntohl(super_block->fat_blocks);
-	super_block->root_start = ntohl(super_block->root_start);
-	super_block->root_blocks = ntohl(super_block->root_blocks);
-
-	// Determines size of the FAT
-	size_t fat_size = super_block->block_size * super_block->fat_blocks;
-	
-	// Used to hold values read from the file
-	uint32_t *fat_table = malloc(fat_size);
-
-	// Moves to the start of the FAT
-	offset = super_block->block_size * super_block->fat_start;
-	fseek(fp,offset,SEEK_SET);
-	// Reads the FAT to fat_table
-	fread(fat_table,sizeof(uint32_t),fat_size/sizeof(uint32_t),fp);
-
-	// Copies path and seperates filename
-	char *path_copy = strdup(argv[2]);
-	char *filename = strrchr(path_copy, '/');
-	char *dirpath;
-
-	// Checks if target file is in the root directory
-	if (filename) {
-		*filename++ = '\0'; // Removes dirpath from filename
-		dirpath = path_copy;
-	} else {
-		filename = path_copy;
-		dirpath = "/"; // Root
+	// Batch mode, -b reads (image path, host path) pairs from a manifest or - for stdin
+	if (!strcmp(argv[2],"-b")) {
+		long failed = get_batch(&fs,argv[3]);
+		fs_close(&fs);
+		return failed ? 1 : 0;
 	}
 
-	uint32_t dir_start,dir_blocks;
-
-	// Attempts to find the directory of the target file
-	if (!resolve_path(fp, super_block->root_start, super_block->root_blocks,
-					super_block->block_size,dirpath,&dir_start,&dir_blocks)) {
-		printf("Requested file %s not found in %s.\n",filename,dirpath);
-		exit(1);
+	// Recursive mode, -r copies a whole image directory into a host directory
+	if (!strcmp(argv[2],"-r")) {
+		if (argc < 5) {
+			printf("Usage: %s image -r image_dir host_dir\n",argv[0]);
+			exit(1);
+		}
+		long failed = get_tree(&fs,argv[3],argv[4]);
+		fs_close(&fs);
+		return failed ? 1 : 0;
 	}
 
 	dir_entry_t entry;
-	
-	// Attempts to find the target file in the directory
-	if (!find_file(fp,dir_start,dir_blocks,super_block->fat_start,super_block->block_size,filename,&entry)) {
-		printf("Requested file %s not found in %s.\n",filename,dirpath);
-		exit(1);
-	}
 
-	// Copies file to current directory
-	copy_file(fp,super_block->fat_start,super_block->block_size,&entry,argv[3]);
+	// Attempts to find the target file
+	if (!lookup_file(&fs,argv[2],&entry)) exit(1);
 
-	fclose(fp);
+	// Copies file to current directory
+	if (!copy_file(&fs,&entry,argv[3])) {
+		perror("Error: Copy failed");
+		exit(1);
+	}
 
-	// Free allocated memory
-	free(super_block);
-	free(fat_table);
-	free(path_copy);
+	fs_close(&fs);
 
 	return 0;
 }
-
@@ -3,16 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <endian.h>
+#include <unistd.h>
 
-// Structure super_block_t, stores information for the superblock
-typedef struct {
-	uint16_t block_size;
-	uint32_t block_count;
-	uint32_t fat_start;
-	uint32_t fat_blocks;
-	uint32_t root_start;
-	uint32_t root_blocks;
-} __attribute__((packed)) super_block_t;
+#include "fs.h"
 
 // Structure fat_t, stores information for the FAT
 typedef struct {
@@ -32,89 +26,111 @@ void print_super_block(super_block_t *super_block) {
 }
 
 
-// Function print_fat, finds and prints information about the FAT
-// Takes an FAT struct, FAT table from the file, and the size of the FAT as input
-// Prints to standard output
-void print_fat(fat_t *fat,uint32_t *fat_table,size_t fat_size) {
-	// Iterates through every block and increments values
-	for (uint32_t i = 0; i < fat_size/4; i++) {
-		switch (ntohl(fat_table[i])) {
-			case 0x00000000:
-				fat->free_blocks++;
-				break;
-			case 0x00000001:
-				fat->reserved_blocks++;
-				break;
-			default:
-				fat->allocated_blocks++;
-				break;
-		}
+// Function count_fat, fills the FAT struct with the number of each kind of block
+// Uses the counters persisted by writers when they are current, unless a scan is forced
+// Otherwise reads the whole FAT and counts it
+// Returns 1 if successful, 0 otherwise
+int count_fat(fs_t *fs,fat_t *fat,int force_scan) {
+	fs_census_t census;
+
+	if (force_scan || !fs_read_counters(fs,&census)) {
+		// Reads the FAT as stored, since counting does not need it decoded
+		uint32_t *fat_table = fs_read_raw_fat(fs);
+		if (!fat_table) return 0;
+
+		// Counts every kind of entry in one vectorized pass, without converting byte order
+		fs_fat_census(fat_table,fs->fat_entries,&census);
+		free(fat_table);
 	}
+
+	fat->free_blocks = census.free_blocks;
+	fat->reserved_blocks = census.reserved_blocks;
+	fat->allocated_blocks = census.allocated_blocks;
+	return 1;
+}
+
+// Function print_fat, prints information about the FAT
+// Takes a filled FAT struct as input, prints to standard output
+void print_fat(fat_t *fat) {
 	// Prints formatted information
 	printf("\nFAT information:\nFree blocks: %u\nReserved blocks: %u\nAllocated blocks: %u\n",
 			fat->free_blocks,fat->reserved_blocks,fat->allocated_blocks);
 	return;
 }
 
+// Function info_remote, asks an image server for the superblock and block counts and prints them
+// Returns 1 if successful, 0 otherwise
+int info_remote(int server) {
+	fs_msg_t msg;
+	fs_info_msg_t info;
+	if (!fs_send_msg(server,FS_OP_INFO,0,NULL,0) || !fs_recv_msg(server,&msg) ||
+			msg.status != FS_STATUS_OK || msg.length != sizeof(info) ||
+			!fs_recv_all(server,&info,sizeof(info))) {
+		return 0;
+	}
+
+	super_block_t super_block;
+	super_block.block_size = ntohs(info.super_block.block_size);
+	super_block.block_count = ntohl(info.super_block.block_count);
+	super_block.fat_start = ntohl(info.super_block.fat_start);
+	super_block.fat_blocks = ntohl(info.super_block.fat_blocks);
+	super_block.root_start = ntohl(info.super_block.root_start);
+	super_block.root_blocks = ntohl(info.super_block.root_blocks);
+
+	fat_t fat;
+	fat.free_blocks = be64toh(info.free_blocks);
+	fat.reserved_blocks = be64toh(info.reserved_blocks);
+	fat.allocated_blocks = be64toh(info.allocated_blocks);
+
+	print_super_block(&super_block);
+	print_fat(&fat);
+	return 1;
+}
+
 int main(int argc,char *argv[]) {
+	fs_stats_init(&argc,argv);
+
 	// A filename is needed as an argument
 	if (argc < 2) {
 		perror("Error: No file inputted");
 		exit(1);
 	}
 
-	// Skips the file system ID, which is 8 bytes
-	off_t offset = 8;
-	// Creates a new super_block struct and allocates memory
-	super_block_t *super_block = malloc(sizeof(super_block_t));
+	// A socket is served by a running diskserve, which already holds the counts
+	int server = fs_connect(argv[1]);
+	if (server >= 0) {
+		if (!info_remote(server)) {
+			perror("Error: Server request failed");
+			exit(1);
+		}
+		close(server);
+		return 0;
+	}
+
+	// --scan ignores the persisted counters and counts the FAT itself
+	int force_scan = argc > 2 && !strcmp(argv[2],"--scan");
+
+	// Opens the inputted file in read binary mode, loading only the superblock and counters
+	fs_t fs;
+	if (!fs_open_flags(&fs,argv[1],"rb",FS_OPEN_NO_FAT)) {
+		perror("Error: File Invalid");
+		exit(1);
+	}
 
-	// Opens the inputted file in read binary mode
-	FILE* fp = fopen(argv[1],"rb");
-	
-	if (!fp) {
+	// Creates FAT structure
+	fat_t fat = {0};
+	if (!count_fat(&fs,&fat,force_scan)) {
 		perror("Error: File Invalid");
 		exit(1);
 	}
 
-	// Moves to the specified offset, after the ID
-	fseek(fp,offset,SEEK_SET);
-	// Reads superblock information to the struct
-	fread(super_block,sizeof(super_block_t),1,fp);
-
-	// Superblock values are converted to the correct endianness
-	super_block->block_size = ntohs(super_block->block_size);
-	super_block->block_count = ntohl(super_block->block_count);
-	super_block->fat_start = ntohl(super_block->fat_start);
-	super_block->fat_blocks = ntohl(super_block->fat_blocks);
-	super_block->root_start = ntohl(super_block->root_start);
-	super_block->root_blocks = ntohl(super_block->root_blocks);
-
-	// Creates FAT structure and allocates memory
-	fat_t *fat = malloc(sizeof(fat_t));
-
-	// Determines size of the FAT
-	size_t fat_size = super_block->block_size * super_block->fat_blocks;
-	
-	// Used to hold values read from the file
-	uint32_t *fat_table = malloc(fat_size);
-
-	// Moves to the start of the FAT
-	offset = super_block->block_size * super_block->fat_start;
-	fseek(fp,offset,SEEK_SET);
-	// Reads the FAT to fat_table
-	fread(fat_table,sizeof(uint32_t),fat_size/sizeof(uint32_t),fp);
-
-	fclose(fp);
-	
 	// Prints the formatted superblock information
-	print_super_block(super_block);
+	print_super_block(&fs.super_block);
 
 	// Prints the formatted FAT information
-	print_fat(fat,fat_table,fat_size);
+	print_fat(&fat);
 
-	// Frees allocated memory
-	free(super_block);
-	free(fat);
+	fs_close(&fs);
 
 	return(0);
 }
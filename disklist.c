@@ -3,34 +3,62 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
-
-#define FAT_EOF 0xFFFFFFFF
-
-// Structure super_block_t, stores information for the superblock
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fs.h"
+
+// Most worker threads used by recursive listing
+#define MAX_WORKERS 16
+
+// Structure list_node_t, one directory of a recursive listing
+// Its lines are kept in the buffer of the worker that read it, children are in directory order
+typedef struct list_node {
+	char *path;
+	uint32_t start;
+	int depth;
+	int worker;
+	size_t out_offset;
+	size_t out_length;
+	int failed;
+	struct list_node **children;
+	uint32_t child_count;
+} list_node_t;
+
+// Structure list_worker_t, a worker's deque of directories and its output buffer
+// The owner pushes and pops at the bottom, other workers steal from the top
 typedef struct {
-	uint16_t block_size;
-	uint32_t block_count;
-	uint32_t fat_start;
-	uint32_t fat_blocks;
-	uint32_t root_start;
-	uint32_t root_blocks;
-} __attribute__((packed)) super_block_t;
-
-// Structure dir_entry_t, stores information about directory entries
+	pthread_mutex_t lock;
+	list_node_t **jobs;
+	long top;
+	long bottom;
+	long capacity;
+	char *out;
+	size_t out_length;
+	size_t out_capacity;
+} list_worker_t;
+
+// Structure list_tree_t, the state shared by the workers of a recursive listing
+// pending counts directories not yet listed, queued those sitting in a deque
 typedef struct {
-	uint8_t status;
-	uint32_t starting_block;
-	uint32_t block_count;
-	uint32_t size;
-	uint8_t created[7];
-	uint8_t modified[7];
-	char name[31];
-	uint8_t unused[6];
-} __attribute__((packed)) dir_entry_t;
+	fs_t *fs;
+	list_worker_t workers[MAX_WORKERS];
+	int worker_count;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle;
+	long pending;
+	long queued;
+} list_tree_t;
+
+// Structure list_arg_t, what a worker thread is started with
+typedef struct {
+	list_tree_t *tree;
+	int id;
+} list_arg_t;
 
 // Function format_time, turns the created time of an entry into a formatted string
 // Takes raw_time from file as input, returns formatted string
-void format_time(uint8_t raw[7],char *buf,size_t buf_size) {
+void format_time(const uint8_t raw[7],char *buf,size_t buf_size) {
 	uint16_t year = raw[0] | (raw[1] << 8);
    	uint8_t month = raw[2];
     	uint8_t day   = raw[3];
@@ -43,210 +71,368 @@ void format_time(uint8_t raw[7],char *buf,size_t buf_size) {
 	return;	
 }
 
-// Function list_directory, prints formatted string with contents of directory
-// Takes filepath, starting block, block count, and block size as input
-// Prints to standard output
-void list_directory(FILE *fp,uint32_t fat_start,uint16_t block_size,uint32_t start_block) {
-	// Stores the current block
-	uint32_t current = start_block;
-
-	// Offset for the next block
-	off_t offset;
-
-	// Loops until end of file is reached
-	while (current != FAT_EOF) {
-		fseek(fp,(off_t)current * block_size, SEEK_SET);
-
-		size_t entries = block_size/sizeof(dir_entry_t);
-		dir_entry_t entry;
+// Longest line format_entry writes, with its newline
+#define LINE_MAX_LENGTH 96
+
+// Function format_entry, writes one line describing a used directory entry to line
+// Returns the length of the line
+int format_entry(const dir_entry_t *entry,char *line) {
+	// Determines if entry is a file or directory
+	char type;
+	if (entry->status & (1 << 1)) type = 'F';
+	else type = 'D';
+
+	// Copies the filename to a string with a null terminator
+	char name_buf[32];
+	memcpy(name_buf,entry->name,31);
+	name_buf[31] = '\0';
+
+	// Formats the raw timestamp into a string
+	char time_buf[32];
+	format_time(entry->created,time_buf,sizeof(time_buf));
+
+	// Prins formatted information
+	return snprintf(line,LINE_MAX_LENGTH,"%c %10u %30s %s\n",
+		type,ntohl(entry->size),name_buf,time_buf);
+}
 
-		// Lists information for each entry
-		for (size_t i = 0; i < entries; i++) {
-			if (fread(&entry,sizeof(dir_entry_t),1,fp) != 1) break;
-			if (entry.status == 0x00) continue; // Unused
+// Function print_entry, prints one line describing a used directory entry
+void print_entry(const dir_entry_t *entry) {
+	char line[LINE_MAX_LENGTH];
+	format_entry(entry,line);
+	fputs(line,stdout);
+	return;
+}
 
-			// Determines if entry is a file or directory
-			char type;
-			if (entry.status & (1 << 1)) type = 'F';
-			else type = 'D';
+// Function list_remote, asks an image server for a directory's entries and prints them
+// Returns 1 if successful, 0 otherwise
+int list_remote(int server,const char *path) {
+	fs_msg_t msg;
+	if (!fs_send_msg(server,FS_OP_LIST,0,path,0) || !fs_recv_msg(server,&msg)) return 0;
+	if (msg.status == FS_STATUS_NOT_FOUND) {
+		printf("Subdirectory \'%s\' not found\n",path);
+		return 1;
+	}
+	if (msg.status != FS_STATUS_OK) return 0;
 
-			// Copies the filename to a string with a null terminator
-			char name_buf[32];
-			memcpy(name_buf,entry.name,31);
-			name_buf[31] = '\0';
+	dir_entry_t entry;
+	for (uint64_t i = 0; i < msg.length/sizeof(dir_entry_t); i++) {
+		if (!fs_recv_all(server,&entry,sizeof(entry))) return 0;
+		print_entry(&entry);
+	}
+	return 1;
+}
 
-			// Formats the raw timestamp into a string
-			char time_buf[20];
-			format_time(entry.created,time_buf,sizeof(time_buf));
+// Function list_directory, prints formatted string with contents of directory
+// Takes the image and starting block as input
+// Prints to standard output
+void list_directory(fs_t *fs,uint32_t start_block) {
+	int fd = fileno(fs->fp);
+	uint16_t block_size = fs->super_block.block_size;
+	char *block = malloc(block_size);
+	if (!block) return;
+
+	// The chain is laid out from the in-memory FAT first, so later blocks can be requested early
+	fs_run_t *runs;
+	uint32_t count = fs_chain_extents(fs,start_block,fs->fat_entries,&runs);
+	fs_prefetch_t pf;
+	fs_prefetch_start(&pf,fs,fd,runs,count);
+
+	// Loops until end of file is reached, stopping at a block that cannot be read
+	int ok = 1;
+	for (uint32_t r = 0; r < count && ok; r++) {
+		if (count > 1) fs_prefetch_at(&pf,r);
+		for (uint32_t b = 0; b < runs[r].length && ok; b++) {
+			// Each directory block is read whole with one call
+			off_t offset = fs_block_offset(fs,runs[r].start + b);
+			ssize_t got = pread(fd,block,block_size,offset);
+			ok = got > 0;
+			if (!ok) break;
+			fs_stats_io(FS_IO_READ,got,offset);
+
+			size_t entries = got/sizeof(dir_entry_t);
+			FS_STAT_ADD(dir_entries_scanned,entries);
+
+			// Lists information for each entry
+			for (size_t i = 0; i < entries; i++) {
+				dir_entry_t entry;
+				memcpy(&entry,block + i * sizeof(dir_entry_t),sizeof(entry));
+				if (entry.status == 0x00) continue; // Unused
+
+				print_entry(&entry);
+			}
+		}
+	}
+	free(runs);
+	free(block);
+	return;
+}
 
-			// Prins formatted information
-			printf("%c %10u %30s %s\n",
-				type,ntohl(entry.size),name_buf,time_buf);
+// Function push_job, adds a directory to the bottom of a worker's deque
+// Returns 1 if successful, 0 otherwise
+int push_job(list_worker_t *worker,list_node_t *node) {
+	pthread_mutex_lock(&worker->lock);
+	if (worker->bottom == worker->capacity) {
+		// Slides the live jobs to the front before growing
+		long live = worker->bottom - worker->top;
+		if (worker->top > 0) memmove(worker->jobs,worker->jobs + worker->top,live * sizeof(list_node_t *));
+		worker->top = 0;
+		worker->bottom = live;
+		if (live == worker->capacity) {
+			long capacity = worker->capacity ? worker->capacity * 2 : 64;
+			list_node_t **jobs = realloc(worker->jobs,capacity * sizeof(list_node_t *));
+			if (!jobs) {
+				pthread_mutex_unlock(&worker->lock);
+				return 0;
+			}
+			worker->jobs = jobs;
+			worker->capacity = capacity;
 		}
+	}
+	worker->jobs[worker->bottom++] = node;
+	pthread_mutex_unlock(&worker->lock);
+	return 1;
+}
 
-		// Moves offset to next block
-		offset = (off_t)fat_start * block_size + (off_t)current * sizeof(uint32_t);
-		// Seeks and reads next block
-		fseek(fp,offset,SEEK_SET);
-		fread(&current,sizeof(uint32_t),1,fp);
-		current = ntohl(current);
+// Function take_job, pops from a worker's own deque, or steals from the others starting with the next one
+// Returns a directory, or NULL if every deque is empty
+list_node_t *take_job(list_tree_t *tree,int id) {
+	for (int i = 0; i < tree->worker_count; i++) {
+		list_worker_t *worker = &tree->workers[(id + i) % tree->worker_count];
+		list_node_t *node = NULL;
+		pthread_mutex_lock(&worker->lock);
+		if (worker->top < worker->bottom) node = i == 0 ? worker->jobs[--worker->bottom] : worker->jobs[worker->top++];
+		pthread_mutex_unlock(&worker->lock);
+		if (node) {
+			__atomic_fetch_sub(&tree->queued,1,__ATOMIC_RELAXED);
+			return node;
+		}
 	}
-	return;
+	return NULL;
 }
 
-// Function find_subdir, returns 1 if found, 0 if not
-// Takes filepath, start blcok, block count, block size, target directory, and output variables as input
-int find_subdir (FILE *fp, uint32_t start_block, uint32_t block_count,
-		uint16_t block_size, char *target,
-		uint32_t *out_start, uint32_t *out_blocks) {
-	// Finds offset of target
-	off_t offset = (off_t)start_block * block_size;
-	// Finds size of target
-	size_t size = (size_t)block_count * block_size;
+// Function append_output, adds bytes to a worker's output buffer
+// Returns 1 if successful, 0 otherwise
+int append_output(list_worker_t *worker,const char *text,size_t length) {
+	if (worker->out_length + length > worker->out_capacity) {
+		size_t capacity = worker->out_capacity ? worker->out_capacity : 1 << 16;
+		while (capacity < worker->out_length + length) capacity *= 2;
+		char *out = realloc(worker->out,capacity);
+		if (!out) return 0;
+		worker->out = out;
+		worker->out_capacity = capacity;
+	}
+	memcpy(worker->out + worker->out_length,text,length);
+	worker->out_length += length;
+	return 1;
+}
 
-	// Moves to target
-	fseek(fp,offset,SEEK_SET);
+// Function list_node, lists one directory into the worker's buffer and queues its subdirectories
+// Returns the number of subdirectories queued
+long list_node(list_tree_t *tree,int id,list_node_t *node) {
+	fs_t *fs = tree->fs;
+	list_worker_t *worker = &tree->workers[id];
+	uint32_t block_size = fs->super_block.block_size;
+	uint32_t per_block = block_size/sizeof(dir_entry_t);
+
+	uint32_t blocks;
+	char *data = fs_read_chain(fs,node->start,&blocks);
+	node->worker = id;
+	node->out_offset = worker->out_length;
+	if (!data) {
+		node->failed = 1;
+		return 0;
+	}
+	FS_STAT_ADD(dir_entries_scanned,(uint64_t)blocks * per_block);
+
+	long queued = 0;
+	size_t path_len = strlen(node->path);
+	for (uint32_t b = 0; b < blocks; b++) {
+		for (uint32_t s = 0; s < per_block; s++) {
+			dir_entry_t entry;
+			memcpy(&entry,data + (size_t)b * block_size + s * sizeof(dir_entry_t),sizeof(entry));
+			if (entry.status == 0x00) continue; // Unused
 
-	dir_entry_t entry;
-	size_t entries = size/sizeof(dir_entry_t);
-
-	// Iterates until target is found
-	for (size_t i = 0; i < entries; i++) {
-		if (fread(&entry,sizeof(dir_entry_t),1,fp) != 1) break;
-		if (entry.status == 0x00) continue; // Unused
-
-		// A directory is found
-		if (entry.status & (1 << 2)) {
-			// Copies entry name
-			char name_buf[32];
-			memcpy(name_buf,entry.name,31);
-			name_buf[31] = '\0';
-
-			// Trims trailing spaces
-			for (int j = 30; j >= 0; j--) {
-				if (name_buf[j] == '\0' || name_buf[j] == ' ' || name_buf[j] == 0x00) name_buf[j] = '\0';
-				else break;
+			char line[LINE_MAX_LENGTH];
+			if (!append_output(worker,line,format_entry(&entry,line))) node->failed = 1;
+			if (!(entry.status & FS_ENTRY_DIR) || node->depth >= FS_MAX_DEPTH) continue;
+
+			// Subdirectories become children in directory order, to be listed by whoever gets to them
+			list_node_t **children = realloc(node->children,(node->child_count + 1) * sizeof(list_node_t *));
+			list_node_t *child = calloc(1,sizeof(list_node_t));
+			if (children) node->children = children;
+			if (!children || !child || !(child->path = malloc(path_len + 34))) {
+				free(child);
+				node->failed = 1;
+				continue;
 			}
+			char name[32];
+			fs_entry_name(&entry,name);
+			sprintf(child->path,"%s%s%s",node->path,path_len > 0 && node->path[path_len - 1] == '/' ? "" : "/",name);
+			child->start = ntohl(entry.starting_block);
+			child->depth = node->depth + 1;
+			node->children[node->child_count++] = child;
+			if (push_job(worker,child)) queued++;
+			else child->failed = 1;
+		}
+	}
+	free(data);
+	node->out_length = worker->out_length - node->out_offset;
+	return queued;
+}
 
-			// Compares current entry to target directory
-			if (strcmp(name_buf,target) == 0) {
-				*out_start = ntohl(entry.starting_block);
-				*out_blocks = ntohl(entry.block_count);
-				return 1;
-			}
+// Function list_worker, lists directories until the whole tree is done
+// A worker with nothing to pop or steal sleeps until new directories are queued or none are pending
+void *list_worker(void *arg) {
+	list_arg_t *list_arg = arg;
+	list_tree_t *tree = list_arg->tree;
+	int id = list_arg->id;
+	for (;;) {
+		list_node_t *node = take_job(tree,id);
+		if (node) {
+			long queued = list_node(tree,id,node);
+			pthread_mutex_lock(&tree->idle_lock);
+			__atomic_fetch_add(&tree->queued,queued,__ATOMIC_RELAXED);
+			tree->pending += queued - 1;
+			if (queued > 0 || tree->pending == 0) pthread_cond_broadcast(&tree->idle);
+			pthread_mutex_unlock(&tree->idle_lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&tree->idle_lock);
+		while (__atomic_load_n(&tree->queued,__ATOMIC_RELAXED) <= 0 && tree->pending > 0) {
+			pthread_cond_wait(&tree->idle,&tree->idle_lock);
 		}
+		int done = tree->pending == 0;
+		pthread_mutex_unlock(&tree->idle_lock);
+		if (done) break;
 	}
-	return 0; // Target not found
+	return NULL;
 }
 
-// Function resolve_path, uses find_subdir to locate a specified subdirectory
-// Supports multiple levels of subdirectories by using string tokenization
-// Returns 1 if successful, 0 otherwise
-int resolve_path(FILE *fp,uint32_t root_start,uint32_t root_blocks,uint32_t block_size,
-		const char *path,uint32_t *out_start,uint32_t *out_blocks) {
-    	// Skip leading slash if present
-    	if (path[0] == '/') path++;
-
-    	// Make a copy of the path for strtok
-    	char *path_copy = strdup(path);
-    	if (!path_copy) return 0;
-
-    	// Path is broken down into sections seperated by /, which indicates subdirectories
-    	char *token = strtok(path_copy, "/");
-    	uint32_t current_start = root_start;
-    	uint32_t current_blocks = root_blocks;
-
-    	// Checks each token
-    	while (token) {
-        	uint32_t sub_start = 0, sub_blocks = 0;
-
-        	// Calls find_subdir to determine if the subdirectory is present
-        	if (!find_subdir(fp,current_start,current_blocks,block_size,token,&sub_start,&sub_blocks)) {
-            		free(path_copy);
-            		return 0;
-        	}
-
-        	// Advance into the found subdirectory
-        	current_start = sub_start;
-        	current_blocks = sub_blocks;
-
-        	token = strtok(NULL, "/");
-    	}
-
-    	free(path_copy);
-
-    	*out_start = current_start;
-    	*out_blocks = current_blocks;
-    	return 1;
+// Function print_tree, prints the listed directories depth first in directory order and frees them
+// Returns the number of directories that could not be listed
+long print_tree(list_tree_t *tree,list_node_t *node,int first) {
+	printf("%s%s:\n",first ? "" : "\n",node->path);
+	fwrite(tree->workers[node->worker].out + node->out_offset,1,node->out_length,stdout);
+	long failed = node->failed;
+	for (uint32_t i = 0; i < node->child_count; i++) failed += print_tree(tree,node->children[i],0);
+	free(node->children);
+	free(node->path);
+	if (!first) free(node);
+	return failed;
+}
+
+// Function list_recursive, lists a directory and everything below it
+// Directories are read in parallel by a pool of work-stealing threads, each buffering its own output,
+// and printed afterwards in the same order a serial walk would give
+// Returns the number of directories that could not be listed
+long list_recursive(fs_t *fs,const char *path,uint32_t start) {
+	list_tree_t tree;
+	memset(&tree,0,sizeof(tree));
+	tree.fs = fs;
+	pthread_mutex_init(&tree.idle_lock,NULL);
+	pthread_cond_init(&tree.idle,NULL);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	tree.worker_count = cpus > 0 ? cpus : 1;
+	if (tree.worker_count > MAX_WORKERS) tree.worker_count = MAX_WORKERS;
+	for (int i = 0; i < tree.worker_count; i++) pthread_mutex_init(&tree.workers[i].lock,NULL);
+
+	list_node_t root = {0};
+	root.path = strdup(path);
+	root.start = start;
+	if (!root.path || !push_job(&tree.workers[0],&root)) return 1;
+	tree.pending = tree.queued = 1;
+
+	list_arg_t args[MAX_WORKERS];
+	pthread_t threads[MAX_WORKERS];
+	int started = 0;
+	for (int i = 0; i < tree.worker_count; i++) {
+		args[i].tree = &tree;
+		args[i].id = i;
+	}
+	for (int i = 1; i < tree.worker_count; i++) {
+		if (pthread_create(&threads[started],NULL,list_worker,&args[i]) == 0) started++;
+	}
+	list_worker(&args[0]);
+	for (int i = 0; i < started; i++) pthread_join(threads[i],NULL);
+
+	long failed = print_tree(&tree,&root,1);
+	for (int i = 0; i < tree.worker_count; i++) {
+		free(tree.workers[i].jobs);
+		free(tree.workers[i].out);
+		pthread_mutex_destroy(&tree.workers[i].lock);
+	}
+	pthread_mutex_destroy(&tree.idle_lock);
+	pthread_cond_destroy(&tree.idle);
+	return failed;
 }
 
 int main(int argc,char *argv[]) {
+	fs_stats_init(&argc,argv);
+
 	// A filename is needed as an argument
 	if (argc < 2) {
 		perror("Error: Not enough arguments");
 		exit(1);
 	}
 
-	// Skips the file system ID, which is 8 bytes
-	off_t offset = 8;
-	// Creates a new super_block struct and allocates memory
-	super_block_t *super_block = malloc(sizeof(super_block_t));
+	// -R lists the directory and every directory below it
+	int recursive = argc > 2 && !strcmp(argv[2],"-R");
+	if (recursive) {
+		for (int i = 2; i < argc; i++) argv[i] = argv[i + 1];
+		argc--;
+	}
+
+	// A socket is served by a running diskserve, which keeps its directories cached
+	int server = fs_connect(argv[1]);
+	if (server >= 0) {
+		if (recursive) {
+			printf("Recursive mode needs the image itself\n");
+			exit(1);
+		}
+		if (!list_remote(server,argc == 2 ? "/" : argv[2])) {
+			perror("Error: Server request failed");
+			exit(1);
+		}
+		close(server);
+		return 0;
+	}
 
-	// Opens the inputted file in read binary mode
-	FILE* fp = fopen(argv[1],"rb");
-	
-	if (!fp) {
+	// Opens the inputted file, loading the superblock and FAT into memory
+	fs_t fs;
+	if (!fs_open(&fs,argv[1],"rb")) {
 		perror("Error: File Invalid");
 		exit(1);
 	}
-
-	// Moves to the specified offset, after the ID
-	fseek(fp,offset,SEEK_SET);
-	// Reads superblock information to the struct
-	fread(super_block,sizeof(super_block_t),1,fp);
-
-	// Superblock values are converted to the correct endianness
-	super_block->block_size = ntohs(super_block->block_size);
-	super_block->block_count = ntohl(super_block->block_count);
-	super_block->fat_start = ntohl(super_block->fat_start);
-	super_block->fat_blocks = ntohl(super_block->fat_blocks);
-	super_block->root_start = ntohl(super_block->root_start);
-	super_block->root_blocks = ntohl(super_block->root_blocks);
-
-	// Determines size of the FAT
-	size_t fat_size = super_block->block_size * super_block->fat_blocks;
-	
-	// Used to hold values read from the file
-	uint32_t *fat_table = malloc(fat_size);
-
-	// Moves to the start of the FAT
-	offset = super_block->block_size * super_block->fat_start;
-	fseek(fp,offset,SEEK_SET);
-	// Reads the FAT to fat_table
-	fread(fat_table,sizeof(uint32_t),fat_size/sizeof(uint32_t),fp);
+	super_block_t *super_block = &fs.super_block;
 
 	// Defaults to root directory if no input given, otherwise finds inputted subdirectory
 	if (argc == 2 || !strcmp(argv[2],"/")) {
 		// Lists contents in root directory
-		list_directory(fp,super_block->fat_start,super_block->block_size,super_block->root_start);
+		if (recursive) {
+			if (list_recursive(&fs,"/",super_block->root_start)) fprintf(stderr,"Error: Some directories could not be read\n");
+		} else {
+			list_directory(&fs,super_block->root_start);
+		}
 	} else {
 		uint32_t final_start,final_blocks;
 
 		// Uses helper function to find the target subdirectory	
-		if (resolve_path(fp, super_block->root_start, super_block->root_blocks,
-					super_block->block_size, argv[2],&final_start, &final_blocks)) {
+		if (fs_resolve_path(&fs,argv[2],0,&final_start,&final_blocks)) {
 			// Lists contents in target subdirectory
-			list_directory(fp, super_block->fat_start, super_block->block_size, final_start);
+			if (recursive) {
+				if (list_recursive(&fs,argv[2],final_start)) fprintf(stderr,"Error: Some directories could not be read\n");
+			} else {
+				list_directory(&fs,final_start);
+			}
 		} else {
 			printf("Subdirectory \'%s\' not found\n",argv[2]);
 		}
 	}
 
-	fclose(fp);
-
-	// Free allocated memory
-	free(super_block);
-	free(fat_table);
+	fs_close(&fs);
 
 	return 0;
 }
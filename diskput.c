@@ -3,425 +3,481 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
-#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
 
-#define FAT_EOF 0xFFFFFFFF
+#include "fs.h"
 
-// Structure super_block_t, stores information for the superblock
-typedef struct {
-	uint16_t block_size;
-	uint32_t block_count;
-	uint32_t fat_start;
-	uint32_t fat_blocks;
-	uint32_t root_start;
-	uint32_t root_blocks;
-} __attribute__((packed)) super_block_t;
-
-// Structure dir_entry_t, stores information about directory entries
-typedef struct {
-	uint8_t status;
-	uint32_t starting_block;
-	uint32_t block_count;
-	uint32_t size;
-	uint8_t created[7];
-	uint8_t modified[7];
-	char name[31];
-	uint8_t unused[6];
-} __attribute__((packed)) dir_entry_t;
-
-// Function find_subdir, returns 1 if found, 0 if not
-// Takes filepath, start blcok, block count, block size, target directory, and output variables as input
-int find_subdir (FILE *fp, uint32_t start_block, uint32_t block_count,
-		uint16_t block_size, char *target,
-		uint32_t *out_start, uint32_t *out_blocks) {
-	// Finds offset of target
-	off_t offset = (off_t)start_block * block_size;
-	// Finds size of target
-	size_t size = (size_t)block_count * block_size;
-
-	// Moves to target
-	fseek(fp,offset,SEEK_SET);
-
-	dir_entry_t entry;
-	size_t entries = size/sizeof(dir_entry_t);
-
-	// Iterates until target is found
-	for (size_t i = 0; i < entries; i++) {
-		if (fread(&entry,sizeof(dir_entry_t),1,fp) != 1) break;
-		if (entry.status == 0x00) continue; // Unused
-
-		// A directory is found
-		if (entry.status & (1 << 2)) {
-			// Copies entry name
-			char name_buf[32];
-			memcpy(name_buf,entry.name,31);
-			name_buf[31] = '\0';
-
-			// Trims trailing spaces
-			for (int j = 30; j >= 0; j--) {
-				if (name_buf[j] == '\0' || name_buf[j] == ' ' || name_buf[j] == 0x00) name_buf[j] = '\0';
-				else break;
-			}
+// Function write_entry, adds an entry to a directory, extending it by a block if it is full
+// Returns 1 if successful, 0 otherwise
+int write_entry(fs_t *fs,uint32_t dir_start,const dir_entry_t *entry) {
+	return fs_dir_add(fs,dir_start,entry);
+}
 
-			// Compares current entry to target directory
-			if (strcmp(name_buf,target) == 0) {
-				*out_start = ntohl(entry.starting_block);
-				*out_blocks = ntohl(entry.block_count);
-				return 1;
-			}
-		}
-	}
-	return 0; // Target not found
+// Function find_file, locates the target file within a directory
+// Returns 1 if successful, 0 otherwise
+// Saves target entry to out_entry
+int find_file(fs_t *fs,uint32_t start,const char *filename,dir_entry_t *out_entry) {
+	// Looks the name up in the directory's hash index, which is built on first access
+	return fs_dir_lookup(fs,start,filename,FS_ENTRY_FILE,out_entry);
 }
 
-uint32_t allocate_block(FILE *fp,uint32_t fat_start,uint32_t block_size) {
-	uint32_t block_num = 0;
-	uint32_t fat_entry;
+// Function allocate_fat, allocates and links the chain for a file of filesize bytes
+// Asks for every block at once so the file lands in as few contiguous runs as possible
+// The runs that make up the chain are returned through extents and count
+// Returns the first block of the chain, or 0 if there is not enough space
+uint32_t allocate_fat(fs_t *fs,size_t filesize,fs_run_t **extents,uint32_t *count) {
+	uint32_t block_size = fs->super_block.block_size;
+	uint32_t blocks_needed = (filesize + block_size - 1)/block_size;
+	if (blocks_needed == 0) return 0;
 
-	uint32_t block_entries = block_size/sizeof(uint32_t);
+	uint32_t first_block = fs_alloc_chain(fs,blocks_needed,extents,count);
+	if (first_block == 0) {
+		printf("No free blocks available\n");
+		return 0;
+	}
 
-	for (uint32_t b = 0; ; b++) {
-		off_t fat_off = (off_t)fat_start * block_size + b * block_size;
-		fseek(fp,fat_off,SEEK_SET);
+	return first_block;
+}
 
-		for (uint32_t i = 0; i < block_entries; i++) {
-			if (fread(&fat_entry,sizeof(fat_entry),1,fp) != 1) break;
-			if (ntohl(fat_entry) == 0) {
-				block_num = b * block_entries + i;
+// Function write_file, copies the source file into its destination runs
+// The block list comes from allocation, so the data path never consults the FAT
+// Returns 1 if successful, 0 otherwise
+int write_file(fs_t *fs,int src,const fs_run_t *extents,uint32_t count,size_t filesize) {
+	return fs_write_extents(fs,extents,count,src,filesize,NULL);
+}
 
-				fat_entry = htonl(FAT_EOF);
-				fseek(fp,fat_off + 1 * sizeof(uint32_t),SEEK_SET);
-				fwrite(&fat_entry,sizeof(fat_entry),1,fp);
-				return block_num;
-			}
+// Function release_extents, returns the blocks of a chain that will not be used to the free pool
+void release_extents(fs_t *fs,const fs_run_t *extents,uint32_t count) {
+	for (uint32_t e = 0; e < count; e++) {
+		for (uint32_t b = 0; b < extents[e].length; b++) {
+			fs_set_next(fs,extents[e].start + b,FAT_FREE);
 		}
-		if (feof(fp)) break;
 	}
-	return 0;
+	return;
 }
 
-void init_directory(FILE *fp,uint32_t block_num,uint32_t block_size) {
-	dir_entry_t empty = {0};
-	const size_t entries = block_size/sizeof(dir_entry_t);
-	off_t off = (off_t)block_num * block_size;
-	fseek(fp,off,SEEK_SET);
-	for (size_t i = 0; i < entries; i++) {
-		fwrite(&empty,sizeof(empty),1,fp);
-	}
-	fflush(fp);
+// Function fill_entry, builds the directory entry for a file that has been written
+void fill_entry(fs_t *fs,const char *filename,uint32_t first_block,size_t filesize,dir_entry_t *entry) {
+	uint32_t block_size = fs->super_block.block_size;
+	memset(entry,0,sizeof(dir_entry_t));
+	entry->status = 0x02;
+	strncpy(entry->name,filename,sizeof(entry->name)-1);
+	entry->starting_block = htonl(first_block);
+	entry->block_count = htonl((filesize + block_size - 1)/block_size);
+	entry->size = htonl(filesize);
+	fs_fill_timestamp(entry);
 	return;
 }
 
-int write_entry(FILE *fp,uint32_t dir_start,uint32_t block_size,uint32_t fat_start,const dir_entry_t *entry) {
-	dir_entry_t current;
-	size_t block_entries = block_size/sizeof(dir_entry_t);
-
-	uint32_t current_block = dir_start;
-	uint32_t last_block = dir_start;
-	while (current_block != FAT_EOF) {
-		off_t offset = (off_t)current_block * block_size;
+// Function open_source, opens a host file to copy, - is standard input
+// Returns the descriptor, or -1 with a message printed if it cannot be opened
+int open_source(const char *host_path,struct stat *src_stat) {
+	int src = strcmp(host_path,"-") ? open(host_path,O_RDONLY) : STDIN_FILENO;
+	if (src < 0 || fstat(src,src_stat) != 0) {
+		printf("Source file %s not found.\n",host_path);
+		if (src > STDIN_FILENO) close(src);
+		return -1;
+	}
+	return src;
+}
 
-		for (size_t i = 0; i < block_entries; i++) {
-			fseek(fp,offset + (off_t)i * sizeof(dir_entry_t),SEEK_SET);
-			if (fread(&current,sizeof(current),1,fp) != 1) break;
+// Function put_file, copies a host file to a full path in the image, creating directories as needed
+// Pipes and other sources without a known size are streamed, growing the chain as data arrives
+// FAT changes are left in memory for the caller to commit with fs_flush
+// Prints a message and returns 0 on failure, returns 1 otherwise
+int put_file(fs_t *fs,const char *host_path,const char *image_path) {
+	struct stat src_stat;
+	int src = open_source(host_path,&src_stat);
+	if (src < 0) return 0;
 
-			if (current.status == 0x00) {
-				fseek(fp,offset + (off_t)i * sizeof(dir_entry_t),SEEK_SET);
-				fwrite(entry,sizeof(*entry),1,fp);
-				fflush(fp);
-				return 1;
-			}
-		}
+	// Copies path and seperates filename
+	char *dirpath,*filename;
+	if (!fs_split_path(image_path,&dirpath,&filename)) {
+		if (src != STDIN_FILENO) close(src);
+		return 0;
+	}
 
-		last_block = current_block;
-		off_t fat_off = (off_t)fat_start * block_size + (off_t)current_block * sizeof(uint32_t);
-		fseek(fp,fat_off,SEEK_SET);
-		fread(&current_block,sizeof(uint32_t),1,fp);
-		current_block = ntohl(current_block);
+	// Names that do not fit an entry are refused before anything is allocated
+	if (!*filename || strlen(filename) >= sizeof(((dir_entry_t *)0)->name)) {
+		printf("Invalid file name %s\n",image_path);
+		free(dirpath);
+		if (src != STDIN_FILENO) close(src);
+		return 0;
 	}
 
-	uint32_t new_block = allocate_block(fp,fat_start,block_size);
-	if (new_block == 0) return 0;
+	uint32_t dir_start,dir_blocks;
 
-	off_t fat_off = (off_t)fat_start * block_size + (off_t)last_block * sizeof(uint32_t);
-	fseek(fp,fat_off,SEEK_SET);
-	uint32_t link = htonl(new_block);
-	fwrite(&link,sizeof(link),1,fp);
+	// Attempts to find the directory of the target file
+	if (!fs_resolve_path(fs,dirpath,1,&dir_start,&dir_blocks)) {
+		printf("Failed to create directory %s\n",dirpath);
+		free(dirpath);
+		if (src != STDIN_FILENO) close(src);
+		return 0;
+	}
 
-	fat_off = (off_t)fat_start * block_size + (off_t)new_block * sizeof(uint32_t);
-	fseek(fp,fat_off,SEEK_SET);
-	uint32_t eof = htonl(FAT_EOF);
-	fwrite(&eof,sizeof(eof),1,fp);
+	size_t filesize = src_stat.st_size;
+	uint32_t first_block = 0;
+	int ok = 1;
+	if (!S_ISREG(src_stat.st_mode)) {
+		// The size is only known at the end, when the entry is written
+		uint64_t streamed = 0;
+		ok = fs_write_stream(fs,src,&first_block,&streamed,NULL);
+		if (!ok) perror("Error: Write failed");
+		filesize = streamed;
+	} else {
+		// Works out every destination block up front
+		fs_run_t *extents = NULL;
+		uint32_t extent_count = 0;
+		first_block = allocate_fat(fs,filesize,&extents,&extent_count);
+		ok = first_block != 0 || filesize == 0;
+
+		if (ok && !write_file(fs,src,extents,extent_count,filesize)) {
+			perror("Error: Write failed");
+			release_extents(fs,extents,extent_count);
+			ok = 0;
+		}
+		free(extents);
+	}
+	if (src != STDIN_FILENO) close(src);
 
-	init_directory(fp,new_block,block_size);
+	if (ok) {
+		dir_entry_t entry;
+		fill_entry(fs,filename,first_block,filesize,&entry);
+		ok = write_entry(fs,dir_start,&entry);
+	}
 
-	off_t offset = (off_t)new_block * block_size;
-	fseek(fp,offset,SEEK_SET);
-	fwrite(entry,sizeof(*entry),1,fp);
-	fflush(fp);
+	free(dirpath);
+	return ok;
+}
 
-	return 1;
+// Function compare_directory, orders manifest pairs by image directory, then by name
+int compare_directory(const void *a,const void *b) {
+	const char *x = ((const fs_pair_t *)a)->dest,*y = ((const fs_pair_t *)b)->dest;
+	const char *xs = strrchr(x,'/'),*ys = strrchr(y,'/');
+	size_t xl = xs ? (size_t)(xs - x) : 0,yl = ys ? (size_t)(ys - y) : 0;
+	int cmp = strncmp(x,y,xl < yl ? xl : yl);
+	if (cmp == 0 && xl != yl) return xl < yl ? -1 : 1;
+	if (cmp == 0) cmp = strcmp(x,y);
+	return cmp;
 }
 
+// Function put_batch, imports every (host path, image path) pair in a manifest
+// Files are grouped by destination directory, so each directory's files are allocated
+// next to each other, and all FAT changes are committed once at the end
+// Returns the number of files that failed
+long put_batch(fs_t *fs,const char *manifest) {
+	fs_pair_t *pairs;
+	long count = fs_manifest_read(manifest,&pairs);
+	if (count < 0) {
+		perror("Error: Manifest Invalid");
+		return 1;
+	}
 
-void fill_timestamp(dir_entry_t *entry) {
-	time_t now = time(NULL);
-	struct tm *tm_now = localtime(&now);
+	qsort(pairs,count,sizeof(fs_pair_t),compare_directory);
+	long failed = 0;
+	for (long i = 0; i < count; i++) {
+		if (!put_file(fs,pairs[i].source,pairs[i].dest)) failed++;
+	}
 
-	uint16_t year = tm_now->tm_year + 1900;
-	entry->created[0] = (year >> 8) & 0xFF;
-	entry->created[1] = year & 0xFF;
-	entry->created[2] = tm_now->tm_mon + 1;
-	entry->created[3] = tm_now->tm_mday;
-	entry->created[4] = tm_now->tm_hour;
-	entry->created[5] = tm_now->tm_min;
-	entry->created[6] = tm_now->tm_sec;
-	
-	return;
+	fs_manifest_free(pairs,count);
+	return failed;
+}
+
+// Most worker threads used by recursive import
+#define MAX_WORKERS 16
+
+// Structure put_job_t, one host file to import in recursive mode
+typedef struct {
+	char *host_path;
+	char *image_path;
+	const char *name;
+	uint32_t dir_start;
+	uint32_t first_block;
+	size_t size;
+	uint64_t hash;
+	int ok;
+} put_job_t;
+
+// Structure import_t, the files collected for a recursive import and the workers' progress
+// Workers only hold alloc_lock while they take blocks from or return blocks to the FAT
+typedef struct {
+	fs_t *fs;
+	put_job_t *jobs;
+	long count;
+	long capacity;
+	long next;
+	long failed;
+	pthread_mutex_t alloc_lock;
+} import_t;
+
+// Function join_path, returns a malloc'd copy of dir/name
+char *join_path(const char *dir,const char *name) {
+	size_t len = strlen(dir);
+	while (len > 0 && dir[len-1] == '/') len--;
+	char *path = malloc(len + strlen(name) + 2);
+	if (path) sprintf(path,"%.*s/%s",(int)len,dir,name);
+	return path;
 }
 
-// Function resolve_path, uses find_subdir to locate a specified subdirectory
-// Supports multiple levels of subdirectories by using string tokenization
+// Function queue_file, adds a host file to the import list
 // Returns 1 if successful, 0 otherwise
-int resolve_path(FILE *fp,uint32_t root_start,uint32_t root_blocks,uint32_t block_size,
-		const char *path,uint32_t fat_start,uint32_t *out_start,uint32_t *out_blocks) {
-
-	// Skip leading slash if present
-    	if (path[0] == '/') path++;
-
-    	// Make a copy of the path for strtok
-    	char *path_copy = strdup(path);
-    	if (!path_copy) return 0;
-
-    	// Path is broken down into sections seperated by /, which indicates subdirectories
-    	char *token = strtok(path_copy, "/");
-    	uint32_t current_start = root_start;
-    	uint32_t current_blocks = root_blocks;
-
-    	// Checks each token
-    	while (token) {
-        	uint32_t sub_start = 0, sub_blocks = 0;
-
-        	// Calls find_subdir to determine if the subdirectory is present
-        	if (!find_subdir(fp,current_start,current_blocks,block_size,token,&sub_start,&sub_blocks)) {
-            		sub_start = allocate_block(fp,fat_start,block_size);
-			sub_blocks = 1;
-			init_directory(fp,sub_start,block_size);
-
-			dir_entry_t new_entry = {0};
-			new_entry.status = 0x04;
-			strncpy(new_entry.name,token,sizeof(new_entry.name)-1);
-			new_entry.starting_block = htonl(sub_start);
-			new_entry.block_count = ntohl(sub_blocks);
-			new_entry.size = htonl(0);
-
-			fill_timestamp(&new_entry);
-        		
-			write_entry(fp,current_start,block_size,fat_start,&new_entry);
-		}
+int queue_file(import_t *tree,char *host_path,char *image_path,uint32_t dir_start) {
+	if (tree->count == tree->capacity) {
+		long capacity = tree->capacity ? tree->capacity * 2 : 256;
+		put_job_t *jobs = realloc(tree->jobs,capacity * sizeof(put_job_t));
+		if (!jobs) return 0;
+		tree->jobs = jobs;
+		tree->capacity = capacity;
+	}
+	put_job_t *job = &tree->jobs[tree->count++];
+	memset(job,0,sizeof(put_job_t));
+	job->host_path = host_path;
+	job->image_path = image_path;
+	job->name = strrchr(image_path,'/') + 1;
+	job->dir_start = dir_start;
+	return 1;
+}
 
-        	// Advance into the subdirectory
-        	current_start = sub_start;
-        	current_blocks = sub_blocks;
+// Function collect_tree, mirrors a host directory's subdirectories in the image and queues its files
+// Names are visited in sorted order, so the image layout does not depend on the host's readdir order
+// Returns 1 if everything below host_dir could be read, 0 otherwise
+int collect_tree(import_t *tree,const char *host_dir,const char *image_dir,uint32_t dir_start,int depth) {
+	if (depth >= FS_MAX_DEPTH) {
+		fprintf(stderr,"Error: %s is nested too deeply\n",host_dir);
+		return 0;
+	}
+
+	struct dirent **names;
+	int n = scandir(host_dir,&names,NULL,alphasort);
+	if (n < 0) {
+		fprintf(stderr,"Error: Cannot read %s\n",host_dir);
+		return 0;
+	}
 
-        	token = strtok(NULL, "/");
-    	}
+	int ok = 1;
+	for (int i = 0; i < n; i++) {
+		const char *name = names[i]->d_name;
+		if (!strcmp(name,".") || !strcmp(name,"..")) {
+			free(names[i]);
+			continue;
+		}
 
-    	free(path_copy);
+		char *host_path = join_path(host_dir,name);
+		char *image_path = join_path(image_dir,name);
+		struct stat st;
+		if (!host_path || !image_path || lstat(host_path,&st) != 0) {
+			ok = 0;
+		} else if (strlen(name) >= sizeof(((dir_entry_t *)0)->name)) {
+			fprintf(stderr,"Error: Name %s is too long for the image\n",host_path);
+			ok = 0;
+		} else if (S_ISDIR(st.st_mode)) {
+			// Directories are made here, before any worker starts allocating
+			uint32_t sub_start,sub_blocks;
+			if (!fs_resolve_path(tree->fs,image_path,1,&sub_start,&sub_blocks)) {
+				printf("Failed to create directory %s\n",image_path);
+				ok = 0;
+			} else if (!collect_tree(tree,host_path,image_path,sub_start,depth + 1)) {
+				ok = 0;
+			}
+		} else if (S_ISREG(st.st_mode)) {
+			if (queue_file(tree,host_path,image_path,dir_start)) {
+				host_path = image_path = NULL;
+			} else {
+				ok = 0;
+			}
+		}
+		// Symbolic links and special files are skipped
 
-    	*out_start = current_start;
-    	*out_blocks = current_blocks;
-    	return 1;
+		free(host_path);
+		free(image_path);
+		free(names[i]);
+	}
+	free(names);
+	return ok;
 }
 
-// Function find_file, locates the target file within a directory
+// Function import_file, reads one host file into newly allocated blocks, hashing it on the way
+// Only allocation takes the lock, the source reads and image writes of different files overlap
 // Returns 1 if successful, 0 otherwise
-// Saves target entry to out_entry
-int find_file(FILE *fp,uint32_t start,uint32_t blocks,uint32_t fat_start,uint32_t block_size,
-		const char *filename, dir_entry_t *out_entry) {
-	size_t block_entries = block_size/sizeof(dir_entry_t);
-	dir_entry_t entry;
-
-	uint32_t current = start;
-	
-	// Iterates through every entry in the directory
-	while (current != FAT_EOF) {
-		fseek(fp,(off_t)current * block_size,SEEK_SET);
-		for (size_t i = 0; i < block_entries; i++) {
-			if (fread(&entry,sizeof(dir_entry_t),1,fp) != 1) break;
-			if (entry.status == 0x00) continue;
-
-			char name_buf[32];
-			strncpy(name_buf,entry.name,sizeof(name_buf)-1);
-			name_buf[31] = '\0';
-
-			// Checks file type and name with target
-			if (entry.status & (1 << 1) && !strcmp(name_buf,filename)) {
-				*out_entry = entry;
-				return 1;
-			}
+int import_file(import_t *tree,put_job_t *job) {
+	fs_t *fs = tree->fs;
+	int src = open(job->host_path,O_RDONLY);
+	struct stat src_stat;
+	if (src < 0 || fstat(src,&src_stat) != 0 || (uint64_t)src_stat.st_size > UINT32_MAX) {
+		if (src >= 0) close(src);
+		return 0;
+	}
+	job->size = src_stat.st_size;
+
+	fs_run_t *extents = NULL;
+	uint32_t extent_count = 0;
+	pthread_mutex_lock(&tree->alloc_lock);
+	job->first_block = allocate_fat(fs,job->size,&extents,&extent_count);
+	pthread_mutex_unlock(&tree->alloc_lock);
+	int ok = job->first_block != 0 || job->size == 0;
+
+	if (ok && !fs_write_extents(fs,extents,extent_count,src,job->size,&job->hash)) {
+		pthread_mutex_lock(&tree->alloc_lock);
+		release_extents(fs,extents,extent_count);
+		pthread_mutex_unlock(&tree->alloc_lock);
+		ok = 0;
+	}
+	free(extents);
+	close(src);
+	return ok;
+}
+
+// Function import_worker, takes files off the shared list until none are left
+void *import_worker(void *arg) {
+	import_t *tree = arg;
+	long i;
+	while ((i = __atomic_fetch_add(&tree->next,1,__ATOMIC_RELAXED)) < tree->count) {
+		tree->jobs[i].ok = import_file(tree,&tree->jobs[i]);
+		if (!tree->jobs[i].ok) {
+			fprintf(stderr,"Error: Import of %s failed\n",tree->jobs[i].host_path);
+			__atomic_fetch_add(&tree->failed,1,__ATOMIC_RELAXED);
 		}
-		off_t offset = (off_t)fat_start * block_size + (off_t)current * sizeof(uint32_t);
-		fseek(fp,offset,SEEK_SET);
-		fread(&current,sizeof(uint32_t),1,fp);
-		current = ntohl(current);
 	}
-	return 0;
+	return NULL;
 }
 
-uint32_t allocate_fat(FILE *fp,uint32_t fat_start,uint32_t block_size,size_t filesize) {
-	uint32_t blocks_needed = (filesize + block_size - 1)/block_size;
-	uint32_t first_block = 0,prev_block = 0;
+// Function put_tree, imports every file below a host directory into an image directory
+// The host tree is walked once and its directories created, then a pool of threads reads,
+// hashes and writes the files while sharing one serialized allocator
+// Entries are added in walk order once every file is in place, and a hash listing is printed
+// Returns the number of files that failed
+long put_tree(fs_t *fs,const char *host_dir,const char *image_dir) {
+	uint32_t dir_start,dir_blocks;
+	if (!fs_resolve_path(fs,image_dir,1,&dir_start,&dir_blocks)) {
+		printf("Failed to create directory %s\n",image_dir);
+		return 1;
+	}
 
-	for (uint32_t b = 0; b < blocks_needed; b++) {
-		uint32_t free_block = allocate_block(fp,fat_start,block_size);
-		if (free_block == 0) {
-			printf("No free blocks available\n");
-			return 0;
-		}
+	import_t tree = {0};
+	tree.fs = fs;
+	pthread_mutex_init(&tree.alloc_lock,NULL);
+	if (!collect_tree(&tree,host_dir,image_dir,dir_start,0)) tree.failed++;
 
-		if (first_block == 0) first_block = free_block;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long workers = cpus > 0 ? cpus : 1;
+	if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+	if (workers > tree.count) workers = tree.count;
 
-		if (prev_block != 0) {
-			off_t fat_off = (off_t)fat_start * block_size + prev_block * sizeof(uint32_t);
-			fseek(fp,fat_off,SEEK_SET);
-			uint32_t link = htonl(free_block);
-			fwrite(&link,sizeof(link),1,fp);
+	pthread_t threads[MAX_WORKERS];
+	long started = 0;
+	for (long t = 1; t < workers; t++) {
+		if (pthread_create(&threads[started],NULL,import_worker,&tree) == 0) started++;
+	}
+	import_worker(&tree);
+	for (long t = 0; t < started; t++) pthread_join(threads[t],NULL);
+	pthread_mutex_destroy(&tree.alloc_lock);
+
+	for (long i = 0; i < tree.count; i++) {
+		put_job_t *job = &tree.jobs[i];
+		if (job->ok) {
+			dir_entry_t entry;
+			fill_entry(fs,job->name,job->first_block,job->size,&entry);
+			if (write_entry(fs,job->dir_start,&entry)) {
+				printf("%016llx  %s\n",(unsigned long long)job->hash,job->image_path);
+			} else {
+				fprintf(stderr,"Error: Cannot add %s\n",job->image_path);
+				tree.failed++;
+			}
 		}
-		prev_block = free_block;
+		free(job->host_path);
+		free(job->image_path);
 	}
-	off_t fat_off = (off_t)fat_start * block_size + prev_block * sizeof(uint32_t);
-	fseek(fp,fat_off,SEEK_SET);
-	uint32_t eof = htonl(FAT_EOF);
-	fwrite(&eof,sizeof(eof),1,fp);
-
-	return first_block;
+	free(tree.jobs);
+	return tree.failed;
 }
 
-void write_file(FILE *fp,FILE *src,uint32_t block_size,uint32_t first_block,
-		size_t filesize,uint32_t fat_start) {
-	uint32_t current = first_block;
-	size_t remaining = filesize;
-	char *buf = malloc(block_size);
-
-	while (current != FAT_EOF && remaining > 0) {
-		size_t to_read = remaining < block_size ? remaining : block_size;
-		fread(buf,1,to_read,src);
-
-		fseek(fp,(off_t)current * block_size,SEEK_SET);
-		fwrite(buf,1,to_read,fp);
-
-		remaining -= to_read;
+// Function put_remote, sends a host file to an image server to be stored at image_path
+// Prints a message and returns 0 on failure, returns 1 otherwise
+int put_remote(int server,const char *host_path,const char *image_path) {
+	struct stat src_stat;
+	int src = open_source(host_path,&src_stat);
+	if (src < 0) return 0;
+
+	// The server is told the length before the data, so streams need the image itself
+	if (!S_ISREG(src_stat.st_mode)) {
+		printf("Streaming %s needs the image itself\n",host_path);
+		if (src != STDIN_FILENO) close(src);
+		return 0;
+	}
 
-		off_t fat_off = (off_t)fat_start * block_size + current * sizeof(uint32_t);
-		fseek(fp,fat_off,SEEK_SET);
-		fread(&current,sizeof(uint32_t),1,fp);
-		current = ntohl(current);
+	// The server may reject the file before reading it, so its reply is read either way
+	fs_msg_t msg;
+	int sent = fs_send_msg(server,FS_OP_PUT,0,image_path,src_stat.st_size) &&
+		fs_relay(src,server,src_stat.st_size);
+	if (src != STDIN_FILENO) close(src);
+	if (!fs_recv_msg(server,&msg)) {
+		perror(sent ? "Error: Server request failed" : "Error: Write failed");
+		return 0;
 	}
-	free(buf);
-	return;
+	if (msg.status != FS_STATUS_OK) {
+		printf("%s: %s\n",image_path,fs_status_message(msg.status));
+		return 0;
+	}
+	return 1;
 }
 
 int main(int argc,char *argv[]) {
-	// A filename is needed as an argument
-	if (argc < 3) {
+	fs_stats_init(&argc,argv);
+	fs_aio_init(&argc,argv);
+
+	// A filename and either a file pair or a batch manifest are needed as arguments
+	if (argc < 4) {
 		perror("Error: Not enough arguments");
 		exit(1);
 	}
 
-	FILE *src = fopen(argv[2], "rb");
-	if (!src) {
-		printf("Source file %s not found.\n",argv[2]);
-		exit(1);
+	// A socket is served by a running diskserve, which handles single files
+	int server = fs_connect(argv[1]);
+	if (server >= 0) {
+		if (!strcmp(argv[2],"-b") || !strcmp(argv[2],"-r")) {
+			printf("Batch and recursive modes need the image itself\n");
+			exit(1);
+		}
+		signal(SIGPIPE,SIG_IGN);
+		int ok = put_remote(server,argv[2],argv[3]);
+		close(server);
+		return ok ? 0 : 1;
 	}
 
-	// Skips the file system ID, which is 8 bytes
-	off_t offset = 8;
-	// Creates a new super_block struct and allocates memory
-	super_block_t *super_block = malloc(sizeof(super_block_t));
-
-	// Opens the inputted file in read binary mode
-	FILE* fp = fopen(argv[1],"rb+");
-	
-	if (!fp) {
+	// Opens the inputted file, loading the superblock and FAT into memory
+	fs_t fs;
+	if (!fs_open_flags(&fs,argv[1],"rb+",fs_aio_direct ? FS_OPEN_DIRECT : 0)) {
 		perror("Error: File Invalid");
 		exit(1);
 	}
-
-	// Moves to the specified offset, after the ID
-	fseek(fp,offset,SEEK_SET);
-	// Reads superblock information to the struct
-	fread(super_block,sizeof(super_block_t),1,fp);
-
-	// Superblock values are converted to the correct endianness
-	super_block->block_size = ntohs(super_block->block_size);
-	super_block->block_count = ntohl(super_block->block_count);
-	super_block->fat_start = ntohl(super_block->fat_start);
-	super_block->fat_blocks = ntohl(super_block->fat_blocks);
-	super_block->root_start = ntohl(super_block->root_start);
-	super_block->root_blocks = ntohl(super_block->root_blocks);
-
-	// Determines size of the FAT
-	size_t fat_size = super_block->block_size * super_block->fat_blocks;
-	
-	// Used to hold values read from the file
-	uint32_t *fat_table = malloc(fat_size);
-
-	// Moves to the start of the FAT
-	offset = super_block->block_size * super_block->fat_start;
-	fseek(fp,offset,SEEK_SET);
-	// Reads the FAT to fat_table
-	fread(fat_table,sizeof(uint32_t),fat_size/sizeof(uint32_t),fp);
-
-	// Copies path and seperates filename
-	char *path_copy = strdup(argv[3]);
-	char *filename = strrchr(path_copy, '/');
-	char *dirpath;
-
-	// Checks if target file is in the root directory
-	if (filename) {
-		*filename++ = '\0'; // Removes dirpath from filename
-		dirpath = path_copy;
-	} else {
-		filename = path_copy;
-		dirpath = "/"; // Root
+	if (fs_aio_direct && !fs.direct_align) fprintf(stderr,"Direct I/O unavailable, using the page cache\n");
+
+	// Batch mode, -b reads (host path, image path) pairs from a manifest or - for stdin
+	// Recursive mode, -r copies a whole host directory into an image directory
+	int failed;
+	if (!strcmp(argv[2],"-b")) failed = put_batch(&fs,argv[3]) != 0;
+	else if (!strcmp(argv[2],"-r")) {
+		if (argc < 5) {
+			printf("Usage: %s image -r host_dir image_dir\n",argv[0]);
+			exit(1);
+		}
+		failed = put_tree(&fs,argv[3],argv[4]) != 0;
 	}
+	else failed = !put_file(&fs,argv[2],argv[3]);
 
-	uint32_t dir_start,dir_blocks;
-
-	// Attempts to find the directory of the target file
-	if (!resolve_path(fp, super_block->root_start, super_block->root_blocks,
-					super_block->block_size,dirpath,super_block->fat_start,&dir_start,&dir_blocks)) {
-		printf("Failed to create directory %s\n",dirpath);
+	// Commits every FAT change made above in one ordered pass
+	// Failed copies have already returned their blocks, directories they created are kept
+	if (!fs_flush(&fs)) {
+		perror("Error: FAT write-back failed");
 		exit(1);
 	}
 
-	fseek(src,0,SEEK_END);
-	size_t filesize = ftell(src);
-	rewind(src);
+	fs_close(&fs);
 
-	uint32_t first_block = allocate_fat(fp,super_block->fat_start,super_block->block_size,filesize);
-
-	write_file(fp,src,super_block->block_size,first_block,filesize,super_block->fat_start);
-
-	dir_entry_t entry = {0};
-	entry.status = 0x02;
-	strncpy(entry.name,filename,sizeof(entry.name)-1);
-	entry.starting_block = htonl(first_block);
-	entry.block_count = htonl((filesize + super_block->block_size - 1)/super_block->block_size);
-	entry.size = htonl(filesize);
-	fill_timestamp(&entry);
-	write_entry(fp,dir_start,super_block->block_size,super_block->fat_start,&entry);
-	
-
-	fclose(src);
-	fclose(fp);
-
-	// Free allocated memory
-	free(super_block);
-	free(fat_table);
-	free(path_copy);
-
-	return 0;
+	return failed;
 }
-
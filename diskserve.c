@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fs.h"
+
+// Structure server_t, an image kept open for every client
+// lock guards the FAT, the free-space index and the directory and path caches
+// Data moves outside the lock, since it only uses positional I/O on blocks no one else owns
+typedef struct {
+	fs_t fs;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	int puts_active;
+} server_t;
+
+// Structure client_t, one accepted connection
+typedef struct {
+	server_t *server;
+	int fd;
+} client_t;
+
+// Set by the signal handler to stop accepting connections
+static volatile sig_atomic_t stopping = 0;
+
+// Function handle_signal, asks the accept loop to shut down
+void handle_signal(int sig) {
+	(void)sig;
+	stopping = 1;
+	return;
+}
+
+// Function reply, sends a reply header with no data
+// Returns 1 if successful, 0 otherwise
+int reply(int fd,uint32_t op,uint32_t status) {
+	return fs_send_msg(fd,op,status,NULL,0);
+}
+
+// Function serve_info, replies with the superblock and the current block counts
+int serve_info(server_t *server,int fd) {
+	fs_t *fs = &server->fs;
+	fs_info_msg_t info;
+	pthread_mutex_lock(&server->lock);
+	info.super_block.block_size = htons(fs->super_block.block_size);
+	info.super_block.block_count = htonl(fs->super_block.block_count);
+	info.super_block.fat_start = htonl(fs->super_block.fat_start);
+	info.super_block.fat_blocks = htonl(fs->super_block.fat_blocks);
+	info.super_block.root_start = htonl(fs->super_block.root_start);
+	info.super_block.root_blocks = htonl(fs->super_block.root_blocks);
+	info.free_blocks = htobe64(fs->census.free_blocks);
+	info.reserved_blocks = htobe64(fs->census.reserved_blocks);
+	info.allocated_blocks = htobe64(fs->census.allocated_blocks);
+	pthread_mutex_unlock(&server->lock);
+
+	return fs_send_msg(fd,FS_OP_INFO,FS_STATUS_OK,NULL,sizeof(info)) &&
+		fs_send_all(fd,&info,sizeof(info));
+}
+
+// Function serve_list, replies with every used entry of a directory
+// Entries are copied from the cached directory, so the image is only read the first time
+int serve_list(server_t *server,int fd,const char *path) {
+	fs_t *fs = &server->fs;
+	dir_entry_t *entries = NULL;
+	uint32_t count = 0;
+	uint32_t status = FS_STATUS_NOT_FOUND;
+
+	pthread_mutex_lock(&server->lock);
+	uint32_t start,blocks;
+	fs_dir_t *dir = NULL;
+	if (fs_resolve_path(fs,path,0,&start,&blocks)) dir = fs_dir_get(fs,start);
+	if (dir) {
+		status = FS_STATUS_IO;
+		entries = malloc((dir->entry_count + 1) * sizeof(dir_entry_t));
+		if (entries) {
+			FS_STAT_ADD(dir_entries_scanned,dir->entry_count);
+			for (uint32_t i = 0; i < dir->entry_count; i++) {
+				if (dir->entries[i].status != 0x00) entries[count++] = dir->entries[i];
+			}
+			status = FS_STATUS_OK;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	int ok = fs_send_msg(fd,FS_OP_LIST,status,NULL,(uint64_t)count * sizeof(dir_entry_t)) &&
+		fs_send_all(fd,entries,(size_t)count * sizeof(dir_entry_t));
+	free(entries);
+	return ok;
+}
+
+// Function serve_get, replies with the contents of a file
+// The lookup and the layout of the file's runs hold the lock, the data is then sent straight from the image
+int serve_get(server_t *server,int fd,const char *path) {
+	fs_t *fs = &server->fs;
+	char *dirpath,*filename;
+	if (!fs_split_path(path,&dirpath,&filename)) return reply(fd,FS_OP_GET,FS_STATUS_BAD_REQUEST);
+
+	pthread_mutex_lock(&server->lock);
+	uint32_t dir_start,dir_blocks,count = 0;
+	dir_entry_t entry;
+	fs_run_t *runs = NULL;
+	int found = fs_resolve_path(fs,dirpath,0,&dir_start,&dir_blocks) &&
+		fs_dir_lookup(fs,dir_start,filename,FS_ENTRY_FILE,&entry);
+	if (found) count = fs_chain_runs(fs,ntohl(entry.starting_block),ntohl(entry.size),&runs);
+	pthread_mutex_unlock(&server->lock);
+	free(dirpath);
+
+	if (!found) return reply(fd,FS_OP_GET,FS_STATUS_NOT_FOUND);
+	uint64_t size = ntohl(entry.size);
+	int ok = fs_send_msg(fd,FS_OP_GET,FS_STATUS_OK,NULL,size) && fs_copy_runs_to_fd(fs,runs,count,size,fd);
+	free(runs);
+	return ok;
+}
+
+// Function put_failed, discards the data of a rejected put and replies with status
+int put_failed(int fd,uint64_t length,uint32_t status) {
+	return fs_relay(fd,-1,length) && reply(fd,FS_OP_PUT,status);
+}
+
+// Function put_done, ends a put, letting a waiting shutdown go ahead once no put is in flight
+void put_done(server_t *server) {
+	if (--server->puts_active == 0) pthread_cond_broadcast(&server->idle);
+	return;
+}
+
+// Function serve_put, stores the data that follows a request as a file
+// Blocks are taken and directories created under the lock, the data is written without it,
+// then the entry is added and the FAT committed so the image is consistent after every put
+int serve_put(server_t *server,int fd,const char *path,uint64_t length) {
+	fs_t *fs = &server->fs;
+	if (!fs->writable) return put_failed(fd,length,FS_STATUS_READ_ONLY);
+	if (length > UINT32_MAX) return put_failed(fd,length,FS_STATUS_BAD_REQUEST);
+
+	char *dirpath,*filename;
+	if (!fs_split_path(path,&dirpath,&filename) || !*filename ||
+			strlen(filename) >= sizeof(((dir_entry_t *)0)->name)) {
+		return put_failed(fd,length,FS_STATUS_BAD_REQUEST);
+	}
+
+	uint32_t block_size = fs->super_block.block_size;
+	uint32_t blocks_needed = (length + block_size - 1)/block_size;
+	fs_run_t *extents = NULL;
+	uint32_t extent_count = 0,first_block = 0;
+	uint32_t dir_start,dir_blocks;
+
+	pthread_mutex_lock(&server->lock);
+	uint32_t status = FS_STATUS_OK;
+	if (!fs_resolve_path(fs,dirpath,1,&dir_start,&dir_blocks)) status = FS_STATUS_NOT_FOUND;
+	else if (blocks_needed > 0) {
+		first_block = fs_alloc_chain(fs,blocks_needed,&extents,&extent_count);
+		if (first_block == 0) status = FS_STATUS_NO_SPACE;
+	}
+	if (status == FS_STATUS_OK) server->puts_active++;
+	pthread_mutex_unlock(&server->lock);
+
+	if (status != FS_STATUS_OK) {
+		free(dirpath);
+		return put_failed(fd,length,status);
+	}
+
+	// A short or failed read leaves the stream out of step, so the connection is dropped
+	int ok = fs_write_extents(fs,extents,extent_count,fd,length,NULL);
+
+	pthread_mutex_lock(&server->lock);
+	if (ok) {
+		dir_entry_t entry = {0};
+		entry.status = FS_ENTRY_FILE;
+		strncpy(entry.name,filename,sizeof(entry.name)-1);
+		entry.starting_block = htonl(first_block);
+		entry.block_count = htonl(blocks_needed);
+		entry.size = htonl(length);
+		fs_fill_timestamp(&entry);
+		status = fs_dir_add(fs,dir_start,&entry) ? FS_STATUS_OK : FS_STATUS_NO_SPACE;
+	}
+	if (!ok || status != FS_STATUS_OK) {
+		for (uint32_t e = 0; e < extent_count; e++) {
+			for (uint32_t b = 0; b < extents[e].length; b++) {
+				fs_set_next(fs,extents[e].start + b,FAT_FREE);
+			}
+		}
+	}
+	if (!fs_flush(fs) && status == FS_STATUS_OK) status = FS_STATUS_IO;
+	put_done(server);
+	pthread_mutex_unlock(&server->lock);
+
+	free(extents);
+	free(dirpath);
+	return ok && reply(fd,FS_OP_PUT,status);
+}
+
+// Function serve_client, answers requests on one connection until the client hangs up
+void *serve_client(void *arg) {
+	client_t *client = arg;
+	int fd = client->fd;
+	fs_msg_t msg;
+	char path[FS_PATH_MAX + 1];
+
+	int ok = 1;
+	while (ok && fs_recv_msg(fd,&msg)) {
+		if (!fs_recv_all(fd,path,msg.path_length)) break;
+		path[msg.path_length] = '\0';
+
+		if (msg.op == FS_OP_INFO) ok = serve_info(client->server,fd);
+		else if (msg.op == FS_OP_LIST) ok = serve_list(client->server,fd,path);
+		else if (msg.op == FS_OP_GET) ok = serve_get(client->server,fd,path);
+		else if (msg.op == FS_OP_PUT) ok = serve_put(client->server,fd,path,msg.length);
+		else ok = fs_relay(fd,-1,msg.length) && reply(fd,msg.op,FS_STATUS_BAD_REQUEST);
+	}
+
+	close(fd);
+	free(client);
+	return NULL;
+}
+
+// Function open_socket, binds and listens on a Unix socket, replacing a stale one
+// Returns the listening descriptor, or -1 on failure
+int open_socket(const char *path) {
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path,path);
+
+	// A socket nobody answers on is left over from a server that did not shut down
+	int probe = fs_connect(path);
+	if (probe >= 0) {
+		close(probe);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	unlink(path);
+
+	int fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if (fd < 0) return -1;
+	if (bind(fd,(struct sockaddr *)&addr,sizeof(addr)) != 0 || listen(fd,64) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc,char *argv[]) {
+	fs_stats_init(&argc,argv);
+
+	// An image and a socket path are needed as arguments
+	if (argc < 3) {
+		perror("Error: Not enough arguments");
+		exit(1);
+	}
+
+	// Opens the image once, for writing when possible, and keeps it for every client
+	server_t server = {0};
+	if (!fs_open(&server.fs,argv[1],"rb+")) {
+		if (!fs_open(&server.fs,argv[1],"rb")) {
+			perror("Error: File Invalid");
+			exit(1);
+		}
+
+		// Read-only images never change, so their counts are taken once
+		if (!fs_read_counters(&server.fs,&server.fs.census)) {
+			uint32_t *raw = fs_read_raw_fat(&server.fs);
+			if (raw) fs_fat_census(raw,server.fs.fat_entries,&server.fs.census);
+			free(raw);
+		}
+	}
+	pthread_mutex_init(&server.lock,NULL);
+	pthread_cond_init(&server.idle,NULL);
+
+	int listen_fd = open_socket(argv[2]);
+	if (listen_fd < 0) {
+		perror("Error: Cannot listen on socket");
+		exit(1);
+	}
+
+	// Signals interrupt accept so the loop can commit and exit
+	struct sigaction sa = {0};
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT,&sa,NULL);
+	sigaction(SIGTERM,&sa,NULL);
+	signal(SIGPIPE,SIG_IGN);
+
+	// Client threads block the signals so they always reach the accept loop
+	sigset_t signals,previous;
+	sigemptyset(&signals);
+	sigaddset(&signals,SIGINT);
+	sigaddset(&signals,SIGTERM);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+	while (!stopping) {
+		int fd = accept(listen_fd,NULL,NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			perror("Error: accept failed");
+			break;
+		}
+
+		client_t *client = malloc(sizeof(client_t));
+		pthread_t thread;
+		if (!client) {
+			close(fd);
+			continue;
+		}
+		client->server = &server;
+		client->fd = fd;
+		pthread_sigmask(SIG_BLOCK,&signals,&previous);
+		if (pthread_create(&thread,&attr,serve_client,client) != 0) {
+			close(fd);
+			free(client);
+		}
+		pthread_sigmask(SIG_SETMASK,&previous,NULL);
+	}
+	close(listen_fd);
+	unlink(argv[2]);
+
+	// Waits for puts in flight, then commits while holding the lock so nothing else starts
+	pthread_mutex_lock(&server.lock);
+	while (server.puts_active > 0) pthread_cond_wait(&server.idle,&server.lock);
+	if (!fs_flush(&server.fs)) {
+		perror("Error: FAT write-back failed");
+		exit(1);
+	}
+
+	// Connections still open are cut off by exiting, the image is not touched again
+	exit(0);
+}
@@ -0,0 +1,469 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+
+// Function fs_open, opens an image and loads its superblock and FAT
+// Mode is passed to fopen, returns 1 if successful, 0 otherwise
+int fs_open(fs_t *fs,const char *path,const char *mode) {
+	return fs_open_flags(fs,path,mode,0);
+}
+
+// Function open_direct, opens the O_DIRECT descriptor used for file data
+// Leaves direct_align at 0 if the file system cannot do direct I/O
+static void open_direct(fs_t *fs,const char *path) {
+	int fd = open(path,(fs->writable ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0) return;
+
+	// Without alignment information a page is assumed, which every file system accepts
+	uint32_t align = FS_AIO_ALIGN;
+	struct statx stx;
+	if (statx(fd,"",AT_EMPTY_PATH,STATX_DIOALIGN,&stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)) {
+		align = stx.stx_dio_offset_align;
+		if (align == 0 || stx.stx_dio_mem_align > FS_AIO_ALIGN) {
+			close(fd);
+			return;
+		}
+	}
+	fs->direct_fd = fd;
+	fs->direct_align = align;
+	return;
+}
+
+// Function fs_open_flags, fs_open with FS_OPEN_* flags
+int fs_open_flags(fs_t *fs,const char *path,const char *mode,int flags) {
+	memset(fs,0,sizeof(*fs));
+
+	fs->fp = fopen(path,mode);
+	if (!fs->fp) return 0;
+
+	// One read covers the 8 byte file system ID, the superblock and the counters record
+	unsigned char header[FS_COUNTERS_OFFSET + sizeof(fs_counters_t)];
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	size_t got = fread(header,1,sizeof(header),fs->fp);
+	fs_stats_io(FS_IO_READ,got,0);
+	fs_timer_stop(FS_PHASE_SUPERBLOCK,&timer);
+	if (got != sizeof(header)) {
+		fs_close(fs);
+		return 0;
+	}
+	super_block_t *super_block = &fs->super_block;
+	memcpy(super_block,header + 8,sizeof(super_block_t));
+	memcpy(&fs->counters,header + FS_COUNTERS_OFFSET,sizeof(fs_counters_t));
+
+	// Superblock values are converted to the correct endianness
+	super_block->block_size = ntohs(super_block->block_size);
+	super_block->block_count = ntohl(super_block->block_count);
+	super_block->fat_start = ntohl(super_block->fat_start);
+	super_block->fat_blocks = ntohl(super_block->fat_blocks);
+	super_block->root_start = ntohl(super_block->root_start);
+	super_block->root_blocks = ntohl(super_block->root_blocks);
+
+	if (super_block->block_size < sizeof(dir_entry_t)) {
+		fs_close(fs);
+		return 0;
+	}
+
+	size_t fat_size = (size_t)super_block->block_size * super_block->fat_blocks;
+	fs->fat_entries = fat_size/sizeof(uint32_t);
+	if (flags & FS_OPEN_NO_FAT) return 1;
+
+	// Reads the whole FAT in one pass and decodes it to host order
+	fs_timer_start(&timer);
+	fs->fat = fs_read_raw_fat(fs);
+	if (!fs->fat) {
+		fs_close(fs);
+		return 0;
+	}
+	fs->writable = strchr(mode,'+') || strchr(mode,'w') || strchr(mode,'a');
+	if (fs->writable) fs_fat_census(fs->fat,fs->fat_entries,&fs->census);
+	for (uint32_t i = 0; i < fs->fat_entries; i++) {
+		fs->fat[i] = ntohl(fs->fat[i]);
+	}
+
+	// One dirty bit per FAT block
+	fs->fat_dirty = calloc(super_block->fat_blocks/64 + 1,sizeof(uint64_t));
+	if (!fs->fat_dirty) {
+		fs_close(fs);
+		return 0;
+	}
+
+	// Writers get the free-space index up front so allocation never rescans the FAT
+	if (fs->writable) {
+		if (!fs_free_init(fs)) {
+			fs_close(fs);
+			return 0;
+		}
+	}
+
+	fs_timer_stop(FS_PHASE_FAT_LOAD,&timer);
+
+	// Metadata keeps going through fp, only file data uses the direct descriptor
+	if (flags & FS_OPEN_DIRECT) open_direct(fs,path);
+	return 1;
+}
+
+// Function fs_read_raw_fat, reads the FAT exactly as stored on disk (big-endian)
+// Returns a malloc'd array of fat_entries entries, or NULL on failure
+uint32_t *fs_read_raw_fat(fs_t *fs) {
+	size_t fat_size = (size_t)fs->fat_entries * sizeof(uint32_t);
+	uint32_t *raw = malloc(fat_size ? fat_size : sizeof(uint32_t));
+	if (!raw) return NULL;
+
+	off_t offset = fs_block_offset(fs,fs->super_block.fat_start);
+	if (fseek(fs->fp,offset,SEEK_SET) != 0 ||
+			fread(raw,sizeof(uint32_t),fs->fat_entries,fs->fp) != fs->fat_entries) {
+		free(raw);
+		return NULL;
+	}
+	fs_stats_io(FS_IO_READ,fat_size,offset);
+	return raw;
+}
+
+// Function counters_checksum, mixes the fields of a host-order counters record
+static uint32_t counters_checksum(uint32_t generation,uint32_t clean,const fs_census_t *census) {
+	uint32_t sum = FS_COUNTERS_MAGIC ^ 0xA5A5A5A5;
+	uint32_t fields[5] = {generation,clean,(uint32_t)census->free_blocks,
+		(uint32_t)census->reserved_blocks,(uint32_t)census->allocated_blocks};
+	for (int i = 0; i < 5; i++) {
+		sum = ((sum << 5) | (sum >> 27)) ^ fields[i];
+	}
+	return sum;
+}
+
+// Function encode_counters, builds the on-disk counters record for a census
+static void encode_counters(uint32_t generation,uint32_t clean,const fs_census_t *census,fs_counters_t *record) {
+	record->magic = htonl(FS_COUNTERS_MAGIC);
+	record->generation = htonl(generation);
+	record->clean = htonl(clean);
+	record->free_blocks = htonl((uint32_t)census->free_blocks);
+	record->reserved_blocks = htonl((uint32_t)census->reserved_blocks);
+	record->allocated_blocks = htonl((uint32_t)census->allocated_blocks);
+	record->checksum = htonl(counters_checksum(generation,clean,census));
+	return;
+}
+
+// Function write_counters, stores the writer's census in block 0 with the given clean flag
+static int write_counters(fs_t *fs,uint32_t clean) {
+	fs_counters_t record;
+	encode_counters(fs->generation,clean,&fs->census,&record);
+
+	if (pwrite(fileno(fs->fp),&record,sizeof(record),FS_COUNTERS_OFFSET) != sizeof(record)) return 0;
+	fs_stats_io(FS_IO_WRITE,sizeof(record),FS_COUNTERS_OFFSET);
+	fs->counters = record;
+	return 1;
+}
+
+// Function fs_read_counters, returns the persisted counters read at open time
+// Returns 1 if the record is present and was committed cleanly, 0 if a full scan is needed
+int fs_read_counters(const fs_t *fs,fs_census_t *out) {
+	const fs_counters_t *record = &fs->counters;
+	if (ntohl(record->magic) != FS_COUNTERS_MAGIC || ntohl(record->clean) != 1) return 0;
+
+	fs_census_t census;
+	census.free_blocks = ntohl(record->free_blocks);
+	census.reserved_blocks = ntohl(record->reserved_blocks);
+	census.allocated_blocks = ntohl(record->allocated_blocks);
+	if (ntohl(record->checksum) != counters_checksum(ntohl(record->generation),1,&census)) return 0;
+
+	// Counters that do not add up to the FAT size are treated as stale
+	if (census.free_blocks + census.reserved_blocks + census.allocated_blocks != fs->fat_entries) return 0;
+
+	*out = census;
+	return 1;
+}
+
+// Function fs_commit_counters, rewrites the counters record from the census of a writable image
+// Used after a repair finds the record out of step with the FAT, returns 1 if successful, 0 otherwise
+int fs_commit_counters(fs_t *fs) {
+	if (!fs->writable || fs->counters_open) return 0;
+	fs->generation = ntohl(fs->counters.magic) == FS_COUNTERS_MAGIC ?
+		ntohl(fs->counters.generation) + 1 : 1;
+	if (fflush(fs->fp) != 0) return 0;
+	return write_counters(fs,1);
+}
+
+// Function fs_format, creates an empty image at path
+// Only block 0, the FAT blocks holding the reserved and root entries and the last FAT block are written
+// Entries the last FAT block has past block_count are reserved, as there are no blocks behind them
+// Everything else, including the rest of the FAT and the root directory, reads back as zeros
+// from the hole left by ftruncate, so the cost does not grow with the image size
+// Returns 1 if successful, 0 otherwise
+int fs_format(const char *path,uint32_t block_size,uint32_t block_count,uint32_t root_blocks,int flags) {
+	if (block_size < sizeof(dir_entry_t) || block_size > UINT16_MAX || root_blocks == 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	uint32_t fat_blocks = ((uint64_t)block_count * sizeof(uint32_t) + block_size - 1)/block_size;
+	uint32_t root_start = 1 + fat_blocks;
+	if ((uint64_t)root_start + root_blocks >= block_count) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	int fd = open(path,O_RDWR | O_CREAT | O_TRUNC,0666);
+	if (fd < 0) return 0;
+	off_t image_size = (off_t)block_size * block_count;
+	int ok = ftruncate(fd,image_size) == 0;
+	if (ok && (flags & FS_FORMAT_PREALLOCATE)) ok = fallocate(fd,0,0,image_size) == 0;
+
+	// Block 0 holds the ID, the superblock and counters describing the empty FAT
+	uint32_t used = root_start + root_blocks;
+	uint32_t per_block = block_size/sizeof(uint32_t);
+	uint64_t fat_entries = (uint64_t)fat_blocks * per_block;
+	uint32_t head_blocks = (used + per_block - 1)/per_block;
+
+	// A last FAT block next to the head is written with it, one further away on its own
+	uint32_t tail_block = fat_blocks - 1;
+	int separate_tail = fat_entries > block_count && tail_block > head_blocks;
+	if (fat_entries > block_count && !separate_tail) head_blocks = fat_blocks;
+	size_t fat_bytes = (size_t)head_blocks * block_size;
+	char *block = calloc(1,block_size);
+	uint32_t *fat = calloc(1,fat_bytes);
+	uint32_t *tail = separate_tail ? calloc(1,block_size) : NULL;
+	ok = ok && block && fat && (tail || !separate_tail);
+	if (ok) {
+		super_block_t super_block;
+		super_block.block_size = htons(block_size);
+		super_block.block_count = htonl(block_count);
+		super_block.fat_start = htonl(1);
+		super_block.fat_blocks = htonl(fat_blocks);
+		super_block.root_start = htonl(root_start);
+		super_block.root_blocks = htonl(root_blocks);
+
+		fs_census_t census;
+		census.reserved_blocks = root_start + (fat_entries - block_count);
+		census.allocated_blocks = root_blocks;
+		census.free_blocks = block_count - used;
+		fs_counters_t record;
+		encode_counters(0,1,&census,&record);
+
+		memcpy(block,"CSC360FS",8);
+		memcpy(block + 8,&super_block,sizeof(super_block));
+		memcpy(block + FS_COUNTERS_OFFSET,&record,sizeof(record));
+		ok = pwrite(fd,block,block_size,0) == (ssize_t)block_size;
+		fs_stats_io(FS_IO_WRITE,block_size,0);
+	}
+
+	// Everything up to the root is reserved and the root is linked into one chain
+	if (ok) {
+		for (uint32_t i = 0; i < root_start; i++) fat[i] = htonl(FAT_RESERVED);
+		for (uint32_t b = root_start; b < used; b++) fat[b] = htonl(b + 1 < used ? b + 1 : FAT_EOF);
+		for (uint64_t i = block_count; i < fat_entries; i++) {
+			if (separate_tail) tail[i - (uint64_t)tail_block * per_block] = htonl(FAT_RESERVED);
+			else fat[i] = htonl(FAT_RESERVED);
+		}
+		ok = pwrite(fd,fat,fat_bytes,block_size) == (ssize_t)fat_bytes;
+		fs_stats_io(FS_IO_WRITE,fat_bytes,block_size);
+	}
+	if (ok && separate_tail) {
+		off_t offset = (off_t)(1 + tail_block) * block_size;
+		ok = pwrite(fd,tail,block_size,offset) == (ssize_t)block_size;
+		fs_stats_io(FS_IO_WRITE,block_size,offset);
+	}
+
+	free(block);
+	free(fat);
+	free(tail);
+	if (close(fd) != 0) ok = 0;
+	return ok;
+}
+
+// Function fs_close, writes back any FAT changes, closes the image and frees the FAT
+void fs_close(fs_t *fs) {
+	if (fs->fp) {
+		fs_flush(fs);
+		fclose(fs->fp);
+	}
+	fs_free_destroy(fs);
+	fs_dir_cache_destroy(fs);
+	fs_path_cache_clear(fs);
+	free(fs->fat);
+	free(fs->fat_dirty);
+	if (fs->direct_align) close(fs->direct_fd);
+	fs->direct_align = 0;
+	fs->fp = NULL;
+	fs->fat = NULL;
+	fs->fat_dirty = NULL;
+	fs->fat_entries = 0;
+	return;
+}
+
+// Function fat_block_dirty, returns 1 if FAT block i has changes waiting to be written
+static int fat_block_dirty(const fs_t *fs,uint32_t i) {
+	return (fs->fat_dirty[i/64] >> (i % 64)) & 1;
+}
+
+// Function flush_fat, fs_flush once there are changes to commit
+static int flush_fat(fs_t *fs) {
+	uint32_t block_size = fs->super_block.block_size;
+	uint32_t per_block = block_size/sizeof(uint32_t);
+	uint32_t fat_blocks = fs->super_block.fat_blocks;
+
+	// Stdio writes to directory blocks go out first, then the FAT by descriptor
+	if (fflush(fs->fp) != 0) return 0;
+	int fd = fileno(fs->fp);
+
+	uint32_t *buf = NULL;
+	uint32_t buf_blocks = 0;
+	int ok = 1;
+	for (uint32_t i = 0; i < fat_blocks; ) {
+		if (fs->fat_dirty[i/64] == 0) {
+			i = (i/64 + 1) * 64;
+			continue;
+		}
+		if (!fat_block_dirty(fs,i)) {
+			i++;
+			continue;
+		}
+
+		// Collects the run of consecutive dirty FAT blocks starting here
+		uint32_t run = 1;
+		while (i + run < fat_blocks && fat_block_dirty(fs,i + run)) run++;
+
+		if (run > buf_blocks) {
+			uint32_t *grown = realloc(buf,(size_t)run * block_size);
+			if (!grown) {
+				ok = 0;
+				break;
+			}
+			buf = grown;
+			buf_blocks = run;
+		}
+
+		// Encodes the entries back to big-endian and writes the run in one call
+		uint32_t first = i * per_block;
+		uint32_t entries = run * per_block;
+		for (uint32_t e = 0; e < entries; e++) {
+			buf[e] = htonl(fs->fat[first + e]);
+		}
+		size_t len = (size_t)run * block_size;
+		off_t offset = fs_block_offset(fs,fs->super_block.fat_start + i);
+		if (pwrite(fd,buf,len,offset) != (ssize_t)len) {
+			ok = 0;
+			break;
+		}
+		fs_stats_io(FS_IO_WRITE,len,offset);
+
+		for (uint32_t b = i; b < i + run; b++) {
+			fs->fat_dirty[b/64] &= ~((uint64_t)1 << (b % 64));
+		}
+		i += run;
+	}
+	free(buf);
+
+	// Once the FAT is on disk the counters describe it again
+	if (ok) ok = write_counters(fs,1);
+	if (ok) fs->counters_open = 0;
+	return ok;
+}
+
+// Function fs_flush, commits pending FAT changes
+// Dirty FAT blocks are written whole, in order, with consecutive blocks merged into one write
+// Returns 1 if successful, 0 otherwise
+int fs_flush(fs_t *fs) {
+	if (!fs->fat_dirty) return 1;
+	if (!fs->counters_open) return 1;
+
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	int ok = flush_fat(fs);
+	fs_timer_stop(FS_PHASE_COMMIT,&timer);
+	return ok;
+}
+
+// Function fs_block_offset, returns the byte offset of a block in the image
+off_t fs_block_offset(const fs_t *fs,uint32_t block) {
+	return (off_t)block * fs->super_block.block_size;
+}
+
+// Function fs_next_block, returns the FAT entry for a block from memory
+// Blocks outside the FAT are treated as the end of a chain
+uint32_t fs_next_block(const fs_t *fs,uint32_t block) {
+	if (block >= fs->fat_entries) return FAT_EOF;
+	FS_STAT_ADD(fat_hops,1);
+	return fs->fat[block];
+}
+
+// Function fs_chain_extents, walks a chain in the in-memory FAT and groups consecutive blocks into runs
+// Stops after max_blocks blocks, at the end of the chain, or at a block outside the FAT
+// Sets out to a malloc'd list of runs and returns how many there are
+uint32_t fs_chain_extents(const fs_t *fs,uint32_t start,uint32_t max_blocks,fs_run_t **out) {
+	uint32_t count = 0,capacity = 16;
+	fs_run_t *runs = malloc(capacity * sizeof(fs_run_t));
+	*out = runs;
+	if (!runs) return 0;
+
+	// max_blocks also bounds the walk if the chain loops back on itself
+	uint32_t current = start,walked = 0;
+	while (current != FAT_EOF && current < fs->fat_entries && walked < max_blocks) {
+		if (count > 0 && runs[count - 1].start + runs[count - 1].length == current) {
+			runs[count - 1].length++;
+		} else {
+			if (count == capacity) {
+				capacity *= 2;
+				fs_run_t *grown = realloc(runs,capacity * sizeof(fs_run_t));
+				if (!grown) break;
+				runs = grown;
+			}
+			runs[count].start = current;
+			runs[count].length = 1;
+			count++;
+		}
+		walked++;
+		current = fs->fat[current];
+	}
+	FS_STAT_ADD(fat_hops,walked);
+
+	*out = runs;
+	return count;
+}
+
+// Function census_adjust, adds delta to the census bucket a FAT value belongs in
+static void census_adjust(fs_census_t *census,uint32_t value,int delta) {
+	if (value == FAT_FREE) census->free_blocks += delta;
+	else if (value == FAT_RESERVED) census->reserved_blocks += delta;
+	else census->allocated_blocks += delta;
+	return;
+}
+
+// Function fs_set_next, updates the FAT entry for a block in memory and marks its FAT block dirty
+// Nothing reaches the disk until fs_flush
+// Keeps the free-space index in step when a block changes between free and used
+// Returns 1 if successful, 0 otherwise
+int fs_set_next(fs_t *fs,uint32_t block,uint32_t value) {
+	if (block >= fs->fat_entries) return 0;
+
+	// The on-disk counters are marked stale before the first change of this commit
+	if (!fs->counters_open) {
+		fs->generation = ntohl(fs->counters.magic) == FS_COUNTERS_MAGIC ?
+			ntohl(fs->counters.generation) + 1 : 1;
+		if (fflush(fs->fp) != 0 || !write_counters(fs,0)) return 0;
+		fs->counters_open = 1;
+	}
+
+	uint32_t old = fs->fat[block];
+	if (old == FAT_FREE && value != FAT_FREE) {
+		fs_free_take(fs,block);
+		FS_STAT_ADD(blocks_allocated,1);
+	} else if (old != FAT_FREE && value == FAT_FREE) {
+		fs_free_release(fs,block);
+		FS_STAT_ADD(blocks_freed,1);
+	}
+	census_adjust(&fs->census,old,-1);
+	census_adjust(&fs->census,value,1);
+	fs->fat[block] = value;
+
+	uint32_t fat_block = block/(fs->super_block.block_size/sizeof(uint32_t));
+	fs->fat_dirty[fat_block/64] |= (uint64_t)1 << (fat_block % 64);
+	return 1;
+}
@@ -0,0 +1,515 @@
+#ifndef FS_H
+#define FS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Special FAT entry values
+#define FAT_FREE 0x00000000
+#define FAT_RESERVED 0x00000001
+#define FAT_EOF 0xFFFFFFFF
+
+// Structure super_block_t, stores information for the superblock
+typedef struct {
+	uint16_t block_size;
+	uint32_t block_count;
+	uint32_t fat_start;
+	uint32_t fat_blocks;
+	uint32_t root_start;
+	uint32_t root_blocks;
+} __attribute__((packed)) super_block_t;
+
+// Structure dir_entry_t, stores information about directory entries
+typedef struct {
+	uint8_t status;
+	uint32_t starting_block;
+	uint32_t block_count;
+	uint32_t size;
+	uint8_t created[7];
+	uint8_t modified[7];
+	char name[31];
+	uint8_t unused[6];
+} __attribute__((packed)) dir_entry_t;
+
+// Directories nested deeper than this are not followed, which also stops loops in corrupt images
+#define FS_MAX_DEPTH 256
+
+// Status bits of a directory entry
+#define FS_ENTRY_FILE (1 << 1)
+#define FS_ENTRY_DIR (1 << 2)
+
+// Block 0 carries a record of allocation counters after the superblock
+// Writers clear clean while they work and set it again when they commit
+#define FS_COUNTERS_OFFSET 32
+#define FS_COUNTERS_MAGIC 0x46534354 // "FSCT"
+
+// Structure fs_counters_t, the persisted counters as stored on disk (big-endian)
+typedef struct {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t clean;
+	uint32_t free_blocks;
+	uint32_t reserved_blocks;
+	uint32_t allocated_blocks;
+	uint32_t checksum;
+} __attribute__((packed)) fs_counters_t;
+
+// Structure fs_census_t, counts of each kind of FAT entry
+typedef struct {
+	uint64_t free_blocks;
+	uint64_t reserved_blocks;
+	uint64_t allocated_blocks;
+} fs_census_t;
+
+// Structure fs_run_t, a run of consecutive free blocks
+typedef struct {
+	uint32_t start;
+	uint32_t length;
+} fs_run_t;
+
+// Structure fs_dir_t, a directory loaded into memory with a hash index over its names
+// Slot i lives in blocks[i / entries per block], index holds slot + 1 with 0 marking empty
+typedef struct {
+	uint32_t start;
+	uint32_t *blocks;
+	uint32_t block_count;
+	dir_entry_t *entries;
+	uint32_t entry_count;
+	uint32_t *index;
+	uint32_t index_size;
+	uint32_t indexed;
+	uint32_t first_free;
+} fs_dir_t;
+
+// Structure fs_path_t, a cached path prefix and the directory it resolves to
+typedef struct {
+	char *path;
+	uint32_t start;
+	uint32_t blocks;
+} fs_path_t;
+
+// Structure fs_pair_t, one source and destination pair from a batch manifest
+typedef struct {
+	char *source;
+	char *dest;
+} fs_pair_t;
+
+// Structure fs_t, an opened disk image
+// Holds the image handle, the host-endian superblock and a host-endian copy of the FAT
+// Images opened for writing also get a free-block bitmap and an index of free runs
+// FAT changes stay in memory, with changed FAT blocks marked in fat_dirty until fs_flush
+// Writers also keep census current so fs_flush can persist it in the counters record
+// With FS_OPEN_DIRECT, file data may also go through an O_DIRECT descriptor, direct_align is 0 without one
+typedef struct {
+	FILE *fp;
+	super_block_t super_block;
+	uint32_t *fat;
+	uint32_t fat_entries;
+	uint64_t *fat_dirty;
+
+	int writable;
+	fs_counters_t counters;
+	fs_census_t census;
+	uint32_t generation;
+	int counters_open;
+
+	uint64_t *free_map;
+	fs_run_t *free_runs;
+	uint32_t run_first;
+	uint32_t run_count;
+	uint32_t run_capacity;
+	uint32_t free_blocks;
+
+	fs_dir_t **dirs;
+	uint32_t dir_slots;
+	uint32_t dir_count;
+
+	fs_path_t *paths;
+	uint32_t path_slots;
+	uint32_t path_count;
+
+	int direct_fd;
+	uint32_t direct_align;
+} fs_t;
+
+// Flags for fs_open_flags
+#define FS_OPEN_NO_FAT 0x1 // Only the superblock is loaded, fat stays NULL
+#define FS_OPEN_DIRECT 0x2 // File data bypasses the page cache where the file system allows it
+
+// Function fs_open, opens an image and loads its superblock and FAT
+// Mode is passed to fopen, returns 1 if successful, 0 otherwise
+int fs_open(fs_t *fs,const char *path,const char *mode);
+
+// Function fs_open_flags, fs_open with FS_OPEN_* flags
+int fs_open_flags(fs_t *fs,const char *path,const char *mode,int flags);
+
+// Flags for fs_format
+#define FS_FORMAT_PREALLOCATE 0x1 // Reserves the data region with fallocate instead of leaving a hole
+
+// Function fs_format, creates an empty image with the FAT directly after block 0 and the root after the FAT
+// The data region is left sparse unless FS_FORMAT_PREALLOCATE is given
+// Returns 1 if successful, 0 otherwise
+int fs_format(const char *path,uint32_t block_size,uint32_t block_count,uint32_t root_blocks,int flags);
+
+// Function fs_read_raw_fat, reads the FAT exactly as stored on disk (big-endian)
+// Returns a malloc'd array of fat_entries entries, or NULL on failure
+uint32_t *fs_read_raw_fat(fs_t *fs);
+
+// Function fs_read_counters, returns the persisted counters read at open time
+// Returns 1 if the record is present and was committed cleanly, 0 if a full scan is needed
+int fs_read_counters(const fs_t *fs,fs_census_t *out);
+
+// Function fs_fat_census, counts free, reserved and allocated entries in an on-disk FAT
+// Compares against the big-endian patterns directly, using SSE2/AVX2 when the CPU has them
+// and splitting very large tables across threads
+void fs_fat_census(const uint32_t *raw,size_t entries,fs_census_t *out);
+
+// Function fs_commit_counters, rewrites the counters record from the census of a writable image
+// Used after a repair finds the record out of step with the FAT, returns 1 if successful, 0 otherwise
+int fs_commit_counters(fs_t *fs);
+
+// Function fs_close, writes back any FAT changes, closes the image and frees the FAT
+void fs_close(fs_t *fs);
+
+// Function fs_flush, commits pending FAT changes
+// Dirty FAT blocks are written whole, in order, with consecutive blocks merged into one write
+// Returns 1 if successful, 0 otherwise
+int fs_flush(fs_t *fs);
+
+// Function fs_block_offset, returns the byte offset of a block in the image
+off_t fs_block_offset(const fs_t *fs,uint32_t block);
+
+// Function fs_next_block, returns the FAT entry for a block from memory
+// Blocks outside the FAT are treated as the end of a chain
+uint32_t fs_next_block(const fs_t *fs,uint32_t block);
+
+// Function fs_set_next, updates the FAT entry for a block in memory and marks its FAT block dirty
+// Nothing reaches the disk until fs_flush
+// Keeps the free-space index in step when a block changes between free and used
+// Returns 1 if successful, 0 otherwise
+int fs_set_next(fs_t *fs,uint32_t block,uint32_t value);
+
+// Function fs_chain_extents, walks a chain in the in-memory FAT and groups consecutive blocks into runs
+// Stops after max_blocks blocks, at the end of the chain, or at a block outside the FAT
+// Sets out to a malloc'd list of runs and returns how many there are
+uint32_t fs_chain_extents(const fs_t *fs,uint32_t start,uint32_t max_blocks,fs_run_t **out);
+
+// Readahead depth limits in bytes, FS_PREFETCH_MAX also caps how much of one run is requested
+#define FS_PREFETCH_MIN (128 << 10)
+#define FS_PREFETCH_MAX (16 << 20)
+
+// Structure fs_prefetch_t, readahead state for one walk over the runs of a chain
+// Runs before next have been requested, ahead is how many bytes of them lie past current
+typedef struct {
+	int fd;
+	uint32_t block_size;
+	const fs_run_t *runs;
+	uint32_t count;
+	uint32_t current;
+	uint32_t next;
+	uint64_t ahead;
+	uint64_t depth;
+	int streak;
+	int probe;
+} fs_prefetch_t;
+
+// Function fs_prefetch_start, sets up readahead for a walk over the runs of a chain
+// fd is the descriptor the runs will be read through
+void fs_prefetch_start(fs_prefetch_t *pf,const fs_t *fs,int fd,const fs_run_t *runs,uint32_t count);
+
+// Function fs_prefetch_at, called before reading a run, keeps the next depth bytes of the chain requested
+// with posix_fadvise(WILLNEED), as the kernel cannot guess where a chain goes next
+// The depth adapts: a requested run that is still not cached when it is reached doubles it,
+// and a streak of cached runs eases it back
+void fs_prefetch_at(fs_prefetch_t *pf,uint32_t run);
+
+// Function fs_read_chain, reads every block of a chain into one buffer, one pread per run with readahead
+// Only positional reads touch the image, so threads may read different chains of one fs_t at once
+// Sets out_blocks to the number of blocks read and returns a malloc'd buffer, or NULL on failure
+char *fs_read_chain(fs_t *fs,uint32_t start,uint32_t *out_blocks);
+
+// Function fs_chain_runs, lays out the runs holding the first size bytes of a chain and flushes pending writes
+// Returns the number of runs, setting runs to a malloc'd array (NULL when size is 0)
+uint32_t fs_chain_runs(fs_t *fs,uint32_t start,uint64_t size,fs_run_t **runs);
+
+// Function fs_copy_runs_to_fd, copies the first size bytes held by runs from fs_chain_runs to out_fd
+// Only reads the image by position, so it needs no lock against threads changing the FAT
+// Returns 1 if successful, 0 otherwise
+int fs_copy_runs_to_fd(fs_t *fs,const fs_run_t *runs,uint32_t count,uint64_t size,int out_fd);
+
+// Function fs_copy_to_fd, copies the first size bytes of a chain to out_fd
+// Each run of consecutive blocks moves as one transfer, using copy_file_range or sendfile
+// when the kernel supports it and large pread/write buffers otherwise
+// Only positional reads touch the image, so several threads may copy from one fs_t at once
+// Returns 1 if successful, 0 otherwise
+int fs_copy_to_fd(fs_t *fs,uint32_t start,uint64_t size,int out_fd);
+
+// Function fs_write_extents, streams size bytes from src_fd into a list of destination runs
+// The source is read in large chunks and each run is written with pwritev
+// If hash is given it receives the 64-bit FNV-1a hash of the data written
+// Only positional writes touch the image, so threads may fill different extents at once
+// Returns 1 if successful, 0 otherwise
+int fs_write_extents(fs_t *fs,const fs_run_t *extents,uint32_t count,int src_fd,uint64_t size,
+		uint64_t *hash);
+
+// Function fs_write_stream, copies src_fd to a new chain until end of input, for sources of unknown length
+// The chain grows as data arrives, into the blocks right after its end while they are free
+// Sets out_start to the first block, 0 for empty input, and out_size to the bytes written
+// On failure every block it allocated is freed again
+// Returns 1 if successful, 0 otherwise
+int fs_write_stream(fs_t *fs,int src_fd,uint32_t *out_start,uint64_t *out_size,uint64_t *hash);
+
+// Function fs_entry_name, copies an entry's name into a terminated string
+// Trailing spaces and padding are trimmed, out must hold 32 bytes
+void fs_entry_name(const dir_entry_t *entry,char *out);
+
+// Function fs_dir_get, returns the loaded directory starting at start, loading it on first use
+// The whole chain is read once and its names are indexed, returns NULL on failure
+fs_dir_t *fs_dir_get(fs_t *fs,uint32_t start);
+
+// Function fs_dir_lookup, finds the first entry called name whose status has any of the type bits
+// Returns 1 and copies the entry to out if found, 0 otherwise
+int fs_dir_lookup(fs_t *fs,uint32_t start,const char *name,uint8_t type,dir_entry_t *out);
+
+// Function fs_walk, visits every entry below a directory, depth first in directory order
+// path is the image path of the directory, the callback gets each entry's full path
+// Returning 0 from the callback for a directory skips its contents
+// Returns 1 if every directory could be read, 0 otherwise
+typedef int (*fs_walk_fn)(fs_t *fs,const char *path,const dir_entry_t *entry,void *arg);
+int fs_walk(fs_t *fs,uint32_t start,const char *path,fs_walk_fn fn,void *arg);
+
+// Function fs_dir_create, allocates and clears a one block directory
+// Returns its starting block, or 0 if the image is full
+uint32_t fs_dir_create(fs_t *fs);
+
+// Function fs_dir_add, stores an entry in the first unused slot of a directory
+// Extends the directory's chain by one block when it is full
+// Returns 1 if successful, 0 otherwise
+int fs_dir_add(fs_t *fs,uint32_t start,const dir_entry_t *entry);
+
+// Function fs_dir_cache_destroy, frees every loaded directory
+void fs_dir_cache_destroy(fs_t *fs);
+
+// Function fs_fill_timestamp, stores the current local time as the entry's creation time
+void fs_fill_timestamp(dir_entry_t *entry);
+
+// Function fs_resolve_path, finds the directory a path names
+// Starts from the longest prefix already in the path cache and looks up only the rest,
+// caching every prefix it resolves on the way
+// With create set, missing directories are made as it goes
+// Returns 1 if successful, 0 otherwise
+int fs_resolve_path(fs_t *fs,const char *path,int create,uint32_t *out_start,uint32_t *out_blocks);
+
+// Function fs_path_cache_clear, forgets every cached path
+// Anything that removes, renames or moves a directory must call this
+void fs_path_cache_clear(fs_t *fs);
+
+// Function fs_manifest_read, reads source and destination pairs from a manifest, or stdin when path is "-"
+// Each line holds a source and a destination separated by whitespace
+// Blank lines and lines starting with # are skipped
+// Returns the number of pairs and sets out to a malloc'd array, or -1 on failure
+long fs_manifest_read(const char *path,fs_pair_t **out);
+
+// Function fs_manifest_free, frees the pairs returned by fs_manifest_read
+void fs_manifest_free(fs_pair_t *pairs,long count);
+
+// Function fs_split_path, splits an image path into its directory and final name
+// Sets dir to a malloc'd copy of the directory ("/" for the root) and name to point into it
+// Returns 1 if successful, 0 otherwise
+int fs_split_path(const char *path,char **dir,char **name);
+
+// Image server protocol, every request and reply starts with an fs_msg_t (big-endian)
+// A request is followed by path_length bytes of image path and then length bytes of data
+// A reply is followed by length bytes of data
+#define FS_MSG_MAGIC 0x46534D47 // "FSMG"
+#define FS_PATH_MAX 4096
+
+// Request operations
+#define FS_OP_INFO 1 // Reply data is an fs_info_msg_t
+#define FS_OP_LIST 2 // Reply data is every used entry of the directory at path
+#define FS_OP_GET 3 // Reply data is the contents of the file at path
+#define FS_OP_PUT 4 // Request data is stored as the file at path
+
+// Reply statuses
+#define FS_STATUS_OK 0
+#define FS_STATUS_NOT_FOUND 1
+#define FS_STATUS_NO_SPACE 2
+#define FS_STATUS_IO 3
+#define FS_STATUS_BAD_REQUEST 4
+#define FS_STATUS_READ_ONLY 5
+
+// Structure fs_msg_t, the header of a server request or reply
+typedef struct {
+	uint32_t magic;
+	uint32_t op;
+	uint32_t status;
+	uint32_t path_length;
+	uint64_t length;
+} __attribute__((packed)) fs_msg_t;
+
+// Structure fs_info_msg_t, the reply to FS_OP_INFO (big-endian)
+typedef struct {
+	super_block_t super_block;
+	uint64_t free_blocks;
+	uint64_t reserved_blocks;
+	uint64_t allocated_blocks;
+} __attribute__((packed)) fs_info_msg_t;
+
+// Function fs_connect, connects to an image server if path names a Unix socket
+// Returns the connected descriptor, or -1 if path is not a socket or nothing is listening
+int fs_connect(const char *path);
+
+// Function fs_send_all, writes len bytes to fd, retrying short writes
+// Returns 1 if successful, 0 otherwise
+int fs_send_all(int fd,const void *buf,size_t len);
+
+// Function fs_recv_all, reads exactly len bytes from fd
+// Returns 1 if successful, 0 on error or if the peer closes first
+int fs_recv_all(int fd,void *buf,size_t len);
+
+// Function fs_send_msg, writes a message header followed by path, which may be NULL
+// Returns 1 if successful, 0 otherwise
+int fs_send_msg(int fd,uint32_t op,uint32_t status,const char *path,uint64_t length);
+
+// Function fs_recv_msg, reads a message header and converts it to host order
+// Returns 1 if a valid header was read, 0 otherwise
+int fs_recv_msg(int fd,fs_msg_t *msg);
+
+// Function fs_relay, copies len bytes from in_fd to out_fd through a buffer
+// Used for data that travels over the server socket, an out_fd of -1 discards it
+// Returns 1 if successful, 0 otherwise
+int fs_relay(int in_fd,int out_fd,uint64_t len);
+
+// Function fs_status_message, returns a description of a reply status
+const char *fs_status_message(uint32_t status);
+
+// Phases timed by --stats, a phase's time includes any phase it calls
+enum {
+	FS_PHASE_SUPERBLOCK,
+	FS_PHASE_FAT_LOAD,
+	FS_PHASE_RESOLVE,
+	FS_PHASE_DIR_LOAD,
+	FS_PHASE_ALLOC,
+	FS_PHASE_DATA,
+	FS_PHASE_DIR_UPDATE,
+	FS_PHASE_COMMIT,
+	FS_PHASE_COUNT
+};
+
+// Structure fs_stats_t, process-wide I/O and work counters, summed over threads
+typedef struct {
+	uint64_t read_calls;
+	uint64_t write_calls;
+	uint64_t copy_calls;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t seeks;
+	uint64_t fat_hops;
+	uint64_t dir_entries_scanned;
+	uint64_t blocks_allocated;
+	uint64_t blocks_freed;
+	uint64_t readahead_bytes;
+	uint64_t readahead_hits;
+	uint64_t readahead_misses;
+	uint64_t next_offset;
+	uint64_t phase_calls[FS_PHASE_COUNT];
+	uint64_t phase_wall_ns[FS_PHASE_COUNT];
+	uint64_t phase_cpu_ns[FS_PHASE_COUNT];
+} fs_stats_t;
+
+// Structure fs_timer_t, the clocks at the start of a timed phase
+typedef struct {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+} fs_timer_t;
+
+extern fs_stats_t fs_stats;
+extern int fs_stats_enabled;
+
+// Adds n to a counter when --stats is on
+#define FS_STAT_ADD(field,n) do { \
+	if (fs_stats_enabled) __atomic_fetch_add(&fs_stats.field,(n),__ATOMIC_RELAXED); \
+} while (0)
+
+// Function fs_stats_init, turns statistics on if --stats is among the arguments
+// The flag is removed from argv so the tool parses the rest as usual
+// The report is written to standard error as JSON when the tool exits
+void fs_stats_init(int *argc,char *argv[]);
+
+// Function fs_timer_start, marks the start of a phase
+void fs_timer_start(fs_timer_t *timer);
+
+// Function fs_timer_stop, adds the wall and thread CPU time since fs_timer_start to a phase
+void fs_timer_stop(int phase,const fs_timer_t *timer);
+
+// Kinds of call counted by fs_stats_io, a copy moves bytes in the kernel and counts both ways
+enum { FS_IO_READ, FS_IO_WRITE, FS_IO_COPY };
+
+// Function fs_stats_io, counts one read, write or copy call that moved bytes
+// offset is the image position for image I/O, which also counts a seek when it does not
+// continue where the previous image access ended, or -1 for other descriptors
+void fs_stats_io(int kind,uint64_t bytes,off_t offset);
+
+// Async data path: segment size, default and largest queue depth, buffer alignment
+#define FS_AIO_SEGMENT (1 << 20)
+#define FS_AIO_DEFAULT_DEPTH 16
+#define FS_AIO_MAX_DEPTH 256
+#define FS_AIO_ALIGN 4096
+
+// How fs_aio_copy issues its transfers
+enum { FS_AIO_AUTO, FS_AIO_THREADS };
+
+// Structure fs_seg_t, one piece of a positional copy
+// in_length bytes are read, then out_length bytes written, zero padded when out_length is longer
+// Neither is more than FS_AIO_SEGMENT
+typedef struct {
+	off_t in_offset;
+	off_t out_offset;
+	size_t in_length;
+	size_t out_length;
+} fs_seg_t;
+
+extern int fs_aio_depth;
+extern int fs_aio_mode;
+extern int fs_aio_direct;
+
+// Function fs_aio_init, takes the async I/O options out of the arguments
+// --queue-depth N sets how many transfers are kept in flight, 1 keeps the copies synchronous
+// --aio-threads uses the thread pool even where io_uring is available
+// --direct asks for file data to bypass the page cache, see FS_OPEN_DIRECT
+void fs_aio_init(int *argc,char *argv[]);
+
+// Function fs_aio_copy, copies a list of segments between two files with positional reads and writes
+// Keeps up to fs_aio_depth transfers in flight on an io_uring, or on a thread pool where
+// io_uring is unavailable
+// to_image is 1 when out_fd is the image and 0 when in_fd is, so only image transfers count as seeks
+// Returns 1 if successful, 0 otherwise
+int fs_aio_copy(int in_fd,int out_fd,const fs_seg_t *segs,uint32_t count,int to_image);
+
+// Function fs_free_init, builds the free-block bitmap and free-run index from the FAT
+// Called by fs_open for writable images, returns 1 if successful, 0 otherwise
+int fs_free_init(fs_t *fs);
+
+// Function fs_free_destroy, frees the free-space index
+void fs_free_destroy(fs_t *fs);
+
+// Function fs_is_free, returns 1 if the block is free, 0 otherwise
+int fs_is_free(const fs_t *fs,uint32_t block);
+
+// Function fs_alloc_block, allocates the lowest free block and marks it as the end of a chain
+// Returns the block number, or 0 if the image is full
+uint32_t fs_alloc_block(fs_t *fs);
+
+// Function fs_alloc_chain, allocates blocks_needed blocks as the fewest, largest free runs
+// Uses the smallest single run that fits, otherwise the largest runs first
+// Links the blocks into one chain in ascending order, ending in FAT_EOF
+// If out_extents is given it receives a malloc'd list of the runs used, in chain order
+// Returns the first block of the chain, or 0 if there is not enough free space
+uint32_t fs_alloc_chain(fs_t *fs,uint32_t blocks_needed,fs_run_t **out_extents,uint32_t *out_count);
+
+// Internal hooks used by fs_set_next to keep the index current
+void fs_free_take(fs_t *fs,uint32_t block);
+void fs_free_release(fs_t *fs,uint32_t block);
+
+#endif
@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "fs.h"
+
+// Most worker threads the fallback engine starts
+#define MAX_WORKERS 16
+
+// Reads and writes kept in flight, how they are issued, and whether file data skips the page cache
+int fs_aio_depth = FS_AIO_DEFAULT_DEPTH;
+int fs_aio_mode = FS_AIO_AUTO;
+int fs_aio_direct = 0;
+
+// Segment buffers, aligned for direct I/O and kept for reuse by later copies
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *pool[FS_AIO_MAX_DEPTH];
+static int pool_count = 0;
+
+// Function buffer_get, takes a segment buffer from the pool, allocating one if it is empty
+// Returns NULL on failure
+static char *buffer_get(void) {
+	char *buf = NULL;
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count > 0) buf = pool[--pool_count];
+	pthread_mutex_unlock(&pool_lock);
+	if (!buf && posix_memalign((void **)&buf,FS_AIO_ALIGN,FS_AIO_SEGMENT) != 0) buf = NULL;
+	return buf;
+}
+
+// Function buffer_put, returns a segment buffer to the pool, or frees it once the pool is full
+static void buffer_put(char *buf) {
+	if (!buf) return;
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count < FS_AIO_MAX_DEPTH) {
+		pool[pool_count++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(buf);
+	return;
+}
+
+// Function fs_aio_init, takes the async I/O options out of the arguments
+// --queue-depth N sets how many transfers are kept in flight, 1 keeps the copies synchronous
+// --aio-threads uses the thread pool even where io_uring is available
+// --direct asks for file data to bypass the page cache
+void fs_aio_init(int *argc,char *argv[]) {
+	int kept = 0;
+	for (int i = 0; i < *argc; i++) {
+		if (i > 0 && !strcmp(argv[i],"--queue-depth") && i + 1 < *argc) {
+			fs_aio_depth = atoi(argv[++i]);
+			if (fs_aio_depth < 1) fs_aio_depth = 1;
+			if (fs_aio_depth > FS_AIO_MAX_DEPTH) fs_aio_depth = FS_AIO_MAX_DEPTH;
+		} else if (i > 0 && !strcmp(argv[i],"--aio-threads")) {
+			fs_aio_mode = FS_AIO_THREADS;
+		} else if (i > 0 && !strcmp(argv[i],"--direct")) {
+			fs_aio_direct = 1;
+		} else {
+			argv[kept++] = argv[i];
+		}
+	}
+	argv[kept] = NULL;
+	*argc = kept;
+	return;
+}
+
+// Structure uring_t, an io_uring instance and its mapped rings
+typedef struct {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned queued;
+} uring_t;
+
+// Function uring_close, unmaps the rings and closes the instance
+static void uring_close(uring_t *ring) {
+	if (ring->sqes) munmap(ring->sqes,ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring,ring->cq_ring_size);
+	if (ring->sq_ring) munmap(ring->sq_ring,ring->sq_ring_size);
+	if (ring->fd >= 0) close(ring->fd);
+	return;
+}
+
+// Whether io_uring can run the copies: 0 not yet known, 1 yes, -1 no for the rest of the process
+static int uring_state = 0;
+
+// Function uring_supports_rw, asks the kernel whether a ring takes IORING_OP_READ and IORING_OP_WRITE
+// Kernels before 5.6 set rings up but reject those operations, and have no probe either
+// Returns 1 if both are supported, 0 otherwise
+static int uring_supports_rw(int fd) {
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1,size);
+	if (!probe) return 0;
+	int ok = syscall(__NR_io_uring_register,fd,IORING_REGISTER_PROBE,probe,256) == 0 &&
+		probe->ops_len > IORING_OP_WRITE &&
+		(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+// Function uring_open, sets up an io_uring with room for entries submissions
+// Called through syscall directly, so no liburing is needed
+// The first ring is probed for plain reads and writes, and a kernel without them is not asked again
+// Returns 1 if successful, 0 where io_uring is missing, disabled or too old
+static int uring_open(uring_t *ring,unsigned entries) {
+	memset(ring,0,sizeof(*ring));
+	ring->fd = -1;
+	int state = __atomic_load_n(&uring_state,__ATOMIC_RELAXED);
+	if (state < 0) return 0;
+
+	struct io_uring_params params;
+	memset(&params,0,sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup,entries,&params);
+	if (ring->fd < 0) {
+		if (errno == ENOSYS || errno == EPERM) __atomic_store_n(&uring_state,-1,__ATOMIC_RELAXED);
+		return 0;
+	}
+	if (state == 0) {
+		state = uring_supports_rw(ring->fd) ? 1 : -1;
+		__atomic_store_n(&uring_state,state,__ATOMIC_RELAXED);
+		if (state < 0) {
+			close(ring->fd);
+			ring->fd = -1;
+			return 0;
+		}
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	int single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+
+	ring->sq_ring = mmap(NULL,ring->sq_ring_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,
+		ring->fd,IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		uring_close(ring);
+		return 0;
+	}
+	ring->cq_ring = single ? ring->sq_ring : mmap(NULL,ring->cq_ring_size,PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,ring->fd,IORING_OFF_CQ_RING);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL,ring->sqes_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,
+		ring->fd,IORING_OFF_SQES);
+	if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+		if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+		uring_close(ring);
+		return 0;
+	}
+
+	char *sq = ring->sq_ring,*cq = ring->cq_ring;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 1;
+}
+
+// Function uring_queue, adds a positional read or write to the submission ring
+// The caller never queues more than the ring holds, as each slot has at most one transfer in flight
+static void uring_queue(uring_t *ring,int write,int fd,char *buf,size_t len,off_t offset,uint64_t tag) {
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = tag;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail,tail + 1,__ATOMIC_RELEASE);
+	ring->queued++;
+	return;
+}
+
+// Function uring_submit, submits what is queued and waits for at least one completion
+// Returns 1 if successful, 0 otherwise
+static int uring_submit(uring_t *ring) {
+	for (;;) {
+		int done = syscall(__NR_io_uring_enter,ring->fd,ring->queued,1,IORING_ENTER_GETEVENTS,NULL,0);
+		if (done >= 0) {
+			ring->queued -= done;
+			return 1;
+		}
+		if (errno != EINTR) return 0;
+	}
+}
+
+// Structure slot_t, one buffer and the transfer it is part of
+typedef struct {
+	char *buf;
+	uint32_t seg;
+	size_t filled;
+	size_t written;
+	int busy;
+} slot_t;
+
+// Tags carry the slot number and whether the transfer was a write
+#define TAG_WRITE ((uint64_t)1 << 32)
+
+// Function uring_copy, runs a copy with up to depth transfers in flight on an io_uring
+// Each slot reads a segment, then writes it, then takes the next segment
+// Returns 1 if successful, 0 on an I/O error, -1 if io_uring cannot be used
+static int uring_copy(int in_fd,int out_fd,const fs_seg_t *segs,uint32_t count,int depth,int to_image) {
+	uring_t ring;
+	if (!uring_open(&ring,depth)) return -1;
+
+	slot_t *slots = calloc(depth,sizeof(slot_t));
+	int ok = slots != NULL;
+	for (int s = 0; ok && s < depth; s++) ok = (slots[s].buf = buffer_get()) != NULL;
+	if (!ok) {
+		for (int s = 0; slots && s < depth; s++) buffer_put(slots[s].buf);
+		free(slots);
+		uring_close(&ring);
+		return 0;
+	}
+
+	uint32_t next = 0,finished = 0;
+	int in_flight = 0;
+	while (in_flight > 0 || (ok && finished < count)) {
+		// Idle slots start reading the next segments
+		for (int s = 0; ok && s < depth && next < count; s++) {
+			if (slots[s].busy) continue;
+			slots[s].busy = 1;
+			slots[s].seg = next++;
+			slots[s].filled = slots[s].written = 0;
+			const fs_seg_t *seg = &segs[slots[s].seg];
+			uring_queue(&ring,0,in_fd,slots[s].buf,seg->in_length,seg->in_offset,s);
+			in_flight++;
+		}
+		if (!uring_submit(&ring)) {
+			// Nothing more can be waited for, so the buffers cannot be released safely
+			ok = 0;
+			break;
+		}
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail,__ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+			slot_t *slot = &slots[cqe->user_data & 0xFFFFFFFF];
+			int write = (cqe->user_data & TAG_WRITE) != 0;
+			const fs_seg_t *seg = &segs[slot->seg];
+			int res = cqe->res;
+			in_flight--;
+
+			// Failures and end of input stop new work, transfers already issued are drained
+			if (res <= 0 || !ok) {
+				if (res <= 0) ok = 0;
+				slot->busy = 0;
+				continue;
+			}
+			if (!write) {
+				fs_stats_io(FS_IO_READ,res,to_image ? -1 : seg->in_offset + slot->filled);
+				slot->filled += res;
+			} else {
+				fs_stats_io(FS_IO_WRITE,res,to_image ? seg->out_offset + slot->written : -1);
+				slot->written += res;
+			}
+
+			// Short transfers are resumed where they stopped, the padding is cleared before the first write
+			if (slot->filled < seg->in_length) {
+				uring_queue(&ring,0,in_fd,slot->buf + slot->filled,seg->in_length - slot->filled,
+					seg->in_offset + slot->filled,slot - slots);
+				in_flight++;
+			} else if (slot->written < seg->out_length) {
+				if (slot->written == 0 && seg->out_length > seg->in_length) {
+					memset(slot->buf + seg->in_length,0,seg->out_length - seg->in_length);
+				}
+				uring_queue(&ring,1,out_fd,slot->buf + slot->written,seg->out_length - slot->written,
+					seg->out_offset + slot->written,(slot - slots) | TAG_WRITE);
+				in_flight++;
+			} else {
+				slot->busy = 0;
+				finished++;
+			}
+		}
+		__atomic_store_n(ring.cq_head,head,__ATOMIC_RELEASE);
+	}
+
+	// A failed submit may leave transfers in flight, whose buffers are then left alone rather than reused
+	uring_close(&ring);
+	for (int s = 0; in_flight == 0 && s < depth; s++) buffer_put(slots[s].buf);
+	free(slots);
+	return ok && finished == count;
+}
+
+// Structure pool_copy_t, a copy shared by the fallback workers
+typedef struct {
+	int in_fd;
+	int out_fd;
+	const fs_seg_t *segs;
+	uint32_t count;
+	uint32_t next;
+	int failed;
+	int to_image;
+} pool_copy_t;
+
+// Function pool_worker, copies segments with pread and pwrite until none are left
+static void *pool_worker(void *arg) {
+	pool_copy_t *copy = arg;
+	char *buf = buffer_get();
+	if (!buf) {
+		__atomic_store_n(&copy->failed,1,__ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	for (;;) {
+		uint32_t i = __atomic_fetch_add(&copy->next,1,__ATOMIC_RELAXED);
+		if (i >= copy->count || __atomic_load_n(&copy->failed,__ATOMIC_RELAXED)) break;
+		const fs_seg_t *seg = &copy->segs[i];
+
+		int ok = 1;
+		for (size_t done = 0; ok && done < seg->in_length; ) {
+			ssize_t got = pread(copy->in_fd,buf + done,seg->in_length - done,seg->in_offset + done);
+			if (got < 0 && errno == EINTR) continue;
+			ok = got > 0;
+			if (ok) fs_stats_io(FS_IO_READ,got,copy->to_image ? -1 : seg->in_offset + done);
+			if (ok) done += got;
+		}
+		if (seg->out_length > seg->in_length) memset(buf + seg->in_length,0,seg->out_length - seg->in_length);
+		for (size_t done = 0; ok && done < seg->out_length; ) {
+			ssize_t put = pwrite(copy->out_fd,buf + done,seg->out_length - done,seg->out_offset + done);
+			if (put < 0 && errno == EINTR) continue;
+			ok = put > 0;
+			if (ok) fs_stats_io(FS_IO_WRITE,put,copy->to_image ? seg->out_offset + done : -1);
+			if (ok) done += put;
+		}
+		if (!ok) __atomic_store_n(&copy->failed,1,__ATOMIC_RELAXED);
+	}
+	buffer_put(buf);
+	return NULL;
+}
+
+// Function pool_copy, runs a copy on depth threads, each doing one transfer at a time
+// The calling thread is one of them
+// Returns 1 if successful, 0 otherwise
+static int pool_copy(int in_fd,int out_fd,const fs_seg_t *segs,uint32_t count,int depth,int to_image) {
+	pool_copy_t copy = { in_fd,out_fd,segs,count,0,0,to_image };
+	int workers = depth < MAX_WORKERS ? depth : MAX_WORKERS;
+	if ((uint32_t)workers > count) workers = count;
+
+	pthread_t threads[MAX_WORKERS];
+	int started = 0;
+	for (int i = 1; i < workers; i++) {
+		if (pthread_create(&threads[started],NULL,pool_worker,&copy) == 0) started++;
+	}
+	pool_worker(&copy);
+	for (int i = 0; i < started; i++) pthread_join(threads[i],NULL);
+	return !copy.failed;
+}
+
+// Function fs_aio_copy, copies a list of segments between two files with positional reads and writes
+// Keeps up to fs_aio_depth transfers in flight on an io_uring, or on a thread pool where
+// io_uring is unavailable
+// to_image is 1 when out_fd is the image and 0 when in_fd is, so only image transfers count as seeks
+// Returns 1 if successful, 0 otherwise
+int fs_aio_copy(int in_fd,int out_fd,const fs_seg_t *segs,uint32_t count,int to_image) {
+	if (count == 0) return 1;
+	int depth = fs_aio_depth;
+	if ((uint32_t)depth > count) depth = count;
+
+	if (fs_aio_mode != FS_AIO_THREADS) {
+		int ok = uring_copy(in_fd,out_fd,segs,count,depth,to_image);
+		if (ok >= 0) return ok;
+	}
+	return pool_copy(in_fd,out_fd,segs,count,depth,to_image);
+}
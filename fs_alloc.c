@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+
+// Function usable_blocks, returns the number of blocks that both exist and have a FAT entry
+static uint32_t usable_blocks(const fs_t *fs) {
+	return fs->super_block.block_count < fs->fat_entries ?
+		fs->super_block.block_count : fs->fat_entries;
+}
+
+// Function find_run, binary searches the live runs for the one at or before block
+// Returns the index of that run, or run_first - 1 if block is before every run
+static int64_t find_run(const fs_t *fs,uint32_t block) {
+	int64_t lo = fs->run_first,hi = (int64_t)fs->run_count - 1,found = (int64_t)fs->run_first - 1;
+	while (lo <= hi) {
+		int64_t mid = lo + (hi - lo)/2;
+		if (fs->free_runs[mid].start <= block) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+// Function insert_run, inserts a run at index i, growing the array if needed
+static int insert_run(fs_t *fs,uint32_t i,uint32_t start,uint32_t length) {
+	// Reclaims the exhausted slots at the front before growing
+	if (fs->run_first > 0) {
+		memmove(fs->free_runs,fs->free_runs + fs->run_first,
+				(fs->run_count - fs->run_first) * sizeof(fs_run_t));
+		fs->run_count -= fs->run_first;
+		i -= fs->run_first;
+		fs->run_first = 0;
+	}
+	if (fs->run_count == fs->run_capacity) {
+		uint32_t capacity = fs->run_capacity ? fs->run_capacity * 2 : 64;
+		fs_run_t *runs = realloc(fs->free_runs,capacity * sizeof(fs_run_t));
+		if (!runs) return 0;
+		fs->free_runs = runs;
+		fs->run_capacity = capacity;
+	}
+	memmove(fs->free_runs + i + 1,fs->free_runs + i,(fs->run_count - i) * sizeof(fs_run_t));
+	fs->free_runs[i].start = start;
+	fs->free_runs[i].length = length;
+	fs->run_count++;
+	return 1;
+}
+
+// Function remove_run, removes the run at index i
+// Removing the first live run is O(1), which is the common case for allocation
+static void remove_run(fs_t *fs,uint32_t i) {
+	if (i == fs->run_first) {
+		fs->run_first++;
+	} else {
+		memmove(fs->free_runs + i,fs->free_runs + i + 1,(fs->run_count - i - 1) * sizeof(fs_run_t));
+		fs->run_count--;
+	}
+	if (fs->run_first == fs->run_count) fs->run_first = fs->run_count = 0;
+	return;
+}
+
+// Function fs_free_init, builds the free-block bitmap and free-run index from the FAT
+// Called by fs_open for writable images, returns 1 if successful, 0 otherwise
+int fs_free_init(fs_t *fs) {
+	uint32_t blocks = usable_blocks(fs);
+
+	fs_free_destroy(fs);
+	fs->free_map = calloc((blocks + 63)/64 + 1,sizeof(uint64_t));
+	if (!fs->free_map) return 0;
+
+	// One pass over the FAT, setting bits and coalescing free runs
+	uint32_t run_start = 0,run_length = 0;
+	for (uint32_t b = 0; b < blocks; b++) {
+		if (fs->fat[b] == FAT_FREE) {
+			fs->free_map[b/64] |= (uint64_t)1 << (b % 64);
+			fs->free_blocks++;
+			if (run_length == 0) run_start = b;
+			run_length++;
+		} else if (run_length > 0) {
+			if (!insert_run(fs,fs->run_count,run_start,run_length)) return 0;
+			run_length = 0;
+		}
+	}
+	if (run_length > 0 && !insert_run(fs,fs->run_count,run_start,run_length)) return 0;
+
+	return 1;
+}
+
+// Function fs_free_destroy, frees the free-space index
+void fs_free_destroy(fs_t *fs) {
+	free(fs->free_map);
+	free(fs->free_runs);
+	fs->free_map = NULL;
+	fs->free_runs = NULL;
+	fs->run_first = fs->run_count = fs->run_capacity = 0;
+	fs->free_blocks = 0;
+	return;
+}
+
+// Function fs_is_free, returns 1 if the block is free, 0 otherwise
+int fs_is_free(const fs_t *fs,uint32_t block) {
+	if (!fs->free_map) return fs_next_block(fs,block) == FAT_FREE;
+	if (block >= usable_blocks(fs)) return 0;
+	return (fs->free_map[block/64] >> (block % 64)) & 1;
+}
+
+// Function fs_free_take, removes a block from the bitmap and run index
+void fs_free_take(fs_t *fs,uint32_t block) {
+	if (!fs->free_map || !fs_is_free(fs,block)) return;
+
+	fs->free_map[block/64] &= ~((uint64_t)1 << (block % 64));
+	fs->free_blocks--;
+
+	int64_t i = find_run(fs,block);
+	if (i < (int64_t)fs->run_first) return;
+	fs_run_t *run = &fs->free_runs[i];
+	uint32_t end = run->start + run->length;
+
+	// Shrinks the run from either end, or splits it in two
+	if (block == run->start) {
+		run->start++;
+		run->length--;
+		if (run->length == 0) remove_run(fs,i);
+	} else if (block == end - 1) {
+		run->length--;
+	} else {
+		run->length = block - run->start;
+		insert_run(fs,i + 1,block + 1,end - block - 1);
+	}
+	return;
+}
+
+// Function fs_free_release, returns a block to the bitmap and run index
+void fs_free_release(fs_t *fs,uint32_t block) {
+	if (!fs->free_map || block >= usable_blocks(fs) || fs_is_free(fs,block)) return;
+
+	fs->free_map[block/64] |= (uint64_t)1 << (block % 64);
+	fs->free_blocks++;
+
+	// Merges with the neighbouring runs where they touch
+	int64_t i = find_run(fs,block);
+	int joins_prev = i >= (int64_t)fs->run_first &&
+		fs->free_runs[i].start + fs->free_runs[i].length == block;
+	int joins_next = i + 1 < (int64_t)fs->run_count && fs->free_runs[i + 1].start == block + 1;
+
+	if (joins_prev && joins_next) {
+		fs->free_runs[i].length += 1 + fs->free_runs[i + 1].length;
+		remove_run(fs,i + 1);
+	} else if (joins_prev) {
+		fs->free_runs[i].length++;
+	} else if (joins_next) {
+		fs->free_runs[i + 1].start--;
+		fs->free_runs[i + 1].length++;
+	} else {
+		insert_run(fs,i + 1,block,1);
+	}
+	return;
+}
+
+// Function fs_alloc_block, allocates the lowest free block and marks it as the end of a chain
+// Returns the block number, or 0 if the image is full
+uint32_t fs_alloc_block(fs_t *fs) {
+	if (!fs->free_map || fs->run_first == fs->run_count) return 0;
+
+	// The lowest free block is always the start of the first live run
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	uint32_t block = fs->free_runs[fs->run_first].start;
+	int ok = fs_set_next(fs,block,FAT_EOF);
+	fs_timer_stop(FS_PHASE_ALLOC,&timer);
+	return ok ? block : 0;
+}
+
+// Function compare_length_desc, orders runs from longest to shortest, then by start
+static int compare_length_desc(const void *a,const void *b) {
+	const fs_run_t *x = a,*y = b;
+	if (x->length != y->length) return x->length < y->length ? 1 : -1;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Function compare_start, orders runs by starting block
+static int compare_start(const void *a,const void *b) {
+	const fs_run_t *x = a,*y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Function plan_extents, chooses which free runs a request of blocks_needed will use
+// Returns a malloc'd list sorted by start and sets count, or NULL on failure
+static fs_run_t *plan_extents(const fs_t *fs,uint32_t blocks_needed,uint32_t *count) {
+	uint32_t live = fs->run_count - fs->run_first;
+	const fs_run_t *runs = fs->free_runs + fs->run_first;
+
+	// Best fit, the smallest single run that holds the whole request
+	int64_t best = -1;
+	for (uint32_t i = 0; i < live; i++) {
+		if (runs[i].length >= blocks_needed &&
+				(best < 0 || runs[i].length < runs[best].length)) best = i;
+	}
+	if (best >= 0) {
+		fs_run_t *plan = malloc(sizeof(fs_run_t));
+		if (!plan) return NULL;
+		plan->start = runs[best].start;
+		plan->length = blocks_needed;
+		*count = 1;
+		return plan;
+	}
+
+	// Otherwise the largest runs are used first so the file is split as few times as possible
+	fs_run_t *sorted = malloc(live * sizeof(fs_run_t));
+	if (!sorted) return NULL;
+	memcpy(sorted,runs,live * sizeof(fs_run_t));
+	qsort(sorted,live,sizeof(fs_run_t),compare_length_desc);
+
+	uint32_t used = 0,remaining = blocks_needed;
+	while (used < live && remaining > sorted[used].length) {
+		remaining -= sorted[used].length;
+		used++;
+	}
+	if (used == live) {
+		free(sorted);
+		return NULL;
+	}
+
+	// The tail goes in the smallest remaining run that fits, which is still one run
+	uint32_t tail = used;
+	for (uint32_t i = used + 1; i < live && sorted[i].length >= remaining; i++) tail = i;
+	sorted[used].start = sorted[tail].start;
+	sorted[used].length = remaining;
+	used++;
+
+	qsort(sorted,used,sizeof(fs_run_t),compare_start);
+	*count = used;
+	return sorted;
+}
+
+// Function link_extents, chains the planned runs together in order
+static void link_extents(fs_t *fs,const fs_run_t *plan,uint32_t count) {
+	// Links each extent internally and to the start of the next one
+	for (uint32_t e = 0; e < count; e++) {
+		uint32_t last = plan[e].start + plan[e].length - 1;
+		for (uint32_t b = plan[e].start; b < last; b++) {
+			fs_set_next(fs,b,b + 1);
+		}
+		fs_set_next(fs,last,e + 1 < count ? plan[e + 1].start : FAT_EOF);
+	}
+	return;
+}
+
+// Function fs_alloc_chain, allocates blocks_needed blocks as the fewest, largest free runs
+// Uses the smallest single run that fits, otherwise the largest runs first
+// Links the blocks into one chain in ascending order, ending in FAT_EOF
+// If out_extents is given it receives a malloc'd list of the runs used, in chain order
+// Returns the first block of the chain, or 0 if there is not enough free space
+uint32_t fs_alloc_chain(fs_t *fs,uint32_t blocks_needed,fs_run_t **out_extents,uint32_t *out_count) {
+	if (!fs->free_map || blocks_needed == 0 || blocks_needed > fs->free_blocks) return 0;
+
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	uint32_t count = 0;
+	fs_run_t *plan = plan_extents(fs,blocks_needed,&count);
+	if (plan) link_extents(fs,plan,count);
+	fs_timer_stop(FS_PHASE_ALLOC,&timer);
+	if (!plan) return 0;
+
+	uint32_t first_block = plan[0].start;
+	if (out_extents) {
+		*out_extents = plan;
+		*out_count = count;
+	} else {
+		free(plan);
+	}
+	return first_block;
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CENSUS_X86 1
+#endif
+
+#include "fs.h"
+
+// Tables smaller than this are counted on the calling thread
+#define CENSUS_THREAD_MIN (1u << 22)
+#define CENSUS_MAX_THREADS 16
+
+// Signature shared by the scalar and SIMD kernels
+// Counts entries equal to zero and to the big-endian reserved pattern
+typedef void (*census_kernel_t)(const uint32_t *raw,size_t entries,uint64_t *zeros,uint64_t *ones);
+
+// Function census_scalar, the portable kernel
+static void census_scalar(const uint32_t *raw,size_t entries,uint64_t *zeros,uint64_t *ones) {
+	const uint32_t reserved = htonl(FAT_RESERVED);
+	uint64_t z = 0,o = 0;
+	for (size_t i = 0; i < entries; i++) {
+		z += raw[i] == FAT_FREE;
+		o += raw[i] == reserved;
+	}
+	*zeros = z;
+	*ones = o;
+	return;
+}
+
+#ifdef CENSUS_X86
+// Function census_sse2, compares four entries per step
+// Each compare yields -1 per matching lane, so subtracting it counts matches
+// Lane counters are drained to 64 bits well before they could wrap
+__attribute__((target("sse2")))
+static void census_sse2(const uint32_t *raw,size_t entries,uint64_t *zeros,uint64_t *ones) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i reserved = _mm_set1_epi32((int)htonl(FAT_RESERVED));
+	uint64_t z = 0,o = 0;
+	size_t i = 0;
+
+	while (i + 4 <= entries) {
+		__m128i zacc = _mm_setzero_si128(),oacc = _mm_setzero_si128();
+		size_t stop = entries - (entries - i) % 4;
+		if (stop - i > ((size_t)1 << 30)) stop = i + ((size_t)1 << 30);
+		for (; i < stop; i += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(raw + i));
+			zacc = _mm_sub_epi32(zacc,_mm_cmpeq_epi32(v,zero));
+			oacc = _mm_sub_epi32(oacc,_mm_cmpeq_epi32(v,reserved));
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i *)lanes,zacc);
+		z += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		_mm_storeu_si128((__m128i *)lanes,oacc);
+		o += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+
+	uint64_t tz,to;
+	census_scalar(raw + i,entries - i,&tz,&to);
+	*zeros = z + tz;
+	*ones = o + to;
+	return;
+}
+
+// Function census_avx2, compares eight entries per step
+__attribute__((target("avx2")))
+static void census_avx2(const uint32_t *raw,size_t entries,uint64_t *zeros,uint64_t *ones) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i reserved = _mm256_set1_epi32((int)htonl(FAT_RESERVED));
+	uint64_t z = 0,o = 0;
+	size_t i = 0;
+
+	while (i + 8 <= entries) {
+		__m256i zacc = _mm256_setzero_si256(),oacc = _mm256_setzero_si256();
+		size_t stop = entries - (entries - i) % 8;
+		if (stop - i > ((size_t)1 << 30)) stop = i + ((size_t)1 << 30);
+		for (; i < stop; i += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(raw + i));
+			zacc = _mm256_sub_epi32(zacc,_mm256_cmpeq_epi32(v,zero));
+			oacc = _mm256_sub_epi32(oacc,_mm256_cmpeq_epi32(v,reserved));
+		}
+		uint32_t lanes[8];
+		_mm256_storeu_si256((__m256i *)lanes,zacc);
+		for (int l = 0; l < 8; l++) z += lanes[l];
+		_mm256_storeu_si256((__m256i *)lanes,oacc);
+		for (int l = 0; l < 8; l++) o += lanes[l];
+	}
+
+	uint64_t tz,to;
+	census_scalar(raw + i,entries - i,&tz,&to);
+	*zeros = z + tz;
+	*ones = o + to;
+	return;
+}
+#endif
+
+// Function pick_kernel, chooses the widest kernel the running CPU supports
+static census_kernel_t pick_kernel(void) {
+#ifdef CENSUS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return census_avx2;
+	if (__builtin_cpu_supports("sse2")) return census_sse2;
+#endif
+	return census_scalar;
+}
+
+// Structure census_job_t, one thread's slice of the table
+typedef struct {
+	census_kernel_t kernel;
+	const uint32_t *raw;
+	size_t entries;
+	uint64_t zeros;
+	uint64_t ones;
+} census_job_t;
+
+// Function census_worker, runs the kernel over one slice
+static void *census_worker(void *arg) {
+	census_job_t *job = arg;
+	job->kernel(job->raw,job->entries,&job->zeros,&job->ones);
+	return NULL;
+}
+
+// Function fs_fat_census, counts free, reserved and allocated entries in an on-disk FAT
+// Compares against the big-endian patterns directly, using SSE2/AVX2 when the CPU has them
+// and splitting very large tables across threads
+void fs_fat_census(const uint32_t *raw,size_t entries,fs_census_t *out) {
+	census_kernel_t kernel = pick_kernel();
+	uint64_t zeros = 0,ones = 0;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = cpus > 0 ? (size_t)cpus : 1;
+	if (threads > CENSUS_MAX_THREADS) threads = CENSUS_MAX_THREADS;
+	if (threads > entries/CENSUS_THREAD_MIN) threads = entries/CENSUS_THREAD_MIN;
+
+	if (threads <= 1) {
+		kernel(raw,entries,&zeros,&ones);
+	} else {
+		census_job_t jobs[CENSUS_MAX_THREADS];
+		pthread_t tids[CENSUS_MAX_THREADS];
+		int running[CENSUS_MAX_THREADS];
+		size_t slice = entries/threads;
+
+		// Slices are contiguous, the last one takes the remainder
+		for (size_t t = 0; t < threads; t++) {
+			jobs[t].kernel = kernel;
+			jobs[t].raw = raw + t * slice;
+			jobs[t].entries = t + 1 == threads ? entries - t * slice : slice;
+			jobs[t].zeros = jobs[t].ones = 0;
+			running[t] = pthread_create(&tids[t],NULL,census_worker,&jobs[t]) == 0;
+
+			// Counts the slice here if a thread cannot be started
+			if (!running[t]) census_worker(&jobs[t]);
+		}
+		for (size_t t = 0; t < threads; t++) {
+			if (running[t]) pthread_join(tids[t],NULL);
+			zeros += jobs[t].zeros;
+			ones += jobs[t].ones;
+		}
+	}
+
+	out->free_blocks = zeros;
+	out->reserved_blocks = ones;
+	out->allocated_blocks = entries - zeros - ones;
+	return;
+}
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "fs.h"
+
+// Function fs_entry_name, copies an entry's name into a terminated string
+// Trailing spaces and padding are trimmed, out must hold 32 bytes
+void fs_entry_name(const dir_entry_t *entry,char *out) {
+	memcpy(out,entry->name,31);
+	out[31] = '\0';
+	for (int j = 30; j >= 0; j--) {
+		if (out[j] == '\0' || out[j] == ' ') out[j] = '\0';
+		else break;
+	}
+	return;
+}
+
+// Function hash_name, FNV-1a over a terminated name
+static uint32_t hash_name(const char *name) {
+	uint32_t hash = 2166136261u;
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Function index_insert, adds slot to the name index with linear probing
+// Entries that share a name probe in insertion order, so the earliest is found first
+static void index_insert(fs_dir_t *dir,uint32_t slot) {
+	char name[32];
+	fs_entry_name(&dir->entries[slot],name);
+	uint32_t mask = dir->index_size - 1;
+	uint32_t i = hash_name(name) & mask;
+	while (dir->index[i] != 0) i = (i + 1) & mask;
+	dir->index[i] = slot + 1;
+	dir->indexed++;
+	return;
+}
+
+// Function index_rebuild, sizes the index to at most half full and reinserts every used slot
+static int index_rebuild(fs_dir_t *dir,uint32_t expected) {
+	uint32_t size = 16;
+	while (size < expected * 2) size *= 2;
+	uint32_t *index = calloc(size,sizeof(uint32_t));
+	if (!index) return 0;
+
+	free(dir->index);
+	dir->index = index;
+	dir->index_size = size;
+	dir->indexed = 0;
+	for (uint32_t slot = 0; slot < dir->entry_count; slot++) {
+		if (dir->entries[slot].status != 0x00) index_insert(dir,slot);
+	}
+	return 1;
+}
+
+// Function dir_free, releases a loaded directory
+static void dir_free(fs_dir_t *dir) {
+	if (!dir) return;
+	free(dir->blocks);
+	free(dir->entries);
+	free(dir->index);
+	free(dir);
+	return;
+}
+
+// Function dir_load, reads a directory's whole chain and indexes its names
+// Runs of consecutive directory blocks are read with a single pread
+static fs_dir_t *dir_load(fs_t *fs,uint32_t start) {
+	uint32_t block_size = fs->super_block.block_size;
+	uint32_t per_block = block_size/sizeof(dir_entry_t);
+
+	fs_dir_t *dir = calloc(1,sizeof(fs_dir_t));
+	if (!dir) return NULL;
+	dir->start = start;
+
+	fs_run_t *runs;
+	uint32_t run_count = fs_chain_extents(fs,start,fs->fat_entries,&runs);
+	for (uint32_t r = 0; r < run_count; r++) dir->block_count += runs[r].length;
+
+	dir->blocks = malloc((dir->block_count + 1) * sizeof(uint32_t));
+	dir->entry_count = dir->block_count * per_block;
+	dir->entries = malloc((size_t)dir->block_count * block_size + 1);
+	if (!runs || !dir->blocks || !dir->entries) {
+		free(runs);
+		dir_free(dir);
+		return NULL;
+	}
+
+	// Pending stdio writes must reach the image before it is read by descriptor
+	fflush(fs->fp);
+	int fd = fileno(fs->fp);
+
+	fs_prefetch_t pf;
+	fs_prefetch_start(&pf,fs,fd,runs,run_count);
+
+	uint32_t loaded = 0;
+	for (uint32_t r = 0; r < run_count; r++) {
+		if (run_count > 1) fs_prefetch_at(&pf,r);
+		size_t len = (size_t)runs[r].length * block_size;
+		char *dest = (char *)dir->entries + (size_t)loaded * block_size;
+		off_t offset = fs_block_offset(fs,runs[r].start);
+		if (pread(fd,dest,len,offset) != (ssize_t)len) {
+			free(runs);
+			dir_free(dir);
+			return NULL;
+		}
+		fs_stats_io(FS_IO_READ,len,offset);
+		for (uint32_t b = 0; b < runs[r].length; b++) dir->blocks[loaded + b] = runs[r].start + b;
+		loaded += runs[r].length;
+	}
+	free(runs);
+
+	// Slots are dir_entry_t sized, any tail of a block that cannot hold one is skipped
+	if (block_size % sizeof(dir_entry_t) != 0) {
+		for (uint32_t b = 0; b < dir->block_count; b++) {
+			memmove(&dir->entries[b * per_block],(char *)dir->entries + (size_t)b * block_size,
+					per_block * sizeof(dir_entry_t));
+		}
+	}
+
+	uint32_t used = 0;
+	for (uint32_t slot = 0; slot < dir->entry_count; slot++) {
+		if (dir->entries[slot].status != 0x00) used++;
+	}
+	if (!index_rebuild(dir,used)) {
+		dir_free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+// Function fs_dir_get, returns the loaded directory starting at start, loading it on first use
+// Returns NULL on failure
+fs_dir_t *fs_dir_get(fs_t *fs,uint32_t start) {
+	// The cache is an open addressed table keyed by starting block
+	if (fs->dir_slots == 0 || (fs->dir_count + 1) * 2 > fs->dir_slots) {
+		uint32_t slots = fs->dir_slots ? fs->dir_slots * 2 : 64;
+		fs_dir_t **table = calloc(slots,sizeof(fs_dir_t *));
+		if (!table) return NULL;
+		for (uint32_t i = 0; i < fs->dir_slots; i++) {
+			fs_dir_t *dir = fs->dirs[i];
+			if (!dir) continue;
+			uint32_t j = (dir->start * 2654435761u) & (slots - 1);
+			while (table[j]) j = (j + 1) & (slots - 1);
+			table[j] = dir;
+		}
+		free(fs->dirs);
+		fs->dirs = table;
+		fs->dir_slots = slots;
+	}
+
+	uint32_t mask = fs->dir_slots - 1;
+	uint32_t i = (start * 2654435761u) & mask;
+	while (fs->dirs[i]) {
+		if (fs->dirs[i]->start == start) return fs->dirs[i];
+		i = (i + 1) & mask;
+	}
+
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	fs_dir_t *dir = dir_load(fs,start);
+	fs_timer_stop(FS_PHASE_DIR_LOAD,&timer);
+	if (!dir) return NULL;
+	fs->dirs[i] = dir;
+	fs->dir_count++;
+	return dir;
+}
+
+// Function fs_dir_lookup, finds the first entry called name whose status has any of the type bits
+// Returns 1 and copies the entry to out if found, 0 otherwise
+int fs_dir_lookup(fs_t *fs,uint32_t start,const char *name,uint8_t type,dir_entry_t *out) {
+	fs_dir_t *dir = fs_dir_get(fs,start);
+	if (!dir) return 0;
+
+	uint32_t mask = dir->index_size - 1;
+	for (uint32_t i = hash_name(name) & mask; dir->index[i] != 0; i = (i + 1) & mask) {
+		const dir_entry_t *entry = &dir->entries[dir->index[i] - 1];
+		FS_STAT_ADD(dir_entries_scanned,1);
+		char entry_name[32];
+		fs_entry_name(entry,entry_name);
+		if ((entry->status & type) && !strcmp(entry_name,name)) {
+			*out = *entry;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Function walk_dir, fs_walk for one directory at a given depth
+static int walk_dir(fs_t *fs,uint32_t start,const char *path,fs_walk_fn fn,void *arg,int depth) {
+	if (depth > FS_MAX_DEPTH) return 0;
+	fs_dir_t *dir = fs_dir_get(fs,start);
+	if (!dir) return 0;
+
+	int ok = 1;
+	size_t path_len = strlen(path);
+	char *child = malloc(path_len + 34);
+	if (!child) return 0;
+	FS_STAT_ADD(dir_entries_scanned,dir->entry_count);
+
+	// Slots are read by index, as loading a child directory may grow the cache but not this directory
+	for (uint32_t slot = 0; slot < dir->entry_count; slot++) {
+		dir_entry_t entry = dir->entries[slot];
+		if (entry.status == 0x00) continue;
+
+		char name[32];
+		fs_entry_name(&entry,name);
+		if (path_len > 0 && path[path_len - 1] == '/') sprintf(child,"%s%s",path,name);
+		else sprintf(child,"%s/%s",path,name);
+
+		int descend = fn(fs,child,&entry,arg);
+		if (descend && (entry.status & FS_ENTRY_DIR)) {
+			if (!walk_dir(fs,ntohl(entry.starting_block),child,fn,arg,depth + 1)) ok = 0;
+		}
+	}
+	free(child);
+	return ok;
+}
+
+// Function fs_walk, visits every entry below a directory, depth first in directory order
+// path is the image path of the directory, the callback gets each entry's full path
+// Returning 0 from the callback for a directory skips its contents
+// Returns 1 if every directory could be read, 0 otherwise
+int fs_walk(fs_t *fs,uint32_t start,const char *path,fs_walk_fn fn,void *arg) {
+	return walk_dir(fs,start,path,fn,arg,0);
+}
+
+// Function zero_block, clears a block on disk
+static int zero_block(fs_t *fs,uint32_t block) {
+	uint32_t block_size = fs->super_block.block_size;
+	char *zeros = calloc(1,block_size);
+	if (!zeros) return 0;
+	off_t offset = fs_block_offset(fs,block);
+	int ok = pwrite(fileno(fs->fp),zeros,block_size,offset) == (ssize_t)block_size;
+	fs_stats_io(FS_IO_WRITE,block_size,offset);
+	free(zeros);
+	return ok;
+}
+
+// Function fs_dir_create, allocates and clears a one block directory
+// Returns its starting block, or 0 if the image is full
+uint32_t fs_dir_create(fs_t *fs) {
+	uint32_t block = fs_alloc_block(fs);
+	if (block == 0) return 0;
+	fflush(fs->fp);
+	if (!zero_block(fs,block)) {
+		fs_set_next(fs,block,FAT_FREE);
+		return 0;
+	}
+	return block;
+}
+
+// Function dir_add, fs_dir_add without the timing
+static int dir_add(fs_t *fs,uint32_t start,const dir_entry_t *entry) {
+	fs_dir_t *dir = fs_dir_get(fs,start);
+	if (!dir) return 0;
+
+	uint32_t block_size = fs->super_block.block_size;
+	uint32_t per_block = block_size/sizeof(dir_entry_t);
+
+	uint32_t slot = dir->first_free;
+	while (slot < dir->entry_count && dir->entries[slot].status != 0x00) slot++;
+	FS_STAT_ADD(dir_entries_scanned,slot - dir->first_free + (slot < dir->entry_count));
+
+	if (slot == dir->entry_count) {
+		// Directory is full, so it is extended by one block
+		uint32_t new_block = fs_dir_create(fs);
+		if (new_block == 0) return 0;
+		fs_set_next(fs,dir->blocks[dir->block_count - 1],new_block);
+
+		uint32_t *blocks = realloc(dir->blocks,(dir->block_count + 1) * sizeof(uint32_t));
+		dir_entry_t *entries = realloc(dir->entries,(size_t)(dir->block_count + 1) * per_block * sizeof(dir_entry_t));
+		if (blocks) dir->blocks = blocks;
+		if (entries) dir->entries = entries;
+		if (!blocks || !entries) return 0;
+
+		dir->blocks[dir->block_count++] = new_block;
+		memset(&dir->entries[dir->entry_count],0,per_block * sizeof(dir_entry_t));
+		dir->entry_count += per_block;
+	}
+
+	off_t offset = fs_block_offset(fs,dir->blocks[slot/per_block]) +
+		(off_t)(slot % per_block) * sizeof(dir_entry_t);
+	fflush(fs->fp);
+	if (pwrite(fileno(fs->fp),entry,sizeof(*entry),offset) != sizeof(*entry)) return 0;
+	fs_stats_io(FS_IO_WRITE,sizeof(*entry),offset);
+
+	dir->entries[slot] = *entry;
+	dir->first_free = slot + 1;
+	if ((dir->indexed + 1) * 2 > dir->index_size) {
+		if (!index_rebuild(dir,dir->indexed + 1)) return 0;
+	} else {
+		index_insert(dir,slot);
+	}
+	return 1;
+}
+
+// Function fs_dir_add, stores an entry in the first unused slot of a directory
+// Extends the directory's chain by one block when it is full
+// Returns 1 if successful, 0 otherwise
+int fs_dir_add(fs_t *fs,uint32_t start,const dir_entry_t *entry) {
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	int ok = dir_add(fs,start,entry);
+	fs_timer_stop(FS_PHASE_DIR_UPDATE,&timer);
+	return ok;
+}
+
+// Function fs_dir_cache_destroy, frees every loaded directory
+void fs_dir_cache_destroy(fs_t *fs) {
+	for (uint32_t i = 0; i < fs->dir_slots; i++) dir_free(fs->dirs[i]);
+	free(fs->dirs);
+	fs->dirs = NULL;
+	fs->dir_slots = fs->dir_count = 0;
+	return;
+}
@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "fs.h"
+
+// Size of the userspace buffer used when the kernel cannot copy for us
+#define COPY_BUFFER_SIZE (1 << 20)
+
+// Each pwritev call carries up to WRITE_VECTORS buffers of COPY_BUFFER_SIZE bytes
+#define WRITE_VECTORS 8
+
+// Transfer methods, tried in order and dropped for the rest of the process once they fail
+// Shared by every copying thread, so it is only read and advanced atomically
+enum { COPY_RANGE, COPY_SENDFILE, COPY_BUFFER };
+static int copy_method = COPY_RANGE;
+
+// Function copy_buffered, moves len bytes from in_fd at offset to out_fd with pread/write
+// The caller's buffer is allocated on first use, so each copy, and each thread, has its own
+// Returns 1 if successful, 0 otherwise
+static int copy_buffered(int in_fd,off_t offset,size_t len,int out_fd,char **buffer) {
+	if (!*buffer && !(*buffer = malloc(COPY_BUFFER_SIZE))) return 0;
+	char *buf = *buffer;
+
+	while (len > 0) {
+		size_t chunk = len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE;
+		ssize_t got = pread(in_fd,buf,chunk,offset);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return 0;
+		fs_stats_io(FS_IO_READ,got,offset);
+
+		for (ssize_t done = 0; done < got; ) {
+			ssize_t put = write(out_fd,buf + done,got - done);
+			if (put < 0 && errno == EINTR) continue;
+			if (put <= 0) return 0;
+			fs_stats_io(FS_IO_WRITE,put,-1);
+			done += put;
+		}
+		offset += got;
+		len -= got;
+	}
+	return 1;
+}
+
+// Function copy_range, moves len bytes from in_fd at offset to the current position of out_fd
+// Starts with the fastest method known to work, falling back for this call when the descriptors do not allow it;
+// only a kernel without the call at all lowers the method for later copies
+// Returns 1 if successful, 0 otherwise, including when in_fd ends before len bytes
+static int copy_range(int in_fd,off_t offset,size_t len,int out_fd,char **buffer) {
+	int method = __atomic_load_n(&copy_method,__ATOMIC_RELAXED);
+	while (len > 0) {
+		ssize_t moved;
+		if (method == COPY_RANGE) {
+			loff_t in_off = offset;
+			moved = copy_file_range(in_fd,&in_off,out_fd,NULL,len,0);
+		} else if (method == COPY_SENDFILE) {
+			off_t in_off = offset;
+			moved = sendfile(out_fd,in_fd,&in_off,len);
+		} else {
+			return copy_buffered(in_fd,offset,len,out_fd,buffer);
+		}
+
+		if (moved < 0 && errno == EINTR) continue;
+		if (moved == 0) {
+			// The chain runs past the end of the image
+			errno = EIO;
+			return 0;
+		}
+		if (moved < 0) {
+			// Nothing has been written for this chunk, so it is simply retried with the next method
+			if (errno == ENOSYS || errno == EOPNOTSUPP || errno == ENOTSUP) {
+				int expected = method;
+				__atomic_compare_exchange_n(&copy_method,&expected,method + 1,0,
+						__ATOMIC_RELAXED,__ATOMIC_RELAXED);
+				method++;
+				continue;
+			}
+			if (errno == EXDEV || errno == EINVAL || errno == EBADF) {
+				method++;
+				continue;
+			}
+			return 0;
+		}
+		fs_stats_io(FS_IO_COPY,moved,offset);
+		offset += moved;
+		len -= moved;
+	}
+	return 1;
+}
+
+// Segments a direct copy runs between dropping the host file's cached pages
+#define DIRECT_WINDOW 64
+
+// Function use_direct, returns 1 if file data can go through the image's O_DIRECT descriptor
+// Every block must start on the alignment the file system asks for
+static int use_direct(const fs_t *fs) {
+	return fs->direct_align && fs->super_block.block_size % fs->direct_align == 0;
+}
+
+// Function async_target, returns 1 if copying size bytes to or from a host file should use fs_aio_copy
+// Large copies do for the queue depth, every copy does in direct mode
+// Only regular files without O_APPEND take positional writes in any order
+static int async_target(const fs_t *fs,int fd,uint64_t size) {
+	if (!use_direct(fs) && (fs_aio_depth <= 1 || size < 2 * (uint64_t)FS_AIO_SEGMENT)) return 0;
+	struct stat st;
+	int flags = fcntl(fd,F_GETFL);
+	return flags >= 0 && !(flags & O_APPEND) && fstat(fd,&st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Function drop_host_pages, writes back and evicts a range of the host file from the page cache
+static void drop_host_pages(int fd,off_t offset,off_t len,int written) {
+	if (written) {
+		sync_file_range(fd,offset,len,SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+	}
+	posix_fadvise(fd,offset,len,POSIX_FADV_DONTNEED);
+	return;
+}
+
+// Function copy_async, moves size bytes between the runs of a chain and a host file with fs_aio_copy
+// to_image picks the direction, the host file is used from its current position, which ends up past the data
+// In direct mode the image side moves whole blocks through the O_DIRECT descriptor, and the host file's
+// pages are dropped as each window of segments completes, so neither side stays in the page cache
+// Returns 1 if successful, 0 otherwise
+static int copy_async(fs_t *fs,const fs_run_t *runs,uint32_t count,uint64_t size,int host_fd,int to_image) {
+	off_t base = lseek(host_fd,0,SEEK_CUR);
+	if (base < 0) return 0;
+
+	// Segments end on block boundaries, so a padded tail never reaches past the file's last block
+	uint32_t block_size = fs->super_block.block_size;
+	size_t seg_size = FS_AIO_SEGMENT/block_size * block_size;
+	fs_seg_t *segs = malloc((size/seg_size + count + 1) * sizeof(fs_seg_t));
+	if (!segs) return 0;
+	int direct = use_direct(fs);
+
+	// Runs are cut into segments, so the transfers in flight spread over the whole file
+	uint32_t seg_count = 0;
+	uint64_t done = 0;
+	for (uint32_t r = 0; r < count && done < size; r++) {
+		uint64_t run_bytes = (uint64_t)runs[r].length * block_size;
+		if (run_bytes > size - done) run_bytes = size - done;
+		off_t image = fs_block_offset(fs,runs[r].start);
+		for (uint64_t pos = 0; pos < run_bytes; pos += seg_size) {
+			fs_seg_t *seg = &segs[seg_count++];
+			size_t len = run_bytes - pos < seg_size ? run_bytes - pos : seg_size;
+			size_t padded = direct ? (len + block_size - 1)/block_size * block_size : len;
+			off_t host = base + done + pos;
+			seg->in_offset = to_image ? host : image + (off_t)pos;
+			seg->out_offset = to_image ? image + (off_t)pos : host;
+			seg->in_length = to_image ? len : padded;
+			seg->out_length = to_image ? padded : len;
+		}
+		done += run_bytes;
+	}
+
+	int image_fd = direct ? fs->direct_fd : fileno(fs->fp);
+	int in_fd = to_image ? host_fd : image_fd,out_fd = to_image ? image_fd : host_fd;
+	int ok = done == size;
+	uint32_t window = direct ? DIRECT_WINDOW : seg_count;
+	for (uint32_t first = 0; ok && first < seg_count; first += window) {
+		uint32_t n = seg_count - first < window ? seg_count - first : window;
+		ok = fs_aio_copy(in_fd,out_fd,segs + first,n,to_image);
+		if (direct) {
+			off_t start = to_image ? segs[first].in_offset : segs[first].out_offset;
+			const fs_seg_t *last = &segs[first + n - 1];
+			off_t end = to_image ? last->in_offset + (off_t)last->in_length : last->out_offset + (off_t)last->out_length;
+			drop_host_pages(host_fd,start,end - start,!to_image);
+		}
+	}
+	free(segs);
+	if (ok && lseek(host_fd,base + size,SEEK_SET) < 0) ok = 0;
+	return ok;
+}
+
+// Function copy_runs, copies the first size bytes held by a list of runs to out_fd
+// Neither the FAT nor the stdio stream is touched, only positional reads of the image
+static int copy_runs(fs_t *fs,const fs_run_t *runs,uint32_t count,uint64_t size,int out_fd) {
+	uint32_t block_size = fs->super_block.block_size;
+	int in_fd = fileno(fs->fp);
+	char *buffer = NULL;
+
+	// Large copies to a regular file keep several transfers in flight
+	if (async_target(fs,out_fd,size)) return copy_async(fs,runs,count,size,out_fd,0);
+
+	// A fragmented chain is requested ahead of the copy, run by run
+	fs_prefetch_t pf;
+	fs_prefetch_start(&pf,fs,in_fd,runs,count);
+
+	uint64_t remaining = size;
+	int ok = 1;
+	for (uint32_t r = 0; r < count && remaining > 0 && ok; r++) {
+		if (count > 1) fs_prefetch_at(&pf,r);
+		uint64_t run_bytes = (uint64_t)runs[r].length * block_size;
+		size_t len = remaining < run_bytes ? remaining : run_bytes;
+		ok = copy_range(in_fd,fs_block_offset(fs,runs[r].start),len,out_fd,&buffer);
+		remaining -= len;
+	}
+	free(buffer);
+
+	// A chain shorter than the recorded size is treated as a failure
+	return ok && remaining == 0;
+}
+
+// Function fs_chain_runs, lays out the runs holding the first size bytes of a chain, for fs_copy_runs_to_fd
+// Also flushes pending stdio writes, so the runs can then be read while the FAT changes
+// Returns the number of runs, setting runs to a malloc'd array (NULL when size is 0)
+uint32_t fs_chain_runs(fs_t *fs,uint32_t start,uint64_t size,fs_run_t **runs) {
+	uint32_t block_size = fs->super_block.block_size;
+	uint64_t blocks = (size + block_size - 1)/block_size;
+	*runs = NULL;
+	if (blocks == 0) return 0;
+
+	// Pending stdio writes must reach the image before it is read by descriptor
+	if (fs->writable) fflush(fs->fp);
+	return fs_chain_extents(fs,start,blocks,runs);
+}
+
+// Function fs_copy_runs_to_fd, copies the first size bytes held by runs to out_fd
+// Returns 1 if successful, 0 otherwise
+int fs_copy_runs_to_fd(fs_t *fs,const fs_run_t *runs,uint32_t count,uint64_t size,int out_fd) {
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	int ok = size == 0 || copy_runs(fs,runs,count,size,out_fd);
+	fs_timer_stop(FS_PHASE_DATA,&timer);
+	return ok;
+}
+
+// Function copy_chain, fs_copy_to_fd without the timing
+static int copy_chain(fs_t *fs,uint32_t start,uint64_t size,int out_fd) {
+	if (size == 0) return 1;
+	fs_run_t *runs;
+	uint32_t count = fs_chain_runs(fs,start,size,&runs);
+	int ok = copy_runs(fs,runs,count,size,out_fd);
+	free(runs);
+	return ok;
+}
+
+// Function fs_read_chain, reads every block of a chain into one buffer, one pread per run with readahead
+// Only positional reads touch the image, so threads may read different chains of one fs_t at once
+// Sets out_blocks to the number of blocks read and returns a malloc'd buffer, or NULL on failure
+char *fs_read_chain(fs_t *fs,uint32_t start,uint32_t *out_blocks) {
+	uint32_t block_size = fs->super_block.block_size;
+	fs_run_t *runs;
+	uint32_t count = fs_chain_extents(fs,start,fs->fat_entries,&runs);
+	uint64_t blocks = 0;
+	for (uint32_t r = 0; r < count; r++) blocks += runs[r].length;
+
+	char *data = runs ? malloc(blocks * block_size + 1) : NULL;
+	int fd = fileno(fs->fp);
+	fs_prefetch_t pf;
+	fs_prefetch_start(&pf,fs,fd,runs,count);
+
+	uint64_t loaded = 0;
+	for (uint32_t r = 0; data && r < count; r++) {
+		if (count > 1) fs_prefetch_at(&pf,r);
+		size_t len = (size_t)runs[r].length * block_size;
+		off_t offset = fs_block_offset(fs,runs[r].start);
+		if (pread(fd,data + loaded * block_size,len,offset) != (ssize_t)len) {
+			free(data);
+			data = NULL;
+			break;
+		}
+		fs_stats_io(FS_IO_READ,len,offset);
+		loaded += runs[r].length;
+	}
+	free(runs);
+	*out_blocks = loaded;
+	return data;
+}
+
+// Function fs_copy_to_fd, copies the first size bytes of a chain to out_fd
+// Each run of consecutive blocks moves as one transfer, using copy_file_range or sendfile
+// when the kernel supports it and large pread/write buffers otherwise
+// Only positional reads touch the image, so several threads may copy from one fs_t at once
+// Returns 1 if successful, 0 otherwise
+int fs_copy_to_fd(fs_t *fs,uint32_t start,uint64_t size,int out_fd) {
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	int ok = copy_chain(fs,start,size,out_fd);
+	fs_timer_stop(FS_PHASE_DATA,&timer);
+	return ok;
+}
+
+// 64-bit FNV-1a parameters
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+// Function fnv_update, folds len bytes into a running FNV-1a hash
+static uint64_t fnv_update(uint64_t hash,const char *data,size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+// Function read_full, reads up to len bytes from fd, retrying short reads
+// Returns the number of bytes read, which is less than len only at end of input, or -1 on error
+static ssize_t read_full(int fd,char *buf,size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t got = read(fd,buf + done,len - done);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) return -1;
+		if (got == 0) break;
+		fs_stats_io(FS_IO_READ,got,-1);
+		done += got;
+	}
+	return done;
+}
+
+// Function pwritev_full, writes every byte described by iov at offset, advancing through short writes
+// Returns 1 if successful, 0 otherwise
+static int pwritev_full(int fd,struct iovec *iov,int iov_count,off_t offset) {
+	while (iov_count > 0) {
+		ssize_t put = pwritev(fd,iov,iov_count,offset);
+		if (put < 0 && errno == EINTR) continue;
+		if (put <= 0) return 0;
+		fs_stats_io(FS_IO_WRITE,put,offset);
+		offset += put;
+
+		// Skips the vectors that were written in full and trims the next one
+		while (iov_count > 0 && (size_t)put >= iov->iov_len) {
+			put -= iov->iov_len;
+			iov++;
+			iov_count--;
+		}
+		if (iov_count > 0) {
+			iov->iov_base = (char *)iov->iov_base + put;
+			iov->iov_len -= put;
+		}
+	}
+	return 1;
+}
+
+// Function fs_write_extents, streams size bytes from src_fd into a list of destination runs
+// The source is read in large chunks and each run is written with pwritev
+// If hash is given it receives the 64-bit FNV-1a hash of the data written
+// Only positional writes touch the image, so threads may fill different extents at once
+// Returns 1 if successful, 0 otherwise
+int fs_write_extents(fs_t *fs,const fs_run_t *extents,uint32_t count,int src_fd,uint64_t size,
+		uint64_t *hash) {
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+
+	// Large regular files keep several transfers in flight, the hash needs the data in order
+	if (!hash && async_target(fs,src_fd,size)) {
+		int ok = copy_async(fs,extents,count,size,src_fd,1);
+		fs_timer_stop(FS_PHASE_DATA,&timer);
+		return ok;
+	}
+
+	uint32_t block_size = fs->super_block.block_size;
+	char *buf = malloc((size_t)WRITE_VECTORS * COPY_BUFFER_SIZE);
+	if (!buf) {
+		fs_timer_stop(FS_PHASE_DATA,&timer);
+		return 0;
+	}
+	int out_fd = fileno(fs->fp);
+
+	uint64_t remaining = size;
+	uint64_t fnv = FNV_OFFSET;
+	int ok = 1;
+	for (uint32_t e = 0; e < count && remaining > 0 && ok; e++) {
+		uint64_t run_bytes = (uint64_t)extents[e].length * block_size;
+		uint64_t left = remaining < run_bytes ? remaining : run_bytes;
+		off_t offset = fs_block_offset(fs,extents[e].start);
+
+		// Fills up to WRITE_VECTORS buffers from the source, then writes them in one call
+		while (left > 0 && ok) {
+			struct iovec iov[WRITE_VECTORS];
+			int iov_count = 0;
+			uint64_t batch = 0;
+			while (iov_count < WRITE_VECTORS && batch < left) {
+				size_t want = left - batch < COPY_BUFFER_SIZE ? left - batch : COPY_BUFFER_SIZE;
+				char *chunk = buf + (size_t)iov_count * COPY_BUFFER_SIZE;
+				ssize_t got = read_full(src_fd,chunk,want);
+				if (got < (ssize_t)want) {
+					ok = 0;
+					break;
+				}
+				if (hash) fnv = fnv_update(fnv,chunk,got);
+				iov[iov_count].iov_base = chunk;
+				iov[iov_count].iov_len = got;
+				iov_count++;
+				batch += got;
+			}
+			if (!ok) break;
+
+			ok = pwritev_full(out_fd,iov,iov_count,offset);
+			offset += batch;
+			left -= batch;
+			remaining -= batch;
+		}
+	}
+	free(buf);
+	fs_timer_stop(FS_PHASE_DATA,&timer);
+
+	if (hash) *hash = fnv;
+	return ok && remaining == 0;
+}
+
+// Function free_chain, returns every block of a chain to the free pool
+static void free_chain(fs_t *fs,uint32_t start) {
+	for (uint32_t b = start, walked = 0; b != 0 && b != FAT_EOF && walked < fs->fat_entries; walked++) {
+		uint32_t next = fs_next_block(fs,b);
+		fs_set_next(fs,b,FAT_FREE);
+		b = next;
+	}
+	return;
+}
+
+// Function grow_chain, adds blocks to the end of a chain, or starts one if last is 0
+// Takes the free blocks straight after last first, then the fewest runs that hold the rest
+// Sets runs to the malloc'd runs added, in chain order, and last to the new end of the chain
+// Returns the number of runs, or 0 if there is not enough space
+static uint32_t grow_chain(fs_t *fs,uint32_t *first,uint32_t *last,uint32_t blocks,fs_run_t **runs) {
+	uint32_t in_place = 0;
+	if (*last) {
+		while (in_place < blocks && fs_is_free(fs,*last + 1 + in_place)) in_place++;
+	}
+
+	// The blocks after last are linked first, so the allocator below cannot hand them out again
+	uint32_t old_last = *last;
+	for (uint32_t b = old_last; b < old_last + in_place; b++) fs_set_next(fs,b,b + 1);
+	if (in_place > 0) fs_set_next(fs,old_last + in_place,FAT_EOF);
+
+	fs_run_t *rest = NULL;
+	uint32_t rest_count = 0,rest_start = 0;
+	fs_run_t *added = NULL;
+	if (in_place < blocks) rest_start = fs_alloc_chain(fs,blocks - in_place,&rest,&rest_count);
+	if (in_place == blocks || rest_start) added = malloc((rest_count + 1) * sizeof(fs_run_t));
+	if (!added) {
+		// Gives back whatever this call took, leaving the chain as it was
+		if (rest_start) free_chain(fs,rest_start);
+		free(rest);
+		for (uint32_t b = old_last + 1; b <= old_last + in_place; b++) fs_set_next(fs,b,FAT_FREE);
+		if (in_place > 0) fs_set_next(fs,old_last,FAT_EOF);
+		return 0;
+	}
+
+	uint32_t count = 0;
+	if (in_place > 0) {
+		added[count].start = old_last + 1;
+		added[count].length = in_place;
+		count++;
+		*last += in_place;
+	}
+	if (rest_start) {
+		if (*last) fs_set_next(fs,*last,rest_start);
+		else *first = rest_start;
+		memcpy(added + count,rest,rest_count * sizeof(fs_run_t));
+		count += rest_count;
+		*last = rest[rest_count - 1].start + rest[rest_count - 1].length - 1;
+	}
+	free(rest);
+	*runs = added;
+	return count;
+}
+
+// Function fs_write_stream, copies src_fd to a new chain until end of input, for sources of unknown length
+// The chain grows as data arrives, into the blocks right after its end while they are free
+// Sets out_start to the first block, 0 for empty input, and out_size to the bytes written
+// On failure every block it allocated is freed again
+// Returns 1 if successful, 0 otherwise
+int fs_write_stream(fs_t *fs,int src_fd,uint32_t *out_start,uint64_t *out_size,uint64_t *hash) {
+	uint32_t block_size = fs->super_block.block_size;
+	// Every batch but the last fills whole blocks, so the next one starts on a block boundary
+	size_t batch = (size_t)WRITE_VECTORS * COPY_BUFFER_SIZE/block_size * block_size;
+	char *buf = malloc(batch);
+	if (!buf) return 0;
+
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	int out_fd = fileno(fs->fp);
+	uint32_t first = 0,last = 0;
+	uint64_t size = 0,fnv = FNV_OFFSET;
+	int ok = 1;
+	while (ok) {
+		ssize_t got = read_full(src_fd,buf,batch);
+		if (got <= 0) {
+			ok = got == 0;
+			break;
+		}
+
+		// Sizes are stored in 32 bits
+		if (size + got > UINT32_MAX) {
+			errno = EFBIG;
+			ok = 0;
+			break;
+		}
+		if (hash) fnv = fnv_update(fnv,buf,got);
+
+		fs_run_t *runs;
+		uint32_t count = grow_chain(fs,&first,&last,(got + block_size - 1)/block_size,&runs);
+		if (count == 0) {
+			errno = ENOSPC;
+			ok = 0;
+			break;
+		}
+
+		size_t done = 0;
+		for (uint32_t r = 0; r < count && ok; r++) {
+			size_t len = (size_t)runs[r].length * block_size;
+			if (len > got - done) len = got - done;
+			struct iovec iov = { buf + done,len };
+			ok = pwritev_full(out_fd,&iov,1,fs_block_offset(fs,runs[r].start));
+			done += len;
+		}
+		free(runs);
+		size += got;
+		if ((size_t)got < batch) break;
+	}
+	free(buf);
+	fs_timer_stop(FS_PHASE_DATA,&timer);
+
+	if (!ok) {
+		if (first) free_chain(fs,first);
+		return 0;
+	}
+	*out_start = first;
+	*out_size = size;
+	if (hash) *hash = fnv;
+	return 1;
+}
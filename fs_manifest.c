@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "fs.h"
+
+// Function fs_manifest_read, reads source and destination pairs from a manifest, or stdin when path is "-"
+// Each line holds a source and a destination separated by whitespace
+// Blank lines and lines starting with # are skipped
+// Returns the number of pairs and sets out to a malloc'd array, or -1 on failure
+long fs_manifest_read(const char *path,fs_pair_t **out) {
+	FILE *in = strcmp(path,"-") ? fopen(path,"r") : stdin;
+	if (!in) return -1;
+
+	long count = 0,capacity = 64;
+	fs_pair_t *pairs = malloc(capacity * sizeof(fs_pair_t));
+	char *line = NULL;
+	size_t line_size = 0;
+	long line_no = 0;
+	ssize_t len;
+
+	while (pairs && (len = getline(&line,&line_size,in)) >= 0) {
+		line_no++;
+		while (len > 0 && isspace((unsigned char)line[len - 1])) line[--len] = '\0';
+
+		char *source = line;
+		while (isspace((unsigned char)*source)) source++;
+		if (*source == '\0' || *source == '#') continue;
+
+		// The destination is everything after the first run of whitespace
+		char *dest = source;
+		while (*dest && !isspace((unsigned char)*dest)) dest++;
+		if (*dest) *dest++ = '\0';
+		while (isspace((unsigned char)*dest)) dest++;
+		if (*dest == '\0') {
+			fprintf(stderr,"Manifest line %ld has no destination\n",line_no);
+			continue;
+		}
+
+		if (count == capacity) {
+			capacity *= 2;
+			fs_pair_t *grown = realloc(pairs,capacity * sizeof(fs_pair_t));
+			if (!grown) break;
+			pairs = grown;
+		}
+		pairs[count].source = strdup(source);
+		pairs[count].dest = strdup(dest);
+		count++;
+	}
+
+	free(line);
+	if (in != stdin) fclose(in);
+	if (!pairs) return -1;
+
+	*out = pairs;
+	return count;
+}
+
+// Function fs_manifest_free, frees the pairs returned by fs_manifest_read
+void fs_manifest_free(fs_pair_t *pairs,long count) {
+	for (long i = 0; i < count; i++) {
+		free(pairs[i].source);
+		free(pairs[i].dest);
+	}
+	free(pairs);
+	return;
+}
+
+// Function fs_split_path, splits an image path into its directory and final name
+// Sets dir to a malloc'd copy of the directory ("/" for the root) and name to point into it
+// Returns 1 if successful, 0 otherwise
+int fs_split_path(const char *path,char **dir,char **name) {
+	const char *slash = strrchr(path,'/');
+	const char *base = slash ? slash + 1 : path;
+	size_t dir_len = slash ? (size_t)(slash - path) : 0;
+
+	// Keeps the directory and name in one allocation, "dir\0name\0"
+	char *copy = malloc(dir_len + strlen(base) + 3);
+	if (!copy) return 0;
+	if (dir_len == 0) {
+		strcpy(copy,"/");
+		dir_len = 1;
+	} else {
+		memcpy(copy,path,dir_len);
+		copy[dir_len] = '\0';
+	}
+	*name = copy + dir_len + 1;
+	strcpy(*name,base);
+	*dir = copy;
+	return 1;
+}
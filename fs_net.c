@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "fs.h"
+
+// Size of the buffer used by fs_relay
+#define RELAY_BUFFER_SIZE (1 << 20)
+
+// Function fs_connect, connects to an image server if path names a Unix socket
+// Returns the connected descriptor, or -1 if path is not a socket or nothing is listening
+int fs_connect(const char *path) {
+	struct stat st;
+	if (stat(path,&st) != 0 || !S_ISSOCK(st.st_mode)) return -1;
+
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+	strcpy(addr.sun_path,path);
+
+	int fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if (fd < 0) return -1;
+	if (connect(fd,(struct sockaddr *)&addr,sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Function fs_send_all, writes len bytes to fd, retrying short writes
+// Returns 1 if successful, 0 otherwise
+int fs_send_all(int fd,const void *buf,size_t len) {
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t put = write(fd,p,len);
+		if (put < 0 && errno == EINTR) continue;
+		if (put <= 0) return 0;
+		fs_stats_io(FS_IO_WRITE,put,-1);
+		p += put;
+		len -= put;
+	}
+	return 1;
+}
+
+// Function fs_recv_all, reads exactly len bytes from fd
+// Returns 1 if successful, 0 on error or if the peer closes first
+int fs_recv_all(int fd,void *buf,size_t len) {
+	char *p = buf;
+	while (len > 0) {
+		ssize_t got = read(fd,p,len);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return 0;
+		fs_stats_io(FS_IO_READ,got,-1);
+		p += got;
+		len -= got;
+	}
+	return 1;
+}
+
+// Function fs_send_msg, writes a message header followed by path, which may be NULL
+// Returns 1 if successful, 0 otherwise
+int fs_send_msg(int fd,uint32_t op,uint32_t status,const char *path,uint64_t length) {
+	size_t path_length = path ? strlen(path) : 0;
+	if (path_length > FS_PATH_MAX) return 0;
+
+	// Header and path go out in one write
+	char buf[sizeof(fs_msg_t) + FS_PATH_MAX];
+	fs_msg_t msg;
+	msg.magic = htobe32(FS_MSG_MAGIC);
+	msg.op = htobe32(op);
+	msg.status = htobe32(status);
+	msg.path_length = htobe32(path_length);
+	msg.length = htobe64(length);
+	memcpy(buf,&msg,sizeof(msg));
+	if (path_length) memcpy(buf + sizeof(msg),path,path_length);
+	return fs_send_all(fd,buf,sizeof(msg) + path_length);
+}
+
+// Function fs_recv_msg, reads a message header and converts it to host order
+// Returns 1 if a valid header was read, 0 otherwise
+int fs_recv_msg(int fd,fs_msg_t *msg) {
+	if (!fs_recv_all(fd,msg,sizeof(fs_msg_t))) return 0;
+	msg->magic = be32toh(msg->magic);
+	msg->op = be32toh(msg->op);
+	msg->status = be32toh(msg->status);
+	msg->path_length = be32toh(msg->path_length);
+	msg->length = be64toh(msg->length);
+	return msg->magic == FS_MSG_MAGIC && msg->path_length <= FS_PATH_MAX;
+}
+
+// Function fs_relay, copies len bytes from in_fd to out_fd through a buffer
+// Used for data that travels over the server socket, an out_fd of -1 discards it
+// Returns 1 if successful, 0 otherwise
+int fs_relay(int in_fd,int out_fd,uint64_t len) {
+	if (len == 0) return 1;
+	char *buf = malloc(len < RELAY_BUFFER_SIZE ? len : RELAY_BUFFER_SIZE);
+	if (!buf) return 0;
+
+	int ok = 1;
+	while (len > 0 && ok) {
+		size_t chunk = len < RELAY_BUFFER_SIZE ? len : RELAY_BUFFER_SIZE;
+		ssize_t got = read(in_fd,buf,chunk);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) ok = 0;
+		else {
+			fs_stats_io(FS_IO_READ,got,-1);
+			ok = out_fd < 0 || fs_send_all(out_fd,buf,got);
+			len -= got;
+		}
+	}
+	free(buf);
+	return ok;
+}
+
+// Function fs_status_message, returns a description of a reply status
+const char *fs_status_message(uint32_t status) {
+	switch (status) {
+	case FS_STATUS_OK: return "OK";
+	case FS_STATUS_NOT_FOUND: return "Not found";
+	case FS_STATUS_NO_SPACE: return "No free blocks available";
+	case FS_STATUS_IO: return "Image I/O failed";
+	case FS_STATUS_BAD_REQUEST: return "Bad request";
+	case FS_STATUS_READ_ONLY: return "Image is read-only";
+	default: return "Unknown status";
+	}
+}
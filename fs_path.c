@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "fs.h"
+
+// Function fs_fill_timestamp, stores the current local time as the entry's creation time
+void fs_fill_timestamp(dir_entry_t *entry) {
+	time_t now = time(NULL);
+	struct tm *tm_now = localtime(&now);
+
+	uint16_t year = tm_now->tm_year + 1900;
+	entry->created[0] = (year >> 8) & 0xFF;
+	entry->created[1] = year & 0xFF;
+	entry->created[2] = tm_now->tm_mon + 1;
+	entry->created[3] = tm_now->tm_mday;
+	entry->created[4] = tm_now->tm_hour;
+	entry->created[5] = tm_now->tm_min;
+	entry->created[6] = tm_now->tm_sec;
+
+	return;
+}
+
+// Function hash_prefix, FNV-1a over the first len bytes of a path
+static uint32_t hash_prefix(const char *path,size_t len) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Function cache_find, looks up the directory cached for the first len bytes of path
+// Returns 1 and sets start and blocks if cached, 0 otherwise
+static int cache_find(const fs_t *fs,const char *path,size_t len,uint32_t *start,uint32_t *blocks) {
+	if (fs->path_slots == 0) return 0;
+	uint32_t mask = fs->path_slots - 1;
+	for (uint32_t i = hash_prefix(path,len) & mask; fs->paths[i].path; i = (i + 1) & mask) {
+		const fs_path_t *cached = &fs->paths[i];
+		if (strlen(cached->path) == len && !memcmp(cached->path,path,len)) {
+			*start = cached->start;
+			*blocks = cached->blocks;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Function cache_insert, remembers the directory found for the first len bytes of path
+static void cache_insert(fs_t *fs,const char *path,size_t len,uint32_t start,uint32_t blocks) {
+	// Grows the table so it stays at most half full
+	if ((fs->path_count + 1) * 2 > fs->path_slots) {
+		uint32_t slots = fs->path_slots ? fs->path_slots * 2 : 64;
+		fs_path_t *table = calloc(slots,sizeof(fs_path_t));
+		if (!table) return;
+		for (uint32_t i = 0; i < fs->path_slots; i++) {
+			fs_path_t *cached = &fs->paths[i];
+			if (!cached->path) continue;
+			uint32_t j = hash_prefix(cached->path,strlen(cached->path)) & (slots - 1);
+			while (table[j].path) j = (j + 1) & (slots - 1);
+			table[j] = *cached;
+		}
+		free(fs->paths);
+		fs->paths = table;
+		fs->path_slots = slots;
+	}
+
+	char *copy = strndup(path,len);
+	if (!copy) return;
+	uint32_t mask = fs->path_slots - 1;
+	uint32_t i = hash_prefix(path,len) & mask;
+	while (fs->paths[i].path) i = (i + 1) & mask;
+	fs->paths[i].path = copy;
+	fs->paths[i].start = start;
+	fs->paths[i].blocks = blocks;
+	fs->path_count++;
+	return;
+}
+
+// Function fs_path_cache_clear, forgets every cached path
+// Anything that removes, renames or moves a directory must call this
+void fs_path_cache_clear(fs_t *fs) {
+	for (uint32_t i = 0; i < fs->path_slots; i++) free(fs->paths[i].path);
+	free(fs->paths);
+	fs->paths = NULL;
+	fs->path_slots = fs->path_count = 0;
+	return;
+}
+
+// Function normalize_path, copies a path without leading, trailing or repeated slashes
+// "/a//b/" becomes "a/b" and the root becomes ""
+static char *normalize_path(const char *path) {
+	char *norm = malloc(strlen(path) + 1);
+	if (!norm) return NULL;
+
+	size_t len = 0;
+	for (const char *c = path; *c; c++) {
+		if (*c == '/' && (len == 0 || norm[len - 1] == '/')) continue;
+		norm[len++] = *c;
+	}
+	if (len > 0 && norm[len - 1] == '/') len--;
+	norm[len] = '\0';
+	return norm;
+}
+
+// Function resolve_path, fs_resolve_path without the timing
+static int resolve_path(fs_t *fs,const char *path,int create,uint32_t *out_start,uint32_t *out_blocks) {
+	char *norm = normalize_path(path);
+	if (!norm) return 0;
+	size_t len = strlen(norm);
+
+	uint32_t current_start = fs->super_block.root_start;
+	uint32_t current_blocks = fs->super_block.root_blocks;
+
+	// Drops one component at a time from the end until a cached prefix is found
+	size_t done = len;
+	while (done > 0 && !cache_find(fs,norm,done,&current_start,&current_blocks)) {
+		while (done > 0 && norm[done - 1] != '/') done--;
+		if (done > 0) done--;
+	}
+
+	// Resolves the remaining components one directory at a time
+	size_t pos = done > 0 ? done + 1 : 0;
+	while (pos < len) {
+		size_t end = pos;
+		while (end < len && norm[end] != '/') end++;
+
+		char name[32];
+		if (end - pos >= sizeof(name)) {
+			free(norm);
+			return 0;
+		}
+		memcpy(name,norm + pos,end - pos);
+		name[end - pos] = '\0';
+
+		dir_entry_t entry;
+		if (fs_dir_lookup(fs,current_start,name,FS_ENTRY_DIR,&entry)) {
+			current_start = ntohl(entry.starting_block);
+			current_blocks = ntohl(entry.block_count);
+		} else if (create) {
+			uint32_t sub_start = fs_dir_create(fs);
+			if (sub_start == 0) {
+				free(norm);
+				return 0;
+			}
+
+			dir_entry_t new_entry = {0};
+			new_entry.status = FS_ENTRY_DIR;
+			memcpy(new_entry.name,name,strlen(name));
+			new_entry.starting_block = htonl(sub_start);
+			new_entry.block_count = htonl(1);
+			new_entry.size = htonl(0);
+			fs_fill_timestamp(&new_entry);
+
+			// A directory that cannot be entered in its parent gives its block back
+			if (!fs_dir_add(fs,current_start,&new_entry)) {
+				fs_set_next(fs,sub_start,FAT_FREE);
+				free(norm);
+				return 0;
+			}
+			current_start = sub_start;
+			current_blocks = 1;
+		} else {
+			free(norm);
+			return 0;
+		}
+
+		cache_insert(fs,norm,end,current_start,current_blocks);
+		pos = end + 1;
+	}
+
+	free(norm);
+	*out_start = current_start;
+	*out_blocks = current_blocks;
+	return 1;
+}
+
+// Function fs_resolve_path, finds the directory a path names
+// Starts from the longest prefix already in the path cache and looks up only the rest,
+// caching every prefix it resolves on the way
+// With create set, missing directories are made as it goes
+// Returns 1 if successful, 0 otherwise
+int fs_resolve_path(fs_t *fs,const char *path,int create,uint32_t *out_start,uint32_t *out_blocks) {
+	fs_timer_t timer;
+	fs_timer_start(&timer);
+	int ok = resolve_path(fs,path,create,out_start,out_blocks);
+	fs_timer_stop(FS_PHASE_RESOLVE,&timer);
+	return ok;
+}
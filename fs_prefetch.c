@@ -0,0 +1,88 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "fs.h"
+
+// Consecutive hits after which the depth is eased back
+#define HIT_STREAK 16
+
+// Function advised_bytes, how much of a run a prefetcher asks for, runs are capped at the largest depth
+static uint64_t advised_bytes(const fs_prefetch_t *pf,uint32_t run) {
+	uint64_t bytes = (uint64_t)pf->runs[run].length * pf->block_size;
+	return bytes < FS_PREFETCH_MAX ? bytes : FS_PREFETCH_MAX;
+}
+
+// Function fs_prefetch_start, sets up readahead for a walk over the runs of a chain
+// fd is the descriptor the runs will be read through
+void fs_prefetch_start(fs_prefetch_t *pf,const fs_t *fs,int fd,const fs_run_t *runs,uint32_t count) {
+	memset(pf,0,sizeof(*pf));
+	pf->fd = fd;
+	pf->block_size = fs->super_block.block_size;
+	pf->runs = runs;
+	pf->count = count;
+	pf->depth = FS_PREFETCH_MIN;
+	pf->probe = 1;
+	return;
+}
+
+// Function probe_cached, checks without blocking whether the first byte at offset is in the page cache
+// Returns 1 if it is, 0 if reading it would wait for the device, -1 if the kernel cannot tell
+static int probe_cached(int fd,off_t offset) {
+	char byte;
+	struct iovec iov = { &byte,1 };
+	ssize_t got = preadv2(fd,&iov,1,offset,RWF_NOWAIT);
+	if (got >= 0) return 1;
+	return errno == EAGAIN ? 0 : -1;
+}
+
+// Function fs_prefetch_at, called before reading a run, keeps the next depth bytes of the chain requested
+// A run that was requested earlier and is still not cached is a miss, and doubles the depth
+// A streak of hits eases the depth back, so cached walks do not keep large requests outstanding
+void fs_prefetch_at(fs_prefetch_t *pf,uint32_t run) {
+	if (run >= pf->count) return;
+	int was_advised = run > pf->current && run < pf->next;
+
+	// Runs passed since the last call no longer count as ahead
+	for (uint32_t r = pf->current + 1; r <= run && r < pf->next; r++) pf->ahead -= advised_bytes(pf,r);
+	if (pf->next <= run) {
+		pf->next = run + 1;
+		pf->ahead = 0;
+	}
+	pf->current = run;
+
+	if (pf->probe && was_advised) {
+		int cached = probe_cached(pf->fd,(off_t)pf->runs[run].start * pf->block_size);
+		if (cached < 0) {
+			pf->probe = 0;
+		} else if (cached) {
+			FS_STAT_ADD(readahead_hits,1);
+			if (++pf->streak >= HIT_STREAK) {
+				pf->streak = 0;
+				pf->depth -= pf->depth/4;
+				if (pf->depth < FS_PREFETCH_MIN) pf->depth = FS_PREFETCH_MIN;
+			}
+		} else {
+			FS_STAT_ADD(readahead_misses,1);
+			pf->streak = 0;
+			pf->depth *= 2;
+			if (pf->depth > FS_PREFETCH_MAX) pf->depth = FS_PREFETCH_MAX;
+		}
+	}
+
+	// Requests the following runs until depth bytes beyond this one are outstanding
+	while (pf->next < pf->count && pf->ahead < pf->depth) {
+		uint64_t bytes = advised_bytes(pf,pf->next);
+		posix_fadvise(pf->fd,(off_t)pf->runs[pf->next].start * pf->block_size,bytes,POSIX_FADV_WILLNEED);
+		FS_STAT_ADD(readahead_bytes,bytes);
+		pf->ahead += bytes;
+		pf->next++;
+	}
+	return;
+}
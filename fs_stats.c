@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "fs.h"
+
+// Counters shared by every thread, only touched while --stats is on
+fs_stats_t fs_stats;
+int fs_stats_enabled = 0;
+
+// Name of the tool and when it started, for the report
+static const char *stats_tool = "";
+static uint64_t stats_started = 0;
+
+// Names of the phases, in FS_PHASE_* order
+static const char *phase_names[FS_PHASE_COUNT] = {
+	"superblock","fat_load","path_resolve","dir_load","allocation","data_copy","dir_update","commit"
+};
+
+// Function clock_ns, reads a clock in nanoseconds
+static uint64_t clock_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Function print_stats, atexit handler that writes the report to standard error
+static void print_stats(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF,&usage);
+	double cpu_ms = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec/1e3 +
+		usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec/1e3;
+
+	fprintf(stderr,"{\"tool\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f,\n",stats_tool,
+		(clock_ns(CLOCK_MONOTONIC) - stats_started)/1e6,cpu_ms);
+	fprintf(stderr," \"counters\": {\"read_calls\": %llu, \"write_calls\": %llu, \"copy_calls\": %llu, "
+		"\"bytes_read\": %llu, \"bytes_written\": %llu, \"seeks\": %llu,\n",
+		(unsigned long long)fs_stats.read_calls,(unsigned long long)fs_stats.write_calls,
+		(unsigned long long)fs_stats.copy_calls,(unsigned long long)fs_stats.bytes_read,
+		(unsigned long long)fs_stats.bytes_written,(unsigned long long)fs_stats.seeks);
+	fprintf(stderr,"  \"fat_hops\": %llu, \"dir_entries_scanned\": %llu, \"blocks_allocated\": %llu, "
+		"\"blocks_freed\": %llu,\n",
+		(unsigned long long)fs_stats.fat_hops,(unsigned long long)fs_stats.dir_entries_scanned,
+		(unsigned long long)fs_stats.blocks_allocated,(unsigned long long)fs_stats.blocks_freed);
+	fprintf(stderr,"  \"readahead_bytes\": %llu, \"readahead_hits\": %llu, \"readahead_misses\": %llu},\n",
+		(unsigned long long)fs_stats.readahead_bytes,(unsigned long long)fs_stats.readahead_hits,
+		(unsigned long long)fs_stats.readahead_misses);
+	fprintf(stderr," \"phases\": {");
+	for (int p = 0; p < FS_PHASE_COUNT; p++) {
+		fprintf(stderr,"%s\n  \"%s\": {\"calls\": %llu, \"wall_ms\": %.3f, \"cpu_ms\": %.3f}",p ? "," : "",
+			phase_names[p],(unsigned long long)fs_stats.phase_calls[p],
+			fs_stats.phase_wall_ns[p]/1e6,fs_stats.phase_cpu_ns[p]/1e6);
+	}
+	fprintf(stderr,"}}\n");
+	return;
+}
+
+// Function fs_stats_init, turns statistics on if --stats is among the arguments
+// The flag is removed from argv so the tool parses the rest as usual
+// The report is written to standard error when the tool exits
+void fs_stats_init(int *argc,char *argv[]) {
+	int kept = 0;
+	for (int i = 0; i < *argc; i++) {
+		if (i > 0 && !strcmp(argv[i],"--stats")) fs_stats_enabled = 1;
+		else argv[kept++] = argv[i];
+	}
+	argv[kept] = NULL;
+	*argc = kept;
+	if (!fs_stats_enabled) return;
+
+	const char *slash = strrchr(argv[0],'/');
+	stats_tool = slash ? slash + 1 : argv[0];
+	stats_started = clock_ns(CLOCK_MONOTONIC);
+	atexit(print_stats);
+	return;
+}
+
+// Function fs_timer_start, marks the start of a phase
+void fs_timer_start(fs_timer_t *timer) {
+	if (!fs_stats_enabled) return;
+	timer->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	timer->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	return;
+}
+
+// Function fs_timer_stop, adds the time since fs_timer_start to a phase
+void fs_timer_stop(int phase,const fs_timer_t *timer) {
+	if (!fs_stats_enabled) return;
+	__atomic_fetch_add(&fs_stats.phase_calls[phase],1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&fs_stats.phase_wall_ns[phase],clock_ns(CLOCK_MONOTONIC) - timer->wall_ns,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&fs_stats.phase_cpu_ns[phase],clock_ns(CLOCK_THREAD_CPUTIME_ID) - timer->cpu_ns,
+		__ATOMIC_RELAXED);
+	return;
+}
+
+// Function fs_stats_io, counts one read, write or copy call that moved bytes
+// offset is the image position for image I/O, which also counts a seek when it does not
+// continue where the previous image access ended, or -1 for other descriptors
+void fs_stats_io(int kind,uint64_t bytes,off_t offset) {
+	if (!fs_stats_enabled) return;
+	if (kind == FS_IO_READ) __atomic_fetch_add(&fs_stats.read_calls,1,__ATOMIC_RELAXED);
+	else if (kind == FS_IO_WRITE) __atomic_fetch_add(&fs_stats.write_calls,1,__ATOMIC_RELAXED);
+	else __atomic_fetch_add(&fs_stats.copy_calls,1,__ATOMIC_RELAXED);
+	if (kind != FS_IO_WRITE) __atomic_fetch_add(&fs_stats.bytes_read,bytes,__ATOMIC_RELAXED);
+	if (kind != FS_IO_READ) __atomic_fetch_add(&fs_stats.bytes_written,bytes,__ATOMIC_RELAXED);
+	if (offset >= 0) {
+		uint64_t previous = __atomic_exchange_n(&fs_stats.next_offset,(uint64_t)offset + bytes,__ATOMIC_RELAXED);
+		if (previous != (uint64_t)offset) __atomic_fetch_add(&fs_stats.seeks,1,__ATOMIC_RELAXED);
+	}
+	return;
+}
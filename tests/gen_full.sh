@@ -0,0 +1,27 @@
+#!/bin/sh
+# Generates images until they are full and checks that what diskgen kept is consistent
+# Files and directories that no longer fit must give back the blocks they took
+# Run from the directory holding the tools, or pass it as the first argument
+set -e
+TOOLS=$(cd "${1:-.}" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+for seed in 1 2 3 4 5; do
+	for shape in "-b 512 -n 100 -R 1 -d 2 -f 2 -F 20 -s 1 -S 600" \
+		"-b 512 -n 400 -R 1 -d 3 -f 3 -F 8 -s 1 -S 4K -p 30" \
+		"-b 1024 -n 2000 -R 2 -d 2 -f 4 -F 30 -s 1K -S 64K -p 10"; do
+		"$TOOLS/diskgen" full.img $shape -r $seed > gen.txt
+		if ! grep -q "image full" gen.txt; then
+			echo "gen_full: image did not fill with $shape -r $seed"
+			exit 1
+		fi
+		if ! "$TOOLS/diskfsck" full.img > fsck.txt; then
+			echo "gen_full: diskfsck failed with $shape -r $seed"
+			cat fsck.txt
+			exit 1
+		fi
+	done
+done
+echo "gen_full: ok"
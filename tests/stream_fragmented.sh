@@ -0,0 +1,57 @@
+#!/bin/sh
+# Streams a file into an image whose free space is one large run and two small ones, then checks the image
+# The stream's second batch fits partly in the blocks after its chain, the rest has to come from elsewhere
+# Run from the directory holding the tools, or pass it as the first argument
+set -e
+TOOLS=$(cd "${1:-.}" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+# Free space starts at block 13: files of 10, 1, 15, 1, 2148 and 1812 blocks fill it in order
+"$TOOLS/diskformat" frag.img -b 4096 -n 4000 > /dev/null
+for spec in g1:10 s1:1 g2:15 s2:1 g3:2148 s3:1812; do
+	head -c $((${spec#*:} * 4096)) /dev/zero > filler
+	"$TOOLS/diskput" frag.img filler "/${spec%%:*}"
+done
+
+# Deletes g1, g2 and g3, leaving free runs of 10, 15 and 2148 blocks
+python3 - frag.img <<'PY'
+import struct, sys
+img = open(sys.argv[1], 'r+b')
+img.seek(8)
+bs, bc, fat_start, fat_blocks, root_start, root_blocks = struct.unpack('>HIIIII', img.read(22))
+for slot in range(root_blocks * bs // 64):
+	img.seek(root_start * bs + slot * 64)
+	status, start = struct.unpack('>BI', img.read(5))
+	img.seek(root_start * bs + slot * 64 + 27)
+	name = img.read(31).split(b'\0')[0]
+	if status == 0 or name not in (b'g1', b'g2', b'g3'):
+		continue
+	block = start
+	while block not in (0, 0xFFFFFFFF):
+		img.seek(fat_start * bs + block * 4)
+		(next_block,) = struct.unpack('>I', img.read(4))
+		img.seek(fat_start * bs + block * 4)
+		img.write(b'\0\0\0\0')
+		block = next_block
+	img.seek(root_start * bs + slot * 64)
+	img.write(b'\0')
+PY
+"$TOOLS/diskfsck" frag.img -y > /dev/null || true
+
+# A stream larger than the free space fails and gives back every block it took
+head -c 9437184 /dev/zero > too_big.bin
+if cat too_big.bin | "$TOOLS/diskput" frag.img - /too_big.bin 2> /dev/null; then
+	echo "stream_fragmented: oversized stream was accepted"
+	exit 1
+fi
+"$TOOLS/diskfsck" frag.img > /dev/null
+
+# 2168 blocks: 2048 in the first batch, then 100 after the chain and 20 more from the small runs
+head -c 8880128 /dev/urandom > stream.bin
+cat stream.bin | "$TOOLS/diskput" frag.img - /stream.bin
+"$TOOLS/diskfsck" frag.img
+"$TOOLS/diskget" frag.img /stream.bin copy.bin
+cmp stream.bin copy.bin
+echo "stream_fragmented: ok"